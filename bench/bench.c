@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#include <gen.h>
+#include <elf.h>
+#include <patch.h>
+#include <resolve.h>
+#include <log.h>
+
+#define BENCH_MAX_SIZES 32
+#define BENCH_PATH_MAX 4096
+// Time per symbol may grow by this much between two sizes before it's reported as a scaling problem.
+#define BENCH_MAX_GROWTH 4.0
+// Phases faster than this are too noisy to compare, in milliseconds.
+#define BENCH_MIN_MS 0.5
+
+typedef enum
+{
+	BENCH_READ,
+	BENCH_LOOKUP,
+	BENCH_INDEX,
+	BENCH_LINK,
+	BENCH_WRITE,
+	BENCH_NUM_PHASES,
+} bench_phase;
+
+static const str bench_phase_names[BENCH_NUM_PHASES] = { "read", "lookup", "index", "link", "write" };
+
+typedef struct
+{
+	gen_config cfg;
+	u32 sizes[BENCH_MAX_SIZES];
+	u32 num_sizes;
+	u32 reps;
+	str dir;
+	bool keep;
+	bool csv;
+	bool check;
+} bench_args;
+
+static f64 bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: solink_bench [flags]\n"
+		"Flags:\n"
+		"\t--syms <n,n,...>   Functions per library, one run per count. (10,100,1000,10000,100000)\n"
+		"\t--libs <count>     Libraries per corpus. (4)\n"
+		"\t--sections <count> Extra sections per file. (16)\n"
+		"\t--body <bytes>     Size of every function. (32)\n"
+		"\t--imports <count>  Functions the executable imports, 0 for as many as a library exports. (0)\n"
+		"\t--chain <length>   Functions in a row that call each other. (4)\n"
+		"\t--no-hash         Don't give libraries a .gnu.hash table.\n"
+		"\t--reps <count>     Repetitions per phase, the fastest one is reported. (5)\n"
+		"\t--dir <path>       Where to put the corpus. (a temporary directory)\n"
+		"\t--keep             Don't delete the corpus afterwards.\n"
+		"\t--csv              Write the results as CSV.\n"
+		"\t--check            Exit with 1 if any phase scales worse than expected.\n");
+}
+
+static u32 bench_number(const str arg, const str flag)
+{
+	str end;
+	const unsigned long value = strtoul(arg, &end, 10);
+	if (*end != '\0' || value > UINT32_MAX)
+	{
+		fprintf(stderr, "invalid value \"%s\" for %s\n", arg, flag);
+		exit(1);
+	}
+	return (u32)value;
+}
+
+static void bench_parse(i32 argc, str* argv, bench_args* args)
+{
+	for (i32 i = 1; i < argc; i++)
+	{
+		const str flag = argv[i];
+		if (!strcmp(flag, "--keep"))
+			args->keep = true;
+		else if (!strcmp(flag, "--csv"))
+			args->csv = true;
+		else if (!strcmp(flag, "--check"))
+			args->check = true;
+		else if (!strcmp(flag, "--no-hash"))
+			args->cfg.no_hash = true;
+		else if (!strcmp(flag, "-h") || !strcmp(flag, "--help"))
+		{
+			bench_usage();
+			exit(0);
+		}
+		else if (i + 1 >= argc)
+		{
+			bench_usage();
+			exit(1);
+		}
+		else if (!strcmp(flag, "--syms"))
+		{
+			args->num_sizes = 0;
+			char* save;
+			for (str tok = strtok_r(argv[++i], ",", &save); tok && args->num_sizes < BENCH_MAX_SIZES; tok = strtok_r(NULL, ",", &save))
+				args->sizes[args->num_sizes++] = bench_number(tok, flag);
+		}
+		else if (!strcmp(flag, "--libs"))
+			args->cfg.num_libs = (u16)bench_number(argv[++i], flag);
+		else if (!strcmp(flag, "--sections"))
+			args->cfg.num_sections = (u16)bench_number(argv[++i], flag);
+		else if (!strcmp(flag, "--body"))
+			args->cfg.body_size = bench_number(argv[++i], flag);
+		else if (!strcmp(flag, "--imports"))
+			args->cfg.num_imports = bench_number(argv[++i], flag);
+		else if (!strcmp(flag, "--chain"))
+			args->cfg.chain = bench_number(argv[++i], flag);
+		else if (!strcmp(flag, "--reps"))
+			args->reps = bench_number(argv[++i], flag);
+		else if (!strcmp(flag, "--dir"))
+			args->dir = argv[++i];
+		else
+		{
+			bench_usage();
+			exit(1);
+		}
+	}
+	if (!args->cfg.num_libs || !args->reps || !args->num_sizes)
+	{
+		fprintf(stderr, "--libs, --reps and --syms need to be at least 1\n");
+		exit(1);
+	}
+}
+
+static i32 bench_unlink(const char* path, const struct stat* st, i32 flag, struct FTW* ftw)
+{
+	(void)st; (void)flag; (void)ftw;
+	return remove(path);
+}
+
+// Runs all phases on one corpus. Every phase is repeated and the fastest time is kept.
+static void bench_run(const bench_args* args, const gen_config* cfg, f64 times[BENCH_NUM_PHASES])
+{
+	char exe_path[BENCH_PATH_MAX], out_path[BENCH_PATH_MAX];
+	str* lib_paths = calloc(cfg->num_libs, sizeof(str));
+	for (u16 i = 0; i < cfg->num_libs; i++)
+	{
+		lib_paths[i] = malloc(BENCH_PATH_MAX);
+		snprintf(lib_paths[i], BENCH_PATH_MAX, "%s/libbench%hu.so", args->dir, i);
+		if (!gen_library(lib_paths[i], cfg, i))
+			log_msg(LOG_ERR, "couldn't write \"%s\"!\n", lib_paths[i]);
+	}
+	snprintf(exe_path, sizeof(exe_path), "%s/bench_exe", args->dir);
+	snprintf(out_path, sizeof(out_path), "%s/bench_out", args->dir);
+	if (!gen_executable(exe_path, cfg))
+		log_msg(LOG_ERR, "couldn't write \"%s\"!\n", exe_path);
+
+	for (u32 p = 0; p < BENCH_NUM_PHASES; p++)
+		times[p] = 1e300;
+	elf_obj* libs = calloc(cfg->num_libs, sizeof(elf_obj));
+	resolve_lib* exports = calloc(cfg->num_libs, sizeof(resolve_lib));
+
+	for (u32 rep = 0; rep < args->reps; rep++)
+	{
+		// Reading all inputs.
+		f64 start = bench_now();
+		for (u16 i = 0; i < cfg->num_libs; i++)
+			libs[i] = elf_read(lib_paths[i]);
+		elf_obj target = elf_read(exe_path);
+		f64 end = bench_now();
+		times[BENCH_READ] = end - start < times[BENCH_READ] ? end - start : times[BENCH_READ];
+
+		// Looking up every import in every library until one provides it.
+		arena mem = {0};
+		start = bench_now();
+		str* names;
+		const size num_names = patch_get_symbols(&target, &mem, &names);
+		size found = 0;
+		for (size n = 0; n < num_names; n++)
+		{
+			for (u16 i = 0; names[n] && i < cfg->num_libs; i++)
+			{
+				if (patch_find_sym(libs + i, names[n]))
+				{
+					found++;
+					break;
+				}
+			}
+		}
+		end = bench_now();
+		times[BENCH_LOOKUP] = end - start < times[BENCH_LOOKUP] ? end - start : times[BENCH_LOOKUP];
+		arena_free(&mem);
+		if (found != num_names - 1)
+			log_msg(LOG_WARN, "only found %zu of %zu imports\n", found, num_names - 1);
+
+		// Collecting all exports and building the resolution index.
+		start = bench_now();
+		for (u16 i = 0; i < cfg->num_libs; i++)
+			exports[i] = resolve_lib_exports(libs + i);
+		resolve_index index = resolve_build(libs, exports, cfg->num_libs);
+		end = bench_now();
+		times[BENCH_INDEX] = end - start < times[BENCH_INDEX] ? end - start : times[BENCH_INDEX];
+
+		// Linking everything the target calls.
+		start = bench_now();
+		patch_link_library(&target, &index);
+		end = bench_now();
+		times[BENCH_LINK] = end - start < times[BENCH_LINK] ? end - start : times[BENCH_LINK];
+
+		// Writing the result.
+		start = bench_now();
+		elf_write(out_path, &target);
+		end = bench_now();
+		times[BENCH_WRITE] = end - start < times[BENCH_WRITE] ? end - start : times[BENCH_WRITE];
+
+		resolve_free(&index);
+		for (u16 i = 0; i < cfg->num_libs; i++)
+		{
+			resolve_lib_free(exports + i);
+			elf_free(libs + i);
+		}
+		elf_free(&target);
+	}
+
+	for (u16 i = 0; i < cfg->num_libs; i++)
+		free(lib_paths[i]);
+	free(lib_paths);
+	free(libs);
+	free(exports);
+}
+
+i32 main(i32 argc, str* argv)
+{
+	bench_args args = {
+		.cfg = {
+			.num_libs = 4,
+			.num_sections = 16,
+			.body_size = 32,
+			.chain = 4,
+		},
+		.sizes = { 10, 100, 1000, 10000, 100000 },
+		.num_sizes = 5,
+		.reps = 5,
+	};
+	bench_parse(argc, argv, &args);
+
+	char tmp_dir[] = "/tmp/solink_bench.XXXXXX";
+	const bool own_dir = !args.dir;
+	if (own_dir && !(args.dir = mkdtemp(tmp_dir)))
+		log_msg(LOG_ERR, "couldn't create a directory for the corpus!\n");
+
+	// Linking reports every function, only the results are interesting here.
+	log_quiet = true;
+
+	if (args.csv)
+		printf("syms,libs,imports,phase,ms,ns_per_sym\n");
+	else
+	{
+		printf("%8s %8s", "syms", "imports");
+		for (u32 p = 0; p < BENCH_NUM_PHASES; p++)
+			printf(" %10s(ms) %8s", bench_phase_names[p], "ns/sym");
+		printf("\n");
+	}
+
+	bool scaling_ok = true;
+	f64 prev[BENCH_NUM_PHASES] = {0};
+	u32 prev_syms = 0;
+	for (u32 s = 0; s < args.num_sizes; s++)
+	{
+		gen_config cfg = args.cfg;
+		cfg.num_syms = args.sizes[s];
+		if (!cfg.num_imports)
+			cfg.num_imports = cfg.num_syms;
+		const u64 imports = cfg.num_imports < (u64)cfg.num_syms * cfg.num_libs ? cfg.num_imports : (u64)cfg.num_syms * cfg.num_libs;
+		// Every phase scales with the amount of symbols in the corpus.
+		const u64 total = (u64)cfg.num_syms * cfg.num_libs + imports;
+
+		f64 times[BENCH_NUM_PHASES];
+		bench_run(&args, &cfg, times);
+
+		if (!args.csv)
+			printf("%8u %8lu", cfg.num_syms, imports);
+		for (u32 p = 0; p < BENCH_NUM_PHASES; p++)
+		{
+			const f64 per_sym = total ? times[p] * 1e6 / total : 0;
+			if (args.csv)
+				printf("%u,%hu,%lu,%s,%.4f,%.2f\n", cfg.num_syms, cfg.num_libs, imports, bench_phase_names[p], times[p], per_sym);
+			else
+				printf(" %14.3f %8.1f", times[p], per_sym);
+
+			// Linear phases keep about the same time per symbol, anything growing a lot more is worth a look.
+			if (prev_syms && prev[p] > 0 && times[p] >= BENCH_MIN_MS && per_sym > prev[p] * BENCH_MAX_GROWTH)
+			{
+				fprintf(stderr, "warning: %s went from %.1f to %.1f ns per symbol between %u and %u symbols\n",
+					bench_phase_names[p], prev[p], per_sym, prev_syms, cfg.num_syms);
+				scaling_ok = false;
+			}
+			prev[p] = per_sym;
+		}
+		if (!args.csv)
+			printf("\n");
+		fflush(stdout);
+		prev_syms = cfg.num_syms;
+	}
+
+	if (own_dir && !args.keep)
+		nftw(args.dir, bench_unlink, 16, FTW_DEPTH | FTW_PHYS);
+	return args.check && !scaling_ok ? 1 : 0;
+}
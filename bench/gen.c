@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gen.h>
+#include <elf.h>
+
+// ELF64 file header, as it's laid out on disk.
+typedef struct
+{
+	u8 e_ident[16];
+	u16 e_type;
+	u16 e_machine;
+	u32 e_version;
+	u64 e_entry;
+	u64 e_phoff;
+	u64 e_shoff;
+	u32 e_flags;
+	u16 e_ehsize;
+	u16 e_phentsize;
+	u16 e_phnum;
+	u16 e_shentsize;
+	u16 e_shnum;
+	u16 e_shstrndx;
+} gen_ehdr;
+
+typedef struct
+{
+	str name;
+	elf_section_header header;
+	u8* data;
+} gen_section;
+
+// A file that's being put together, section by section.
+typedef struct
+{
+	u16 num_sections;
+	u16 cap;
+	gen_section* sections;
+} gen_file;
+
+static u16 gen_section_add(gen_file* file, str name, u32 type, u64 flags, u8* data, u64 len, u64 align, u64 entsize)
+{
+	if (file->num_sections == file->cap)
+	{
+		file->cap = file->cap ? file->cap * 2 : 16;
+		file->sections = reallocarray(file->sections, file->cap, sizeof(gen_section));
+	}
+	file->sections[file->num_sections] = (gen_section) {
+		.name = strdup(name),
+		.header = {
+			.sh_type = type,
+			.sh_flags = flags,
+			.sh_size = len,
+			.sh_addralign = align,
+			.sh_entsize = entsize,
+		},
+		.data = data,
+	};
+	return file->num_sections++;
+}
+
+// Assigns every section a place in the file and its address, as long as everything fits into one PT_LOAD.
+static void gen_layout(gen_file* file, u64* end)
+{
+	u64 pos = sizeof(gen_ehdr) + sizeof(elf_program_header);
+	for (u16 i = 1; i < file->num_sections; i++)
+	{
+		elf_section_header* h = &file->sections[i].header;
+		const u64 align = h->sh_addralign ? h->sh_addralign : 1;
+		pos = ALIGN(pos, align);
+		h->sh_offset = pos;
+		// SHF_ALLOC
+		h->sh_addr = h->sh_flags & 2 ? pos : 0;
+		pos += h->sh_size;
+	}
+	*end = pos;
+}
+
+// Adds the section name table, then writes the whole file.
+static bool gen_write(gen_file* file, const str path, u16 type)
+{
+	// Extra sections are never loaded, the rest lives in one segment.
+	size names_len = 1;
+	for (u16 i = 1; i < file->num_sections; i++)
+		names_len += strlen(file->sections[i].name) + 1;
+	names_len += sizeof(".shstrtab");
+	char* names = calloc(1, names_len);
+	const u16 shstrndx = gen_section_add(file, ".shstrtab", SHT_STRTAB, 0, (u8*)names, names_len, 1, 0);
+	size pos = 1;
+	for (u16 i = 1; i < file->num_sections; i++)
+	{
+		file->sections[i].header.sh_name = pos;
+		pos += sprintf(names + pos, "%s", file->sections[i].name) + 1;
+	}
+
+	u64 end;
+	gen_layout(file, &end);
+	u64 load_end = 0;
+	for (u16 i = 1; i < file->num_sections; i++)
+	{
+		const elf_section_header* h = &file->sections[i].header;
+		if (h->sh_flags & 2 && h->sh_offset + h->sh_size > load_end)
+			load_end = h->sh_offset + h->sh_size;
+	}
+	const u64 shoff = ALIGN(end, 8);
+	const size total = shoff + file->num_sections * sizeof(elf_section_header);
+
+	u8* buf = calloc(1, total);
+	gen_ehdr* ehdr = (gen_ehdr*)buf;
+	*ehdr = (gen_ehdr) {
+		.e_ident = { 0x7f, 'E', 'L', 'F', 2, 1, 1 },
+		.e_type = type,
+		.e_machine = EM_X86_64,
+		.e_version = 1,
+		.e_phoff = sizeof(gen_ehdr),
+		.e_shoff = shoff,
+		.e_ehsize = sizeof(gen_ehdr),
+		.e_phentsize = sizeof(elf_program_header),
+		.e_phnum = 1,
+		.e_shentsize = sizeof(elf_section_header),
+		.e_shnum = file->num_sections,
+		.e_shstrndx = shstrndx,
+	};
+	// PT_LOAD, readable and executable.
+	const elf_program_header load = {
+		.p_type = 1,
+		.p_flags = 5,
+		.p_filesz = load_end,
+		.p_memsz = load_end,
+		.p_align = 0x1000,
+	};
+	memcpy(buf + sizeof(gen_ehdr), &load, sizeof(load));
+
+	elf_section_header* shdrs = (elf_section_header*)(buf + shoff);
+	for (u16 i = 0; i < file->num_sections; i++)
+	{
+		shdrs[i] = file->sections[i].header;
+		if (i && file->sections[i].data)
+			memcpy(buf + shdrs[i].sh_offset, file->sections[i].data, shdrs[i].sh_size);
+		free(file->sections[i].data);
+		free(file->sections[i].name);
+	}
+
+	FILE* f = fopen(path, "wb");
+	const bool ok = f && fwrite(buf, 1, total, f) == total;
+	if (f)
+		fclose(f);
+	free(buf);
+	free(file->sections);
+	return ok;
+}
+
+// Adds unused sections that only make the section table longer.
+static void gen_extra_sections(gen_file* file, const gen_config* cfg)
+{
+	char name[16];
+	for (u16 i = 0; i < cfg->num_sections && file->num_sections < UINT16_MAX - 2; i++)
+	{
+		snprintf(name, sizeof(name), ".bench.%hu", i);
+		u8* data = malloc(64);
+		memset(data, i & 0xff, 64);
+		gen_section_add(file, name, SHT_PROGBITS, 0, data, 64, 8, 0);
+	}
+}
+
+void gen_symbol_name(char* buf, size buf_size, u16 lib, u32 sym)
+{
+	snprintf(buf, buf_size, "bench_lib%hu_function_%u", lib, sym);
+}
+
+// Puts all symbol names into a string table. Returns the offset of every name.
+static char* gen_strtab(u32 num, u16 lib, const u32* order, u32* offsets, size* len)
+{
+	char name[64];
+	*len = 1;
+	for (u32 i = 0; i < num; i++)
+	{
+		gen_symbol_name(name, sizeof(name), lib, order ? order[i] : i);
+		*len += strlen(name) + 1;
+	}
+	char* strtab = calloc(1, *len);
+	size pos = 1;
+	for (u32 i = 0; i < num; i++)
+	{
+		offsets[i] = pos;
+		gen_symbol_name(name, sizeof(name), lib, order ? order[i] : i);
+		pos += sprintf(strtab + pos, "%s", name) + 1;
+	}
+	return strtab;
+}
+
+typedef struct
+{
+	u32 sym;
+	u32 hash;
+	u32 bucket;
+} gen_hashed;
+
+static i32 gen_cmp_bucket(const void* a, const void* b)
+{
+	const gen_hashed* x = a;
+	const gen_hashed* y = b;
+	if (x->bucket != y->bucket)
+		return x->bucket < y->bucket ? -1 : 1;
+	return x->sym < y->sym ? -1 : x->sym > y->sym;
+}
+
+bool gen_library(const str path, const gen_config* cfg, u16 lib)
+{
+	const u32 num = cfg->num_syms;
+	const u32 body = cfg->body_size ? cfg->body_size : 1;
+	gen_file file = {0};
+	gen_section_add(&file, "", SHT_NULL, 0, NULL, 0, 0, 0);
+
+	// The GNU hash table requires symbols to be ordered by bucket.
+	const u32 num_buckets = num / 4 + 1;
+	const u32 bloom_size = 1u << (31 - __builtin_clz(num / 32 + 1));
+	const u32 bloom_shift = 6;
+	gen_hashed* hashed = malloc((num ? num : 1) * sizeof(gen_hashed));
+	char name[64];
+	for (u32 i = 0; i < num; i++)
+	{
+		gen_symbol_name(name, sizeof(name), lib, i);
+		hashed[i].sym = i;
+		hashed[i].hash = elf_gnu_hash(name);
+		hashed[i].bucket = hashed[i].hash % num_buckets;
+	}
+	qsort(hashed, num, sizeof(gen_hashed), gen_cmp_bucket);
+
+	const size hash_len = (4 + bloom_size * 2 + num_buckets + num) * sizeof(u32);
+	u32* gnu_hash = calloc(1, hash_len);
+	gnu_hash[0] = num_buckets;
+	gnu_hash[1] = 1; // The null symbol isn't hashed.
+	gnu_hash[2] = bloom_size;
+	gnu_hash[3] = bloom_shift;
+	u64* bloom = (u64*)(gnu_hash + 4);
+	u32* buckets = gnu_hash + 4 + bloom_size * 2;
+	u32* chain = buckets + num_buckets;
+	for (u32 i = 0; i < num; i++)
+	{
+		const u32 h = hashed[i].hash;
+		bloom[(h / 64) % bloom_size] |= (1ull << (h % 64)) | (1ull << ((h >> bloom_shift) % 64));
+		if (!buckets[hashed[i].bucket])
+			buckets[hashed[i].bucket] = i + 1;
+		// The lowest bit marks the last symbol of a bucket.
+		const bool last = i + 1 == num || hashed[i + 1].bucket != hashed[i].bucket;
+		chain[i] = (h & ~1u) | last;
+	}
+
+	u32* order = malloc((num ? num : 1) * sizeof(u32));
+	for (u32 i = 0; i < num; i++)
+		order[i] = hashed[i].sym;
+	u32* name_offsets = malloc((num ? num : 1) * sizeof(u32));
+	size strtab_len;
+	char* strtab = gen_strtab(num, lib, order, name_offsets, &strtab_len);
+
+	// Function bodies are a call to the next function of the chain, then padding and a return.
+	u8* text = malloc((size)num * body);
+	memset(text, 0x90, (size)num * body); // nop
+	for (u32 i = 0; i < num; i++)
+	{
+		u8* code = text + (size)i * body;
+		if (cfg->chain > 1 && i % cfg->chain != cfg->chain - 1 && i + 1 < num && body >= 6)
+		{
+			code[0] = 0xe8; // call rel32
+			const i32 rel = (i32)(body - 5);
+			memcpy(code + 1, &rel, sizeof(rel));
+		}
+		code[body - 1] = 0xc3; // ret
+	}
+
+	// Without a hash table, lookups have to scan .dynsym, like in stripped vendor libraries.
+	const u16 hash_idx = cfg->no_hash ? 0 : gen_section_add(&file, ".gnu.hash", SHT_GNU_HASH, 2, (u8*)gnu_hash, hash_len, 8, 0);
+	const u16 dynsym_idx = gen_section_add(&file, ".dynsym", SHT_DYNSYM, 2, NULL, ((size)num + 1) * sizeof(elf_symtab), 8, sizeof(elf_symtab));
+	const u16 dynstr_idx = gen_section_add(&file, ".dynstr", SHT_STRTAB, 2, (u8*)strtab, strtab_len, 1, 0);
+	// SHF_ALLOC | SHF_EXECINSTR
+	const u16 text_idx = gen_section_add(&file, ".text", SHT_PROGBITS, 6, text, (size)num * body, 16, 0);
+	if (hash_idx)
+		file.sections[hash_idx].header.sh_link = dynsym_idx;
+	else
+		free(gnu_hash);
+	file.sections[dynsym_idx].header.sh_link = dynstr_idx;
+	file.sections[dynsym_idx].header.sh_info = 1;
+	gen_extra_sections(&file, cfg);
+
+	// Symbols point into .text, so it needs its address first.
+	u64 end;
+	gen_layout(&file, &end);
+	const u64 text_addr = file.sections[text_idx].header.sh_addr;
+	elf_symtab* syms = calloc((size)num + 1, sizeof(elf_symtab));
+	for (u32 i = 0; i < num; i++)
+	{
+		syms[i + 1] = (elf_symtab) {
+			.sym_name = name_offsets[i],
+			.sym_info = 0x12, // STB_GLOBAL | STT_FUNC
+			.sym_shndx = text_idx,
+			.sym_value = text_addr + (u64)order[i] * body,
+			.sym_size = body,
+		};
+	}
+	file.sections[dynsym_idx].data = (u8*)syms;
+
+	free(hashed);
+	free(order);
+	free(name_offsets);
+	return gen_write(&file, path, 3); // ET_DYN
+}
+
+bool gen_executable(const str path, const gen_config* cfg)
+{
+	// Spread the imports evenly over all libraries, but never import a function twice.
+	const u64 available = (u64)cfg->num_syms * cfg->num_libs;
+	const u32 num = cfg->num_imports < available ? cfg->num_imports : (u32)available;
+	gen_file file = {0};
+	gen_section_add(&file, "", SHT_NULL, 0, NULL, 0, 0, 0);
+
+	char name[64];
+	size strtab_len = 1;
+	for (u32 i = 0; i < num; i++)
+	{
+		gen_symbol_name(name, sizeof(name), i % cfg->num_libs, i / cfg->num_libs);
+		strtab_len += strlen(name) + 1;
+	}
+	char* strtab = calloc(1, strtab_len);
+	elf_symtab* syms = calloc((size)num + 1, sizeof(elf_symtab));
+	size pos = 1;
+	for (u32 i = 0; i < num; i++)
+	{
+		gen_symbol_name(name, sizeof(name), i % cfg->num_libs, i / cfg->num_libs);
+		syms[i + 1] = (elf_symtab) {
+			.sym_name = pos,
+			.sym_info = 0x12, // STB_GLOBAL | STT_FUNC, undefined
+		};
+		pos += sprintf(strtab + pos, "%s", name) + 1;
+	}
+
+	// PLT0 followed by one stub per import: jmp *got(%rip); push $idx; jmp PLT0.
+	u8* plt = calloc((size)num + 1, 16);
+	for (u32 i = 0; i < num; i++)
+	{
+		u8* stub = plt + ((size)i + 1) * 16;
+		const u8 code[16] = { 0xff, 0x25, 0, 0, 0, 0, 0x68, i & 0xff, (i >> 8) & 0xff, (i >> 16) & 0xff, i >> 24, 0xe9, 0, 0, 0, 0 };
+		memcpy(stub, code, sizeof(code));
+	}
+	u8* got = calloc((size)num + 3, sizeof(u64));
+	elf_rela* rela = calloc(num ? num : 1, sizeof(elf_rela));
+	u8* text = malloc(16);
+	memset(text, 0x90, 16); // nop
+	text[15] = 0xc3; // ret
+
+	const u16 dynsym_idx = gen_section_add(&file, ".dynsym", SHT_DYNSYM, 2, (u8*)syms, ((size)num + 1) * sizeof(elf_symtab), 8, sizeof(elf_symtab));
+	const u16 dynstr_idx = gen_section_add(&file, ".dynstr", SHT_STRTAB, 2, (u8*)strtab, strtab_len, 1, 0);
+	const u16 rela_idx = gen_section_add(&file, ".rela.plt", SHT_RELA, 2, (u8*)rela, (size)num * sizeof(elf_rela), 8, sizeof(elf_rela));
+	gen_section_add(&file, ".plt", SHT_PROGBITS, 6, plt, ((size)num + 1) * 16, 16, 16);
+	gen_section_add(&file, ".text", SHT_PROGBITS, 6, text, 16, 16, 0);
+	const u16 got_idx = gen_section_add(&file, ".got.plt", SHT_PROGBITS, 3, got, ((size)num + 3) * sizeof(u64), 8, 8);
+	file.sections[dynsym_idx].header.sh_link = dynstr_idx;
+	file.sections[dynsym_idx].header.sh_info = 1;
+	file.sections[rela_idx].header.sh_link = dynsym_idx;
+	gen_extra_sections(&file, cfg);
+
+	// Every JUMP_SLOT points at its GOT entry, the first three belong to the dynamic linker.
+	u64 end;
+	gen_layout(&file, &end);
+	const u64 got_addr = file.sections[got_idx].header.sh_addr;
+	for (u32 i = 0; i < num; i++)
+		rela[i] = (elf_rela) { got_addr + ((u64)i + 3) * sizeof(u64), ((u64)(i + 1) << 32) | R_X86_64_JUMP_SLOT, 0 };
+
+	return gen_write(&file, path, 3); // ET_DYN
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <types.h>
+
+/// Shape of a synthetic corpus.
+typedef struct
+{
+	/// The amount of functions every library exports.
+	u32 num_syms;
+	/// The amount of libraries.
+	u16 num_libs;
+	/// The amount of extra, unused sections in every file.
+	u16 num_sections;
+	/// The size of every function body in bytes.
+	u32 body_size;
+	/// The amount of functions the executable calls through its PLT.
+	u32 num_imports;
+	/// The length of call chains inside of a library. Every function calls the next one, except for the last of a chain.
+	u32 chain;
+	/// Leave out `.gnu.hash`, so symbols can only be found by scanning `.dynsym`.
+	bool no_hash;
+} gen_config;
+
+/// \brief                  Gets the name of a function of the corpus.
+/// \param  [out]   buf     The buffer to write the name to.
+/// \param          buf_size The size of `buf`.
+/// \param          lib     The library the function lives in.
+/// \param          sym     The index of the function in the library.
+void gen_symbol_name(char* buf, size buf_size, u16 lib, u32 sym);
+
+/// \brief                  Writes a shared object exporting `num_syms` functions, with a GNU hash table unless `no_hash` is set.
+/// \param  [in]    path    The path to write to.
+/// \param  [in]    cfg     The shape of the corpus.
+/// \param          lib     The index of the library in the corpus.
+/// \returns                `true` if successful, otherwise `false`.
+bool gen_library(const str path, const gen_config* cfg, u16 lib);
+
+/// \brief                  Writes an executable importing `num_imports` functions spread over all libraries.
+/// \param  [in]    path    The path to write to.
+/// \param  [in]    cfg     The shape of the corpus.
+/// \returns                `true` if successful, otherwise `false`.
+bool gen_executable(const str path, const gen_config* cfg);
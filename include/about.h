@@ -2,10 +2,26 @@
 
 #define SOLINK_ABOUT_TEXT "solink " SOLINK_VER_MAJ "." SOLINK_VER_MIN " (" SOLINK_VER_PATCH ")\n"
 #define SOLINK_HELP_TEXT "Usage: solink [flags] [lib(s)] <target>\n" \
+	"       solink [flags] --batch <manifest> [lib(s)]\n" \
+	"       solink [flags] --serve <socket>\n" \
 	"Flags:\n" \
 	"\t-o, --output <file path> Save the resulting binary at the given location.\n" \
 	"\t-s, --symbol <symbol>    Only match the given symbol.\n" \
+	"\t-j, --jobs <count>       Load files and copy functions on up to <count> threads.\n" \
+	"\t-b, --batch <manifest>   Link every (target, output) pair listed in the manifest.\n" \
+	"\t--serve <socket>         Keep libraries loaded and link requests sent to <socket>.\n" \
+	"\t--client <socket>        Let the server listening on <socket> do the linking.\n" \
 	"\t-f, --force              Forcefully match all external symbols.\n" \
+	"\t--no-cache               Don't use or update the library symbol cache.\n" \
+	"\t--no-incremental         Always relink from scratch and don't record a link manifest.\n" \
+	"\t--direct-calls           Make calls of the target go straight to the copied functions, not through the PLT.\n" \
+	"\t--profile <file>         Put the functions that ran most often in <file> first.\n" \
+	"\t--static-bind            Remove the imports a link satisfied, and libraries that aren't needed anymore.\n" \
+	"\t--hugepage-align         Map the copied functions so they can be backed by 2 MiB pages.\n" \
+	"\t--fold-identical         Copy functions with identical code only once.\n" \
+	"\t-w, --watch              Relink whenever one of the input files changes.\n" \
+	"\t--stats[=json]           Report the time spent in each phase and other counters after linking.\n" \
+	"\t--trace <file>           Write a timeline of the link to <file> as Chrome trace events.\n" \
 	"\t-q, --quiet              Don't write any messages to the standard output.\n" \
 	"\t--relax                  Don't write any warnings to the standard output.\n" \
 	"\t-v, --version            Write the version to standard output.\n" \
@@ -0,0 +1,38 @@
+#pragma once
+#include <types.h>
+
+typedef struct arena_block arena_block;
+
+/// A region allocator. Everything allocated from an arena is released at once by `arena_free`.
+typedef struct
+{
+	arena_block* head;
+	/// The last allocation, which can still grow in place.
+	void* last;
+} arena;
+
+/// \brief                  Allocates memory from an arena. The memory is aligned to 16 bytes.
+/// \param  [in]    mem     The arena to allocate from.
+/// \param          len     The amount of bytes to allocate.
+/// \returns                A pointer to the allocated memory.
+void* arena_alloc(arena* mem, size len);
+
+/// \brief                  Allocates zero-initialized memory for an array from an arena.
+/// \param  [in]    mem     The arena to allocate from.
+/// \param          num     The amount of elements.
+/// \param          len     The size of a single element.
+/// \returns                A pointer to the allocated memory.
+void* arena_calloc(arena* mem, size num, size len);
+
+/// \brief                  Resizes an allocation. Grows in place if `ptr` was the last allocation from this arena,
+///                         otherwise the contents get copied to a new allocation.
+/// \param  [in]    mem     The arena `ptr` was allocated from.
+/// \param  [in]    ptr     The allocation to resize, or `NULL`.
+/// \param          old_len The current size of the allocation.
+/// \param          new_len The requested size of the allocation.
+/// \returns                A pointer to the resized memory.
+void* arena_realloc(arena* mem, void* ptr, size old_len, size new_len);
+
+/// \brief                  Releases all memory allocated from an arena.
+/// \param  [in]    mem     The arena to free.
+void arena_free(arena* mem);
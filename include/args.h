@@ -6,9 +6,24 @@ typedef struct
 	u16 num_files;
 	str* files;
 	str output;
+	str batch;
+	str serve;
+	str client;
+	str trace;
+	str profile;
 	u32 num_symbols;
 	str* symbols;
+	u16 jobs;
 	bool force;
+	bool no_cache;
+	bool no_incremental;
+	bool direct_calls;
+	bool static_bind;
+	bool hugepage_align;
+	bool fold_identical;
+	bool watch;
+	bool stats;
+	bool stats_json;
 	bool version;
 	bool help;
 } arguments;
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <elf.h>
+#include <resolve.h>
+#include <types.h>
+
+/// \brief                  Resolves, links and writes a single target against the indexed libraries.
+///                         All libraries something gets linked from are read if they only came from the cache.
+/// \param  [in]    target  The ELF to link.
+/// \param  [in]    index   The resolution index of all libraries.
+/// \param  [in]    output  The path to write the linked binary to.
+/// \returns                `true` if successful, otherwise `false`.
+bool batch_link_one(elf_obj* target, const resolve_index* index, const str output);
+
+/// \brief                  Links every target listed in a manifest against the same libraries, using up to `jobs` threads.
+///                         Each line of the manifest holds the path of a target and the path of its output,
+///                         separated by whitespace. Empty lines and lines starting with `#` are ignored.
+///                         Messages are reported per target in manifest order, followed by a summary.
+/// \param  [in]    manifest The path of the manifest.
+/// \param  [in]    index   The resolution index of all libraries. All libraries must be read already.
+/// \param          jobs    The maximum amount of threads to use.
+/// \returns                `true` if all targets were linked successfully, otherwise `false`.
+bool batch_link(const str manifest, const resolve_index* index, u16 jobs);
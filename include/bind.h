@@ -0,0 +1,19 @@
+#pragma once
+#include <elf.h>
+#include <patch.h>
+#include <resolve.h>
+#include <types.h>
+
+/// \brief                  Removes every import of the target that a link satisfied, so the dynamic linker doesn't
+///                         have to look it up at startup anymore:
+///                         - Their `.rela.plt` entries are removed and the lazy binding stubs renumbered.
+///                           Other relocations against them become `R_X86_64_RELATIVE` to the copy.
+///                         - Their symbols are removed from `.dynsym` and `.gnu.version`, `.gnu.hash` and `.hash`
+///                           follow the new symbol indices.
+///                         - Libraries that only provided such imports lose their `DT_NEEDED` entry and version needs.
+///                         All tables shrink in place. Only supported for x86-64 targets.
+/// \param  [in]    session The link, after all functions were copied.
+/// \param  [in]    target  The ELF the link went to.
+/// \param  [in]    index   The resolution index of all libraries of the link.
+/// \returns                `true` if successful, otherwise `false`. Nothing gets changed on failure.
+bool bind_static(patch_session* session, elf_obj* target, const resolve_index* index);
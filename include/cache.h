@@ -0,0 +1,33 @@
+#pragma once
+
+#include <resolve.h>
+#include <types.h>
+
+/// Identifies the contents of a file without reading it.
+typedef struct
+{
+	u64 dev;
+	u64 ino;
+	u64 size;
+	i64 mtime_sec;
+	i64 mtime_nsec;
+} cache_stamp;
+
+/// \brief                  Gets the identity of a file, see `cache_stamp`.
+/// \param  [in]    path    The path of the file.
+/// \param  [out]   stamp   The stamp to fill.
+/// \returns                `true` if successful, `false` if the file couldn't be accessed.
+bool cache_stamp_get(const str path, cache_stamp* stamp);
+
+/// \brief                  Loads the exported symbols of a library from the on-disk cache.
+///                         Entries are only used if the library's path, inode, size and modification time still match.
+/// \param  [in]    path    The path of the library.
+/// \param  [out]   exports The symbol list to load into. Its symbols point into a mapping of the cache entry.
+/// \returns                `true` if a valid cache entry was found, otherwise `false`.
+bool cache_load(const str path, resolve_lib* exports);
+
+/// \brief                  Stores the exported symbols of a library in the on-disk cache.
+///                         Failing to write the cache is not an error, the entry is just skipped.
+/// \param  [in]    path    The path of the library.
+/// \param  [in]    exports The symbols to store.
+void cache_store(const str path, const resolve_lib* exports);
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 
 #include <types.h>
+#include <arena.h>
 
 typedef enum {
 	EM_NONE         = 0,
@@ -13,6 +14,35 @@ typedef enum {
 	EM_RISCV        = 243
 } elf_machine;
 
+typedef enum {
+	SHT_NULL        = 0,
+	SHT_PROGBITS    = 1,
+	SHT_SYMTAB      = 2,
+	SHT_STRTAB      = 3,
+	SHT_RELA        = 4,
+	SHT_HASH        = 5,
+	SHT_DYNAMIC     = 6,
+	SHT_NOTE        = 7,
+	SHT_NOBITS      = 8,
+	SHT_REL         = 9,
+	SHT_DYNSYM      = 11,
+	SHT_GNU_HASH    = 0x6ffffff6,
+	SHT_GNU_VERDEF  = 0x6ffffffd,
+	SHT_GNU_VERNEED = 0x6ffffffe,
+	SHT_GNU_VERSYM  = 0x6fffffff
+} elf_section_type;
+
+typedef enum {
+	PT_NULL         = 0,
+	PT_LOAD         = 1,
+	PT_DYNAMIC      = 2,
+	PT_INTERP       = 3,
+	PT_NOTE         = 4,
+	PT_PHDR         = 6,
+	PT_TLS          = 7
+} elf_segment_type;
+
+/// A symbol in the ELF64 layout. Tables of ELF32 files or of another byte order get decoded to it, see `elf_symbols`.
 typedef struct
 {
 	u32 sym_name;
@@ -23,6 +53,52 @@ typedef struct
 	u64 sym_size;
 } __attribute__((packed)) elf_symtab;
 
+typedef enum {
+	R_X86_64_NONE      = 0,
+	R_X86_64_64        = 1,
+	R_X86_64_PC32      = 2,
+	R_X86_64_PLT32     = 4,
+	R_X86_64_GLOB_DAT  = 6,
+	R_X86_64_JUMP_SLOT = 7,
+	R_X86_64_RELATIVE  = 8
+} elf_reloc_type;
+
+/// A relocation in the ELF64 layout, see `elf_relocs`.
+typedef struct
+{
+	u64 r_offset;
+	u64 r_info;
+	i64 r_addend;
+} elf_rela;
+
+#define ELF_R_SYM(info) ((u32)((info) >> 32))
+#define ELF_R_TYPE(info) ((u32)(info))
+#define ELF_R_INFO(sym, type) (((u64)(sym) << 32) | (u32)(type))
+
+typedef enum {
+	DT_NULL         = 0,
+	DT_NEEDED       = 1,
+	DT_PLTRELSZ     = 2,
+	DT_HASH         = 4,
+	DT_STRTAB       = 5,
+	DT_SYMTAB       = 6,
+	DT_RELA         = 7,
+	DT_RELASZ       = 8,
+	DT_SONAME       = 14,
+	DT_JMPREL       = 23,
+	DT_GNU_HASH     = 0x6ffffef5,
+	DT_VERSYM       = 0x6ffffff0,
+	DT_VERNEED      = 0x6ffffffe,
+	DT_VERNEEDNUM   = 0x6fffffff
+} elf_dynamic_tag;
+
+/// An entry of `.dynamic` in the ELF64 layout.
+typedef struct
+{
+	i64 d_tag;
+	u64 d_val;
+} elf_dynamic;
+
 typedef struct
 {
 	u32 p_type;
@@ -77,24 +153,59 @@ typedef struct
 typedef struct
 {
 	elf_program_header header;
+	/// `true` if the segment wasn't part of the input file, so its file offset and size are up to `layout_plan`.
+	bool added;
 } elf_segment;
 
 typedef struct
 {
 	elf_section_header header;
+	/// Section body. Points into the file mapping until the section gets modified.
+	/// Loaded on first use, always access it through `elf_section_data`.
 	u8* data;
+	/// Where the body is stored in the input file, the header may be moved around later.
+	u64 file_offset;
+	u64 file_size;
+	/// `true` if `data` is a private copy in the arena of the ELF.
+	bool owned;
+	/// Capacity of an owned `data` buffer.
+	u64 capacity;
+	/// Symbols or relocations of the body decoded to the layout of `elf_symtab` or `elf_rela`,
+	/// for files that don't use it. Decoded on first use, see `elf_symbols` and `elf_relocs`.
+	void* entries;
+	/// Structure-of-arrays copy of a symbol table, built on the first lookup that has to scan it.
+	struct symindex* index;
+	/// `true` if the section wasn't part of the input file, so its file offset is up to `layout_plan`.
+	bool added;
 } elf_section;
 
+/// Decoders and encoders for one class and byte order.
+typedef struct elf_codec elf_codec;
+
 typedef struct
 {
 	str file_name;
+	/// Memory for the header tables and all modified section bodies.
+	arena mem;
+	/// Read-only mapping of the whole input file.
+	u8* map;
+	size map_size;
 	/// ELF Header
 	elf_header header;
-	elf_header old_header;
+	/// How the headers and tables of the file are encoded.
+	const elf_codec* codec;
+	/// Address the program header table moves to, see `layout_place`. 0 while it stays where it was read from.
+	u64 phdr_vaddr;
 	/// Programs/Segments
 	elf_segment* segments;
+	u16 segments_cap;
 	/// Sections
 	elf_section* sections;
+	u16 sections_cap;
+	/// Indices of the dynamic symbol table and its hash tables, 0 if not present.
+	u16 dynsym_idx;
+	u16 gnu_hash_idx;
+	u16 hash_idx;
 } elf_obj;
 
 /// \brief                  Creates and initializes a new ELF.
@@ -125,12 +236,54 @@ void elf_write(const str file, const elf_obj* elf);
 /// \returns                A pointer to the section in memory.
 elf_section* elf_section_get(const elf_obj* elf, const str name);
 
-/// \brief                  Adds a new named section.
+/// \brief                  Finds the allocated section that contains a virtual address.
+/// \param  [in]    elf     The deserialized ELF.
+/// \param          addr    The virtual address to look for.
+/// \returns                A pointer to the section in memory, or `NULL` if no section contains the address.
+elf_section* elf_section_at(const elf_obj* elf, u64 addr);
+
+/// \brief                  Adds a new named, allocated and executable section.
+///                         It gets an address from `layout_place` once its size is known.
 /// \param  [in]    elf     The deserialized ELF.
 /// \param  [in]    name    The name of the section.
-/// \param  [in]    off     The virtual address where this section and segment lives.
 /// \returns                A pointer to the new section in memory.
-elf_section* elf_section_add(elf_obj* elf, const str name, u64 off);
+elf_section* elf_section_add(elf_obj* elf, const str name);
+
+/// \brief                  Appends a new program header. Its file offset and size get assigned by `layout_plan`.
+/// \param  [in]    elf     The deserialized ELF.
+/// \param  [in]    hdr     The program header to add.
+/// \returns                A pointer to the new segment in memory.
+elf_segment* elf_segment_add(elf_obj* elf, const elf_program_header* hdr);
+
+/// \brief                  Gets the body of a section, loading it from the file on first use.
+/// \param  [in]    elf     The ELF the section belongs to.
+/// \param  [in]    sect    The section to get the body of.
+/// \returns                A pointer to the section body, or `NULL` if the section has no contents in the file.
+u8* elf_section_data(const elf_obj* elf, elf_section* sect);
+
+/// \brief                  Makes a section body writable and ensures it can hold at least `size` bytes.
+///                         Bodies that still point into the file mapping get copied out first.
+/// \param  [in]    elf     The ELF the section belongs to.
+/// \param  [in]    sect    The section to modify.
+/// \param          size    The minimum amount of bytes the body needs to hold.
+/// \returns                A pointer to the writable section body.
+u8* elf_section_reserve(elf_obj* elf, elf_section* sect, u64 size);
+
+/// \brief                  Gets the entries of a symbol table section, decoding them first if the file doesn't use
+///                         the layout of `elf_symtab` (ELF32 or a different byte order).
+/// \param  [in]    elf     The ELF the section belongs to.
+/// \param  [in]    sect    A `SHT_SYMTAB` or `SHT_DYNSYM` section.
+/// \param  [out]   num_syms The amount of symbols in the table. Optional.
+/// \returns                A pointer to the first symbol, or `NULL` if the section has no contents in the file.
+elf_symtab* elf_symbols(const elf_obj* elf, elf_section* sect, size* num_syms);
+
+/// \brief                  Gets the entries of a relocation section, decoding them first if the file doesn't use
+///                         the layout of `elf_rela`. `SHT_REL` entries get an addend of 0.
+/// \param  [in]    elf     The ELF the section belongs to.
+/// \param  [in]    sect    A `SHT_RELA` or `SHT_REL` section.
+/// \param  [out]   num_relocs The amount of relocations in the section. Optional.
+/// \returns                A pointer to the first relocation, or `NULL` if the section has no contents in the file.
+elf_rela* elf_relocs(const elf_obj* elf, elf_section* sect, size* num_relocs);
 
 /// \brief                  Gets the name of a section at the given index.
 /// \param  [in]    elf     The file where the section is stored.
@@ -140,4 +293,24 @@ str elf_section_get_name(const elf_obj* elf, u16 idx);
 
 u16 elf_section_get_idx(const elf_obj* elf, const elf_section* name);
 
-size elf_gnu_hash(const str name);
+/// \brief                  Gets the dynamic symbol table and its string table, loading both if needed.
+/// \param  [in]    elf     The file to get the symbols of.
+/// \param  [out]   num_syms The amount of symbols in the table. Optional.
+/// \param  [out]   strtab  The string table the symbol names point into. Optional.
+/// \param  [out]   strtab_size The size of the string table in bytes. Optional.
+/// \returns                A pointer to the first symbol, or `NULL` if the file has no dynamic symbols.
+elf_symtab* elf_dynsym_table(const elf_obj* elf, size* num_syms, str* strtab, size* strtab_size);
+
+/// \brief                  Looks up a defined dynamic symbol by name.
+///                         Uses `.gnu.hash` if present, `.hash` otherwise and only scans `.dynsym` as a last resort,
+///                         through an index that's built on the first scan, see `symindex.h`.
+/// \param  [in]    elf     The file to search in.
+/// \param  [in]    name    The name of the symbol.
+/// \returns                A pointer to the symbol in `.dynsym` if successful, otherwise `NULL`.
+elf_symtab* elf_dynsym_lookup(const elf_obj* elf, const str name);
+
+/// \brief                  Calculates the GNU hash of a symbol name, as used in `.gnu.hash`.
+u32 elf_gnu_hash(const str name);
+
+/// \brief                  Calculates the System V hash of a symbol name, as used in `.hash`.
+u32 elf_hash(const str name);
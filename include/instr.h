@@ -4,5 +4,43 @@
 
 #include <elf.h>
 
+typedef enum
+{
+	INSTR_OTHER,
+	/// Direct call.
+	INSTR_CALL,
+	/// Direct unconditional jump.
+	INSTR_JUMP,
+	/// Direct conditional jump.
+	INSTR_BRANCH,
+	/// Return.
+	INSTR_RET,
+	/// Indirect call or jump.
+	INSTR_INDIRECT,
+} instr_kind;
+
+typedef struct
+{
+	/// Length of the whole instruction in bytes.
+	u8 length;
+	instr_kind kind;
+	/// Offset and size of the relative displacement inside the instruction, size is 0 if there is none.
+	/// This is either the target of a direct branch, or a RIP-relative memory operand.
+	u8 rel_offset;
+	u8 rel_size;
+	/// `true` if the displacement belongs to a RIP-relative memory operand.
+	bool rip_relative;
+	/// Where the displacement points to, relative to the start of the instruction.
+	i64 rel_target;
+} instr_info;
+
 /// \brief          Gets the assembly instructions for a relative jump on the given machine and writes them to instr.
 bool instr_get_bytes(elf_machine type, u32 offset, u8 instr[16]);
+
+/// \brief                  Decodes the length and control flow of a single instruction.
+/// \param          type    The machine the code is for.
+/// \param  [in]    code    The instruction bytes.
+/// \param          len     The amount of bytes available at `code`.
+/// \param  [out]   out     The decoded instruction.
+/// \returns                `true` if successful, `false` if the machine is unsupported or the bytes are truncated.
+bool instr_decode(elf_machine type, const u8* code, size len, instr_info* out);
@@ -0,0 +1,34 @@
+#pragma once
+#include <elf.h>
+#include <types.h>
+
+/// The size of a huge page on x86-64, the page size `layout_place` maps code with for `--hugepage-align`.
+#define LAYOUT_HUGE_PAGE 0x200000
+
+/// \brief                  Gives all added, allocated sections of an ELF an address, once their sizes are known.
+///                         Sections and segments of the input file keep their addresses, added sections get mapped with
+///                         as few segments as possible:
+///                         - A segment with matching flags that ends both the file and the address space just grows.
+///                         - All other sections share one new segment per combination of flags, at the lowest free
+///                           address behind an existing segment, including gaps between them.
+///                         - The program header table stays in place while it fits, otherwise it moves to the start of
+///                           the first new segment.
+///                         With a `code_page` larger than the pages of the file, added executable sections always get
+///                         a new segment, aligned to and padded up to a multiple of `code_page` both in the file and
+///                         in memory. Executable segments of the input get that alignment too, where their address
+///                         and offset allow it.
+/// \param  [in]    elf     The ELF to place the sections of.
+/// \param          code_page The page size to map added code with, 0 to use the pages of the file.
+/// \returns                `true` if successful, otherwise `false`.
+bool layout_place(elf_obj* elf, u64 code_page);
+
+/// \brief                  Assigns the final file offsets of a modified ELF, so it can be written with `elf_write`.
+///                         Sections and segments of the input file keep their offsets, everything that was added or
+///                         grew gets packed behind them:
+///                         - Added segments are placed at the first offset congruent to their address modulo their
+///                           alignment, their sections at the same distance from the start as in memory.
+///                         - `PT_PHDR` follows the program header table, wherever `layout_place` put it.
+///                         - Unallocated sections are packed in order behind that, then the section header table.
+/// \param  [in]    elf     The ELF to lay out, after `layout_place`.
+/// \returns                `true` if successful, otherwise `false`.
+bool layout_plan(elf_obj* elf);
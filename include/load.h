@@ -0,0 +1,26 @@
+#pragma once
+
+#include <elf.h>
+#include <resolve.h>
+#include <types.h>
+
+/// \brief                  Reads, validates and indexes all input files, using up to `jobs` threads.
+///                         Messages are reported per file in input order, regardless of which thread produced them.
+///                         Libraries with a valid cache entry only get their exports loaded, see `load_required`.
+/// \param  [in]    files   The paths of all input files.
+/// \param          num_files The amount of paths in `files`.
+/// \param          num_libs The amount of leading files that are libraries and need their exports collected.
+/// \param          jobs    The maximum amount of threads to use.
+/// \param  [out]   elfs    An array of `num_files` ELFs to read into.
+/// \param  [out]   exports An array of `num_libs` symbol lists to collect the library exports into.
+/// \returns                `true` if all files were loaded successfully, otherwise `false`.
+bool load_files(const str* files, u16 num_files, u16 num_libs, u16 jobs, elf_obj* elfs, resolve_lib* exports);
+
+/// \brief                  Reads all required files that haven't been read yet, using up to `jobs` threads.
+/// \param  [in]    files   The paths of all input files.
+/// \param          num_files The amount of paths in `files`.
+/// \param  [in]    required Which of the files need to be read.
+/// \param          jobs    The maximum amount of threads to use.
+/// \param  [in,out] elfs   An array of `num_files` ELFs to read into.
+/// \returns                `true` if all required files were loaded successfully, otherwise `false`.
+bool load_required(const str* files, u16 num_files, const bool* required, u16 jobs, elf_obj* elfs);
@@ -29,3 +29,26 @@ extern bool log_warn;
 /// \param fmt `printf` format string.
 /// \returns Always `false`.
 bool log_msg(log_level level, const str fmt, ...);
+
+/// \brief Redirects all messages of the calling thread into a buffer instead of printing them.
+///        While capturing, errors don't exit the process, `log_msg` just returns `false`.
+///        Anything that may run while capturing has to return on its own after logging an error.
+///        Captures nest, ending one resumes the capture that was active when it began.
+void log_capture_begin(void);
+
+/// \brief Stops capturing messages on the calling thread.
+/// \param [out] buf The captured messages, to be passed to `log_replay`.
+/// \returns `true` if no error was logged while capturing, otherwise `false`.
+bool log_capture_end(void** buf);
+
+/// \brief Prints and frees messages captured with `log_capture_begin`.
+///        Unlike `log_msg`, this never exits, even if an error was captured.
+///        If the calling thread is capturing itself, the messages are added to that capture instead.
+/// \param buf The captured messages.
+void log_replay(void* buf);
+
+/// \brief Passes messages captured with `log_capture_begin` to a callback in order, then frees them.
+/// \param buf The captured messages.
+/// \param sink Called with the level and text of every message.
+/// \param arg Passed to `sink` as is.
+void log_drain(void* buf, void (*sink)(log_level level, const str text, void* arg), void* arg);
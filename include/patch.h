@@ -1,13 +1,15 @@
 #pragma once
 
 #include <elf.h>
+#include <resolve.h>
 #include <types.h>
 
 /// \brief                  Extracts the symbol names from the dynamic symbol table.
 /// \param  [in]    elf     The file to extract from.
+/// \param  [in]    mem     The arena to allocate the name array from.
 /// \param  [out]   names   A reference to an array to store all symbol names in.
 /// \returns                The size of the name array.
-size patch_get_symbols(const elf_obj* elf, str** names);
+size patch_get_symbols(const elf_obj* elf, arena* mem, str** names);
 
 /// \brief                  Gets a pointer to the specified symbol.
 /// \param  [in]    elf     The file to extract from.
@@ -15,19 +17,89 @@ size patch_get_symbols(const elf_obj* elf, str** names);
 /// \returns                A reference to a symbol if successful, otherwise `NULL`.
 elf_symtab* patch_find_sym(const elf_obj* elf, str name);
 
-/// \brief                  Matches all symbols against each other and links the library to the target.
+/// A function that gets copied into the target.
+typedef struct
+{
+	/// Name of the function, for messages.
+	str name;
+	/// The library the function is copied from.
+	u16 lib;
+	/// The section of the library the function lives in, 0 if unknown.
+	u16 shndx;
+	/// Virtual address and size of the function in the library.
+	u64 addr;
+	u64 size;
+	/// Offset of the copy in `.solink`.
+	u64 offset;
+	/// Address of the target's PLT entry to redirect to the copy, 0 if only other copied functions call it.
+	u64 plt_addr;
+	/// The symbol of the target's `.dynsym` that PLT entry imports.
+	u32 import_sym;
+	/// The references of this function that need fixing up.
+	size first_fixup;
+	size num_fixups;
+	/// The function references something that doesn't follow it to its copy, so it stays in its library.
+	/// Only set while planning, `patch_begin` drops these functions from the link.
+	bool pinned;
+	/// Index + 1 of the identical function whose copy this one uses, 0 if it has a copy of its own.
+	size same_as;
+} patch_func;
+
+/// State of a single link, from `patch_begin` to `patch_end`.
+typedef struct patch_session patch_session;
+
+/// \brief                  Matches all symbols against each other and links the libraries to the target.
+///                         Only functions the target calls through its PLT get linked, together with all functions
+///                         they call in turn.
 /// \param  [in]    target  The ELF to link to.
-/// \param  [in]    library The ELF to link against.
-/// \param          num_lib The amount of ELFs in `library`.
+/// \param  [in]    index   The resolution index of all libraries to link against.
 /// \returns                `true` if successful, otherwise `false`.
-bool patch_link_library(elf_obj* target, const elf_obj* library, u16 num_lib);
+bool patch_link_library(elf_obj* target, const resolve_index* index);
 
-/// \brief                  Links a given symbol from the library to the target.
+/// \brief                  Finds all functions a link needs, without changing the target yet.
+///                         Functions that can't be copied, and callers that can only reach them through the copy,
+///                         are left out. Calls to them keep going through the target's PLT.
 /// \param  [in]    target  The ELF to link to.
-/// \param  [in]    sect    The section to write to.
-/// \param  [in]    library The ELF to link against.
-/// \param  [in]    name    The name of the symbol to link.
+/// \param  [in]    index   The resolution index of all libraries to link against.
+/// \returns                The planned link, or `NULL` if it failed. Must be freed with `patch_end`.
+patch_session* patch_begin(elf_obj* target, const resolve_index* index);
+
+/// \brief                  Gets all functions of a link. Their offsets may be changed before calling `patch_code`.
+/// \param  [in]    session The link to get the functions of.
+/// \param  [out]   num_funcs The amount of functions.
+/// \returns                The functions of the link.
+patch_func* patch_funcs(patch_session* session, size* num_funcs);
+
+/// \brief                  Lays out all functions of a link in a new `.solink` section of the target and copies them.
+///                         With `--fold-identical`, functions with identical code share a single copy.
+///                         All offsets are planned up front, then the functions get copied on up to `--jobs` threads.
+/// \param  [in]    session The link to apply.
+/// \returns                `true` if successful, otherwise `false`.
+bool patch_apply(patch_session* session);
+
+/// \brief                  Copies a function and fixes all references that leave it for where it will live.
+/// \param  [in]    session The link the function belongs to.
+/// \param          idx     The index of the function in the link.
+/// \param          base    The address of `.solink` in the target.
+/// \param  [out]   out     A buffer of at least the size of the function.
+/// \returns                `true` if successful, otherwise `false`.
+bool patch_code(patch_session* session, size idx, u64 base, u8* out);
+
+/// \brief                  Frees a link.
+/// \param  [in]    session The link to free, may be `NULL`.
+void patch_end(patch_session* session);
+
+/// \brief                  Copies a function of the link into the target and redirects its PLT entry to the copy.
+///                         Functions that share the copy of an identical one only get their PLT entry redirected.
+/// \param  [in]    session The link the function belongs to.
+/// \param          idx     The index of the function in the link.
 /// \returns                `true` if successful, otherwise `false`.
-bool patch_link_symbol(elf_obj* target, elf_section* sect, const elf_obj* library, str name);
+bool patch_link_symbol(patch_session* session, size idx);
 
-void patch_fix_offsets(elf_obj* elf);
+/// \brief                  Rewrites the direct calls and jumps of the target that go to the PLT entry of a copied
+///                         function, so they go straight to the copy. PLT entries stay redirected as a fallback.
+///                         Call sites are taken from the relocations of a code section if it has any, otherwise its
+///                         instructions get decoded front to back. Only supported on x86-64.
+/// \param  [in]    session The link to rewrite the calls for, after all functions were linked.
+/// \returns                The amount of rewritten instructions.
+size patch_direct_calls(patch_session* session);
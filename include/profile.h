@@ -0,0 +1,25 @@
+#pragma once
+
+#include <types.h>
+
+/// How often each function was seen running, read from a profile file.
+typedef struct profile profile;
+
+/// \brief                  Gets the profile stored at a path, reading it if it wasn't read yet or changed since.
+///                         Two formats are understood, line by line:
+///                         - Symbol counts, a symbol name and a number separated by whitespace, in either order.
+///                         - The output of `perf script`, every stack frame adds one sample to its symbol.
+///                         Empty lines, lines starting with `#` and lines matching neither format are ignored.
+/// \param  [in]    path    The path of the profile.
+/// \returns                The profile, or `NULL` if it couldn't be read. Must be released with `profile_release`.
+profile* profile_acquire(const str path);
+
+/// \brief                  Gives back a profile gotten from `profile_acquire`.
+/// \param  [in]    prof    The profile to release.
+void profile_release(profile* prof);
+
+/// \brief                  Gets the amount of samples of a function.
+/// \param  [in]    prof    The profile to look in.
+/// \param  [in]    name    The name of the function, without a version.
+/// \returns                The amount of samples, 0 if the function never showed up.
+u64 profile_count(const profile* prof, const str name);
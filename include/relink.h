@@ -0,0 +1,40 @@
+#pragma once
+
+#include <elf.h>
+#include <patch.h>
+#include <resolve.h>
+#include <types.h>
+
+/// \brief                  Checks if an output is still up to date, without reading any input.
+///                         This is the case if neither the inputs nor the output changed since the manifest was recorded.
+/// \param  [in]    output  The path of the output.
+/// \param  [in]    files   The paths of all libraries, followed by the target.
+/// \param          num_files The amount of paths in `files`.
+/// \returns                `true` if nothing has to be done, otherwise `false`.
+bool relink_up_to_date(const str output, const str* files, u16 num_files);
+
+/// \brief                  Tries to bring an existing output up to date with a planned link by only rewriting
+///                         the functions that changed. This fails if the target changed, a function is new or
+///                         doesn't fit its old place anymore.
+/// \param  [in]    session The planned link, see `patch_begin`. Its function offsets get changed.
+/// \param  [in]    target  The target of the link.
+/// \param  [in]    index   The resolution index of all libraries.
+/// \param  [in]    output  The path of the output.
+/// \returns                `true` if the output was updated, `false` if it has to be written from scratch.
+bool relink_update(patch_session* session, const elf_obj* target, const resolve_index* index, const str output);
+
+/// \brief                  Records the manifest of an output that was just written, next to it.
+///                         Failing to write the manifest is not an error, the next link just starts from scratch.
+/// \param  [in]    session The applied link, see `patch_apply`.
+/// \param  [in]    target  The target of the link.
+/// \param  [in]    index   The resolution index of all libraries.
+/// \param  [in]    output  The path of the output.
+void relink_record(patch_session* session, const elf_obj* target, const resolve_index* index, const str output);
+
+/// \brief                  Links once, then again every time one of the files changes. Only returns on failure,
+///                         after warning about what went wrong. Errors of a link are reported, but don't stop watching.
+/// \param  [in]    files   The paths of all files to watch.
+/// \param          num_files The amount of paths in `files`.
+/// \param  [in]    link    Performs a single link.
+/// \returns                `false` once the files couldn't be watched anymore.
+bool relink_watch(const str* files, u16 num_files, bool (*link)(void));
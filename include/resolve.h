@@ -0,0 +1,74 @@
+#pragma once
+
+#include <elf.h>
+#include <types.h>
+
+typedef struct
+{
+	str name;
+	u32 hash;
+	/// The symbol record. Its `sym_name` is only meaningful if it points into the library's `.dynsym`.
+	elf_symtab* sym;
+} resolve_sym;
+
+/// Exported function symbols of a single library.
+typedef struct
+{
+	size num_syms;
+	resolve_sym* syms;
+	/// Mapping of the cache entry the symbols were loaded from, `NULL` if they came from the library itself.
+	void* cache;
+	size cache_size;
+} resolve_lib;
+
+typedef struct
+{
+	/// Interned symbol name, `NULL` if the slot is empty.
+	str name;
+	u32 hash;
+	/// Index of the library that provides this symbol.
+	u16 lib;
+	/// Index of another library that also provides this symbol, -1 if there is none.
+	i32 conflict;
+	/// The symbol in the `.dynsym` of the providing library.
+	elf_symtab* sym;
+} resolve_entry;
+
+/// Maps symbol names to the library that provides them, for all libraries of a link.
+typedef struct
+{
+	/// The indexed libraries. Libraries that were only loaded from the cache get read on demand.
+	elf_obj* libs;
+	u16 num_libs;
+	/// Open addressing hash table, `cap` is always a power of two.
+	size cap;
+	size num_entries;
+	resolve_entry* entries;
+} resolve_index;
+
+/// \brief                  Collects all exported (STB_GLOBAL | STT_FUNC) symbols of a library.
+/// \param  [in]    lib     The library to collect the symbols from.
+/// \returns                The exported symbols.
+resolve_lib resolve_lib_exports(const elf_obj* lib);
+
+/// \brief                  Frees all resources associated with the given symbol list.
+/// \param  [in]    exports The symbol list to free.
+void resolve_lib_free(resolve_lib* exports);
+
+/// \brief                  Builds a resolution index over all given libraries.
+///                         Symbols provided by more than one library are marked as a conflict.
+/// \param  [in]    libs    The libraries to index.
+/// \param  [in]    exports The exported symbols of each library, as returned by `resolve_lib_exports`.
+/// \param          num_libs The amount of libraries in `libs` and `exports`.
+/// \returns                The resolution index.
+resolve_index resolve_build(elf_obj* libs, const resolve_lib* exports, u16 num_libs);
+
+/// \brief                  Finds the library that provides a symbol.
+/// \param  [in]    index   The index to search in.
+/// \param  [in]    name    The name of the symbol.
+/// \returns                The index entry if the symbol is provided, otherwise `NULL`.
+const resolve_entry* resolve_find(const resolve_index* index, const str name);
+
+/// \brief                  Frees all resources associated with the given index.
+/// \param  [in]    index   The index to free.
+void resolve_free(resolve_index* index);
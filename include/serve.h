@@ -0,0 +1,18 @@
+#pragma once
+
+#include <types.h>
+
+/// \brief                  Runs a link server on a Unix domain socket until the process gets killed.
+///                         Libraries stay parsed and indexed between requests and are only read again when
+///                         their path, inode, size or modification time changes. Requests are handled concurrently.
+/// \param  [in]    socket  The path of the socket to listen on.
+/// \returns                `false` if the server couldn't be started.
+bool serve_run(const str socket);
+
+/// \brief                  Sends a link request to a server started with `serve_run` and prints its messages.
+/// \param  [in]    socket  The path of the socket the server listens on.
+/// \param  [in]    files   The absolute paths of all libraries, followed by the target.
+/// \param          num_files The amount of paths in `files`.
+/// \param  [in]    output  The absolute path to write the linked binary to.
+/// \returns                `true` if the server linked the target successfully, otherwise `false`.
+bool serve_client(const str socket, const str* files, u16 num_files, const str output);
@@ -0,0 +1,68 @@
+#pragma once
+#include <types.h>
+
+/// Parts of a link that get timed separately.
+typedef enum
+{
+	STATS_ARGS,
+	STATS_READ,
+	STATS_RESOLVE,
+	STATS_LINK,
+	STATS_LAYOUT,
+	STATS_WRITE,
+	STATS_NUM_PHASES,
+} stats_phase;
+
+/// Things that get counted during a link.
+typedef enum
+{
+	STATS_SYMS_RESOLVED,
+	STATS_SYMS_UNRESOLVED,
+	STATS_LOOKUPS,
+	STATS_BYTES_READ,
+	STATS_BYTES_COPIED,
+	STATS_BYTES_WRITTEN,
+	STATS_SECTIONS_ADDED,
+	STATS_SEGMENTS_ADDED,
+	STATS_CALLS_REWRITTEN,
+	STATS_IMPORTS_BOUND,
+	STATS_FUNCS_FOLDED,
+	STATS_ALLOCS,
+	STATS_ALLOC_BLOCKS,
+	STATS_NUM_COUNTERS,
+} stats_counter;
+
+/// The point in time a phase started at, see `stats_start`.
+typedef struct
+{
+	u64 wall;
+	u64 cpu;
+} stats_clock;
+
+/// \brief                  Gets the current wall and CPU time of the calling thread, even without `--stats`.
+/// \returns                The start of a phase, to be passed to `stats_stop`.
+stats_clock stats_start(void);
+
+/// \brief                  Adds the time since `start` to a phase. Does nothing unless `--stats` was given.
+///                         Phases can be stopped any number of times and from any thread, all times add up.
+/// \param          phase   The phase to add to.
+/// \param          start   When the phase started.
+void stats_stop(stats_phase phase, stats_clock start);
+
+/// \brief                  Records how long reading a single file took, in addition to the `STATS_READ` phase.
+/// \param  [in]    file    The path of the file.
+/// \param          bytes   The size of the file.
+/// \param          start   When reading started.
+void stats_file(const str file, u64 bytes, stats_clock start);
+
+/// \brief                  Adds to a counter. Does nothing unless `--stats` was given.
+/// \param          counter The counter to add to.
+/// \param          num     The amount to add.
+void stats_count(stats_counter counter, u64 num);
+
+/// \brief                  Writes everything recorded since the last reset to standard output.
+/// \param          json    Write a JSON object instead of a table.
+void stats_report(bool json);
+
+/// \brief                  Forgets all recorded times and counters.
+void stats_reset(void);
@@ -0,0 +1,42 @@
+#pragma once
+#include <types.h>
+#include <elf.h>
+
+/// Symbols are scanned in blocks of this many, all arrays are padded to a multiple of it.
+#define SYMINDEX_BLOCK 8
+
+/// A structure-of-arrays copy of a symbol table, for files without `.gnu.hash` or `.hash`.
+/// Scans compare the hashes and binding of a whole block of symbols at once, before touching any name.
+typedef struct symindex
+{
+	/// The amount of symbols, without the padding.
+	size num_syms;
+	size num_blocks;
+	/// GNU hash of every name.
+	u32* hashes;
+	/// `sym_info` of every symbol. Undefined symbols and the padding are stored as 0 (STB_LOCAL), so they never match.
+	u8* info;
+	/// Offset of every name in the string table.
+	u32* names;
+	/// Finds the next block with candidates, see `symindex_build`.
+	size (*scan)(const struct symindex* index, size block, u32 hash, u32* mask);
+} symindex;
+
+/// \brief                  Builds the index of a symbol table. Uses AVX2 or SSE2 for scans if the host supports it.
+/// \param  [in]    syms    The symbols to index.
+/// \param          num_syms The amount of symbols.
+/// \param  [in]    strtab  The string table the symbol names point into.
+/// \param          strtab_size The size of the string table in bytes.
+/// \returns                The index, to be freed with `symindex_free`.
+symindex* symindex_build(const elf_symtab* syms, size num_syms, const str strtab, size strtab_size);
+
+/// \brief                  Finds a defined, non-local symbol by name.
+/// \param  [in]    index   The index to search in.
+/// \param  [in]    strtab  The string table the index was built with.
+/// \param  [in]    name    The name of the symbol.
+/// \returns                The index of the symbol in its table, or -1 if there is none.
+i64 symindex_find(const symindex* index, const str strtab, const str name);
+
+/// \brief                  Frees an index.
+/// \param  [in]    index   The index to free, may be `NULL`.
+void symindex_free(symindex* index);
@@ -0,0 +1,23 @@
+#pragma once
+#include <types.h>
+
+/// \brief                  Gets the start of a span. Costs a single branch unless `--trace` was given.
+/// \returns                The current time, to be passed to `trace_end`.
+u64 trace_begin(void);
+
+/// \brief                  Records a span on the calling thread, from `start` until now.
+///                         Events are kept in a buffer of the thread, so recording never takes a lock.
+/// \param  [in]    name    The name of the span. Must be a string literal, it isn't copied.
+/// \param  [in]    file    The file the span works on, or `NULL`.
+/// \param  [in]    symbol  The symbol the span works on, or `NULL`.
+/// \param          start   When the span started, see `trace_begin`.
+void trace_end(const str name, const str file, const str symbol, u64 start);
+
+/// \brief                  Writes the events of all threads since the last reset as a Chrome trace event file,
+///                         which can be opened with Perfetto or `chrome://tracing`. Failing to write is only a warning.
+///                         No thread may record events at the same time.
+/// \param  [in]    path    The file to write to.
+void trace_write(const str path);
+
+/// \brief                  Forgets all recorded events. No thread may record events at the same time.
+void trace_reset(void);
@@ -13,6 +13,9 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+typedef float f32;
+typedef double f64;
+
 typedef size_t size;
 
 typedef char* str;
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <arena.h>
+#include <log.h>
+#include <stats.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_block
+{
+	arena_block* next;
+	size cap;
+	size used;
+	_Alignas(ARENA_ALIGN) u8 data[];
+};
+
+void* arena_alloc(arena* mem, size len)
+{
+	if (!mem)
+	{
+		log_msg(LOG_ERR, "failed to allocate memory, no arena given!\n");
+		return NULL;
+	}
+
+	// Empty allocations still take up room, otherwise they'd share their address with the next one.
+	len = ALIGN(len ? len : 1, ARENA_ALIGN);
+	arena_block* block = mem->head;
+	if (!block || block->cap - block->used < len)
+	{
+		// Large allocations get a block of their own.
+		const size cap = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(arena_block) + cap);
+		if (!block)
+		{
+			log_msg(LOG_ERR, "failed to allocate %zu bytes!\n", len);
+			return NULL;
+		}
+		stats_count(STATS_ALLOC_BLOCKS, 1);
+		block->cap = cap;
+		block->used = 0;
+		// Keep the fuller block behind the new one, so the head always has the most room left.
+		if (mem->head && cap > ARENA_BLOCK_SIZE)
+		{
+			block->next = mem->head->next;
+			mem->head->next = block;
+		}
+		else
+		{
+			block->next = mem->head;
+			mem->head = block;
+		}
+	}
+
+	stats_count(STATS_ALLOCS, 1);
+	void* result = block->data + block->used;
+	block->used += len;
+	mem->last = result;
+	return result;
+}
+
+void* arena_calloc(arena* mem, size num, size len)
+{
+	void* result = arena_alloc(mem, num * len);
+	if (result)
+		memset(result, 0, num * len);
+	return result;
+}
+
+void* arena_realloc(arena* mem, void* ptr, size old_len, size new_len)
+{
+	if (!ptr)
+		return arena_alloc(mem, new_len);
+	if (new_len <= old_len)
+		return ptr;
+
+	// Grow in place if this was the last allocation and the block still has room.
+	arena_block* block = mem->head;
+	if (ptr == mem->last && block && (u8*)ptr >= block->data && (u8*)ptr < block->data + block->cap)
+	{
+		const size start = (size)((u8*)ptr - block->data);
+		const size len = ALIGN(new_len, ARENA_ALIGN);
+		if (start + len <= block->cap)
+		{
+			block->used = start + len;
+			return ptr;
+		}
+	}
+
+	void* result = arena_alloc(mem, new_len);
+	if (result)
+		memcpy(result, ptr, old_len);
+	return result;
+}
+
+void arena_free(arena* mem)
+{
+	if (!mem) return;
+	arena_block* block = mem->head;
+	while (block)
+	{
+		arena_block* next = block->next;
+		free(block);
+		block = next;
+	}
+	mem->head = NULL;
+	mem->last = NULL;
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <libgen.h>
+#include <unistd.h>
 
 #include <args.h>
 #include <about.h>
@@ -20,6 +21,16 @@ bool args_check_file(str path)
 	return true;
 }
 
+// Creates a file if it doesn't exist yet, but keeps its contents for incremental links.
+static bool args_touch_file(str path)
+{
+	FILE* file = fopen(path, "a");
+	if (!file)
+		return log_msg(LOG_ERR, "\"%s\": %s\n", path, strerror(errno));
+	fclose(file);
+	return true;
+}
+
 void args_parse(i32 argc, str* argv)
 {
 	// If no additional arguments are provided, just print the About text.
@@ -42,13 +53,79 @@ void args_parse(i32 argc, str* argv)
 			// Check if we have sufficient arguments.
 			if (i + 1 >= argc)
 				log_msg(LOG_ERR, "%s is missing an argument!\n", argv[i]);
-			// Touch the file.
-			fclose(fopen(argv[i + 1], "w"));
+			args_touch_file(argv[i + 1]);
 			ARGS.output = realpath(argv[i + 1], NULL);
 			i++;
 		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs"))
+		{
+			// Check if we have sufficient arguments.
+			if (i + 1 >= argc)
+				log_msg(LOG_ERR, "%s is missing an argument!\n", argv[i]);
+			str end;
+			const long jobs = strtol(argv[i + 1], &end, 10);
+			if (*end != '\0' || jobs < 1 || jobs > UINT16_MAX)
+				log_msg(LOG_ERR, "invalid amount of jobs \"%s\"!\n", argv[i + 1]);
+			ARGS.jobs = (u16)jobs;
+			i++;
+		}
+		else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--batch"))
+		{
+			// Check if we have sufficient arguments.
+			if (i + 1 >= argc)
+				log_msg(LOG_ERR, "%s is missing an argument!\n", argv[i]);
+			args_check_file(argv[i + 1]);
+			ARGS.batch = realpath(argv[i + 1], NULL);
+			i++;
+		}
+		else if (!strcmp(argv[i], "--serve") || !strcmp(argv[i], "--client"))
+		{
+			// Check if we have sufficient arguments.
+			if (i + 1 >= argc)
+				log_msg(LOG_ERR, "%s is missing an argument!\n", argv[i]);
+			if (!strcmp(argv[i], "--serve"))
+				ARGS.serve = argv[i + 1];
+			else
+				ARGS.client = argv[i + 1];
+			i++;
+		}
+		else if (!strcmp(argv[i], "--trace"))
+		{
+			// Check if we have sufficient arguments.
+			if (i + 1 >= argc)
+				log_msg(LOG_ERR, "%s is missing an argument!\n", argv[i]);
+			ARGS.trace = argv[i + 1];
+			i++;
+		}
+		else if (!strcmp(argv[i], "--profile"))
+		{
+			// Check if we have sufficient arguments.
+			if (i + 1 >= argc)
+				log_msg(LOG_ERR, "%s is missing an argument!\n", argv[i]);
+			ARGS.profile = argv[i + 1];
+			i++;
+		}
 		else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--force"))
 			ARGS.force = true;
+		else if (!strcmp(argv[i], "--no-cache"))
+			ARGS.no_cache = true;
+		else if (!strcmp(argv[i], "--no-incremental"))
+			ARGS.no_incremental = true;
+		else if (!strcmp(argv[i], "--direct-calls"))
+			ARGS.direct_calls = true;
+		else if (!strcmp(argv[i], "--static-bind"))
+			ARGS.static_bind = true;
+		else if (!strcmp(argv[i], "--hugepage-align"))
+			ARGS.hugepage_align = true;
+		else if (!strcmp(argv[i], "--fold-identical"))
+			ARGS.fold_identical = true;
+		else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--watch"))
+			ARGS.watch = true;
+		else if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=json"))
+		{
+			ARGS.stats = true;
+			ARGS.stats_json = argv[i][7] == '=';
+		}
 		else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quiet"))
 			log_quiet = true;
 		else if (!strcmp(argv[i], "--relax"))
@@ -81,16 +158,52 @@ void args_parse(i32 argc, str* argv)
 		}
 	}
 
-	// We need at least 1 library and 1 executable.
-	if (ARGS.num_files < 2)
+	// The server gets its files from the clients.
+	if (ARGS.serve)
+	{
+		if (ARGS.client || ARGS.batch || ARGS.watch || ARGS.stats || ARGS.trace || ARGS.num_files || ARGS.output)
+			log_msg(LOG_ERR, "can't use files, an output path, --client, --batch, --watch, --stats or --trace together with --serve.\n");
+		if (!ARGS.jobs)
+			ARGS.jobs = 1;
+		return;
+	}
+	if (ARGS.client && (ARGS.stats || ARGS.trace))
+		log_msg(LOG_ERR, "can't use --stats or --trace together with --client, the server does the work.\n");
+	// Requests only carry paths, the server links with the options it was started with.
+	if (ARGS.client && (ARGS.force || ARGS.no_incremental || ARGS.direct_calls || ARGS.static_bind ||
+		ARGS.hugepage_align || ARGS.fold_identical || ARGS.profile))
+		log_msg(LOG_ERR, "can't use --force, --no-incremental, --direct-calls, --static-bind, --hugepage-align, "
+			"--fold-identical or --profile together with --client, pass them to --serve instead.\n");
+	if (ARGS.client && ARGS.batch)
+		log_msg(LOG_ERR, "can't use --batch together with --client.\n");
+	if (ARGS.watch && (ARGS.client || ARGS.batch))
+		log_msg(LOG_ERR, "can't use --watch together with --client or --batch.\n");
+
+	// We need at least 1 library and 1 executable, which come from the manifest in batch mode.
+	if (ARGS.batch && ARGS.output)
+		log_msg(LOG_ERR, "can't use an output path in batch mode, the manifest provides them.\n");
+	if (ARGS.num_files < (ARGS.batch ? 1 : 2))
 		log_msg(LOG_ERR, "need at least 2 files to link.\n");
 
+	// If no amount of jobs was given, use one per processor.
+	if (!ARGS.jobs)
+	{
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		ARGS.jobs = cpus < 1 ? 1 : cpus > UINT16_MAX ? UINT16_MAX : (u16)cpus;
+	}
+
 	// If no output file was given, use "a.out" as a default.
 	if (!ARGS.output)
 		ARGS.output = "a.out";
+	// The server doesn't share our working directory.
+	if (ARGS.client && ARGS.output[0] != '/')
+	{
+		args_touch_file(ARGS.output);
+		ARGS.output = realpath(ARGS.output, NULL);
+	}
 
 	// We can't link to ourselves, that won't do anything.
-	for (u16 f = 0; f < ARGS.num_files - 1; f++)
+	for (u16 f = 0; !ARGS.batch && f < ARGS.num_files - 1; f++)
 	{
 		if (!strcmp(ARGS.files[f], ARGS.files[ARGS.num_files - 1]))
 			log_msg(LOG_ERR, "can't use \"%s\" as target and library!\n", basename(ARGS.files[f]));
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+// FIXME: This header is POSIX only, swap this for a portable function later!
+#include <libgen.h>
+
+#include <batch.h>
+#include <args.h>
+#include <load.h>
+#include <patch.h>
+#include <relink.h>
+#include <log.h>
+
+bool batch_link_one(elf_obj* target, const resolve_index* index, const str output)
+{
+	if (!target || !index || !output)
+		return log_msg(LOG_ERR, "couldn't link, no target, index or output given!\n");
+
+	// Memory for everything that lives as long as this link.
+	arena mem = {0};
+
+	// Print a table with matching library symbols.
+	log_msg(LOG_INFO, "linking %s...\n", basename(target->file_name));
+
+	// Get all symbol names from the target.
+	str* symbols = NULL; // List of symbol names.
+	size num_sym = patch_get_symbols(target, &mem, &symbols); // Amount of symbol names.
+	const resolve_entry** sym_idx = arena_calloc(&mem, num_sym, sizeof(resolve_entry*)); // Where each symbol is located.
+	size strs_len = 4; // Size of the longest symbol string, for nice table formatting.
+
+	// Try to resolve the symbols.
+	for (size sym = 0; sym < num_sym; sym++)
+	{
+		if (symbols[sym] == NULL)
+			continue;
+		// Find which library provides this symbol.
+		sym_idx[sym] = resolve_find(index, symbols[sym]);
+		// FIXME: There's probably a nicer way to do this.
+		if (strlen(symbols[sym]) > strs_len)
+			strs_len = strlen(symbols[sym]);
+	}
+
+	// Print table header.
+	log_msg(LOG_INFO, _BOLD "link\tname");
+	for (size i = 0; i < strs_len - 4; i++) // Pad len - "name"
+		log_msg(LOG_INFO, " ");
+	log_msg(LOG_INFO, _BOLD "\tsource\n");
+
+	for (size sym = 0; sym < num_sym; sym++)
+	{
+		if (symbols[sym] == NULL)
+			continue;
+
+		// Padding for nice formatting.
+		const i32 pad_len = (i32)(strs_len - strlen(symbols[sym]));
+
+		if (sym_idx[sym])
+			log_msg(LOG_INFO, "[" _GREEN "x" _REGULAR "]\t%s%*s\t%s\n", symbols[sym], pad_len, "", basename(index->libs[sym_idx[sym]->lib].file_name));
+		else
+			log_msg(LOG_INFO, "[" _RED "-" _REGULAR "]\t" _RED "%s%*s\tn/a\n", symbols[sym], pad_len, "");
+	}
+
+	// Libraries that were only loaded from the cache have to be read now if anything gets linked from them.
+	bool* required = arena_calloc(&mem, index->num_libs, sizeof(bool));
+	str* files = arena_calloc(&mem, index->num_libs, sizeof(str));
+	bool missing = false;
+	for (size sym = 0; sym < num_sym; sym++)
+	{
+		if (sym_idx[sym])
+			required[sym_idx[sym]->lib] = true;
+	}
+	for (u16 i = 0; i < index->num_libs; i++)
+	{
+		files[i] = index->libs[i].file_name;
+		missing |= required[i] && !index->libs[i].map;
+	}
+	if (missing && !load_required(files, index->num_libs, required, ARGS.jobs, index->libs))
+	{
+		arena_free(&mem);
+		return log_msg(LOG_ERR, "failed to load all required libraries!\n");
+	}
+	arena_free(&mem);
+
+	// Find everything that has to be linked.
+	patch_session* session = patch_begin(target, index);
+	if (!session)
+		return log_msg(LOG_ERR, "failed to link against a library!\n");
+
+	// If only function bodies changed since the last link, just rewrite those in the existing output.
+	if (!ARGS.no_incremental && relink_update(session, target, index, output))
+	{
+		patch_end(session);
+		return true;
+	}
+
+	// Patch input executable with all libraries.
+	if (!patch_apply(session))
+	{
+		patch_end(session);
+		return log_msg(LOG_ERR, "failed to link against a library!\n");
+	}
+
+	// Write the result to file.
+	elf_write(output, target);
+	log_msg(LOG_INFO, _GREEN "wrote the patched binary to \"%s\"\n", output);
+	if (!ARGS.no_incremental)
+		relink_record(session, target, index, output);
+	patch_end(session);
+	return true;
+}
+
+typedef struct
+{
+	const resolve_index* index;
+	size num_targets;
+	str* targets;
+	str* outputs;
+	/// Captured messages of each target.
+	void** logs;
+	bool* ok;
+	/// The next target to be picked up by a worker.
+	atomic_size_t next;
+} batch_state;
+
+static void batch_one(batch_state* state, size i)
+{
+	// Errors must not exit while other targets are still being linked, so collect them instead.
+	log_capture_begin();
+	elf_obj target = elf_read(state->targets[i]);
+	if (target.map)
+		batch_link_one(&target, state->index, state->outputs[i]);
+	state->ok[i] = log_capture_end(state->logs + i) && target.map;
+	elf_free(&target);
+}
+
+static void* batch_worker(void* arg)
+{
+	batch_state* state = arg;
+	size i;
+	while ((i = atomic_fetch_add(&state->next, 1)) < state->num_targets)
+		batch_one(state, i);
+	return NULL;
+}
+
+// Frees the (target, output) pairs of a manifest.
+static void batch_free_manifest(str* targets, str* outputs, size num)
+{
+	for (size i = 0; i < num; i++)
+	{
+		free(targets[i]);
+		free(outputs[i]);
+	}
+	free(targets);
+	free(outputs);
+}
+
+// Reads the (target, output) pairs of a manifest. Returns `false` if it couldn't be read or is invalid.
+static bool batch_read_manifest(const str manifest, const resolve_index* index, str** targets, str** outputs, size* num)
+{
+	FILE* file = fopen(manifest, "r");
+	if (!file)
+		return log_msg(LOG_ERR, "couldn't open batch manifest \"%s\"!\n", manifest);
+
+	size cap = 0;
+	*num = 0;
+	*targets = NULL;
+	*outputs = NULL;
+	char* line = NULL;
+	size line_cap = 0;
+	bool ok = true;
+	for (size line_num = 1; ok && getline(&line, &line_cap, file) != -1; line_num++)
+	{
+		char* save;
+		const str target = strtok_r(line, " \t\r\n", &save);
+		if (!target || target[0] == '#')
+			continue;
+		const str output = strtok_r(NULL, " \t\r\n", &save);
+		if (!output || strtok_r(NULL, " \t\r\n", &save))
+		{
+			ok = log_msg(LOG_ERR, "[%s:%zu] expected a target and an output path!\n", basename(manifest), line_num);
+			break;
+		}
+
+		// Targets have to exist, outputs get created when writing.
+		str path = realpath(target, NULL);
+		if (!path)
+		{
+			ok = log_msg(LOG_ERR, "[%s:%zu] target \"%s\" doesn't exist!\n", basename(manifest), line_num, target);
+			break;
+		}
+		// We can't link to ourselves, that won't do anything.
+		for (u16 l = 0; ok && l < index->num_libs; l++)
+		{
+			if (!strcmp(index->libs[l].file_name, path))
+				ok = log_msg(LOG_ERR, "[%s:%zu] can't use \"%s\" as target and library!\n", basename(manifest), line_num, basename(path));
+		}
+		if (!ok)
+		{
+			free(path);
+			break;
+		}
+
+		if (*num == cap)
+		{
+			cap = cap ? cap * 2 : 16;
+			*targets = reallocarray(*targets, cap, sizeof(str));
+			*outputs = reallocarray(*outputs, cap, sizeof(str));
+		}
+		(*targets)[*num] = path;
+		(*outputs)[*num] = strdup(output);
+		(*num)++;
+	}
+	free(line);
+	fclose(file);
+	if (!ok)
+	{
+		batch_free_manifest(*targets, *outputs, *num);
+		*targets = NULL;
+		*outputs = NULL;
+		*num = 0;
+	}
+	return ok;
+}
+
+bool batch_link(const str manifest, const resolve_index* index, u16 jobs)
+{
+	if (!manifest || !index)
+		return log_msg(LOG_ERR, "couldn't link batch, no manifest or index given!\n");
+
+	batch_state state = { .index = index };
+	if (!batch_read_manifest(manifest, index, &state.targets, &state.outputs, &state.num_targets))
+		return false;
+	if (!state.num_targets)
+		return log_msg(LOG_WARN, "[%s] batch manifest doesn't list any targets\n", basename(manifest));
+	state.logs = calloc(state.num_targets, sizeof(void*));
+	state.ok = calloc(state.num_targets, sizeof(bool));
+	atomic_init(&state.next, 0);
+
+	// Never spawn more threads than there are targets. The calling thread works too.
+	if (jobs > state.num_targets)
+		jobs = (u16)state.num_targets;
+	const u16 num_threads = jobs > 1 ? jobs - 1 : 0;
+	pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+	u16 started = 0;
+	for (; started < num_threads; started++)
+	{
+		if (pthread_create(threads + started, NULL, batch_worker, &state) != 0)
+			break;
+	}
+	batch_worker(&state);
+	for (u16 i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// Report everything in manifest order, so the output is the same for any amount of jobs.
+	size num_ok = 0;
+	for (size i = 0; i < state.num_targets; i++)
+	{
+		log_replay(state.logs[i]);
+		num_ok += state.ok[i];
+	}
+
+	// Print a summary of all targets.
+	log_msg(LOG_INFO, _BOLD "\nlink\ttarget\n" _REGULAR);
+	for (size i = 0; i < state.num_targets; i++)
+	{
+		if (state.ok[i])
+			log_msg(LOG_INFO, "[" _GREEN "x" _REGULAR "]\t%s -> %s\n", state.targets[i], state.outputs[i]);
+		else
+			log_msg(LOG_INFO, "[" _RED "-" _REGULAR "]\t" _RED "%s\n" _REGULAR, state.targets[i]);
+	}
+	log_msg(num_ok == state.num_targets ? LOG_INFO : LOG_WARN, "linked %zu of %zu targets\n", num_ok, state.num_targets);
+
+	const bool result = num_ok == state.num_targets;
+	free(threads);
+	batch_free_manifest(state.targets, state.outputs, state.num_targets);
+	free(state.logs);
+	free(state.ok);
+	return result;
+}
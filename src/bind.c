@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <libgen.h>
+#include <string.h>
+
+#include <bind.h>
+#include <log.h>
+#include <stats.h>
+
+// An entry of `.gnu.version_r` in the ELF64 layout.
+typedef struct
+{
+	u16 vn_version;
+	u16 vn_cnt;
+	u32 vn_file;
+	u32 vn_aux;
+	u32 vn_next;
+} bind_verneed_entry;
+
+// State of a single pass over a target.
+typedef struct
+{
+	elf_obj* target;
+	const resolve_index* index;
+	arena mem;
+	elf_dynamic* dyn;
+	size num_dyn;
+	size num_syms;
+	/// Where every satisfied import lives now, 0 for all others.
+	u64* copies;
+	/// Imports that are still referenced by something that can't be bound here.
+	bool* keep;
+	/// Imports whose copy is shared with identical functions, so it can't stand for their address.
+	bool* shared;
+	/// Symbols that get removed, and where the others move to.
+	bool* removed;
+	u32* new_idx;
+	/// Libraries that provided at least one satisfied import.
+	bool* provided;
+} bind_state;
+
+static elf_dynamic* bind_dyn_get(const bind_state* s, i64 tag)
+{
+	for (size i = 0; i < s->num_dyn && s->dyn[i].d_tag != DT_NULL; i++)
+	{
+		if (s->dyn[i].d_tag == tag)
+			return s->dyn + i;
+	}
+	return NULL;
+}
+
+static void bind_dyn_remove(bind_state* s, elf_dynamic* entry)
+{
+	memmove(entry, entry + 1, (s->dyn + s->num_dyn - (entry + 1)) * sizeof(elf_dynamic));
+	s->dyn[s->num_dyn - 1] = (elf_dynamic) { DT_NULL, 0 };
+}
+
+// Gets the offset of the `push` immediate in the lazy binding stub of relocation `idx`, 0 if the stub isn't known.
+static u64 bind_push_offset(const elf_obj* elf, elf_section* plt, size idx)
+{
+	const u64 off = (idx + 1) * 16;
+	const u8* code = plt ? elf_section_data(elf, plt) : NULL;
+	if (!code || off + 16 > plt->header.sh_size)
+		return 0;
+	u64 imm = 0;
+	// jmp *GOT(%rip); push idx; jmp .plt
+	if (code[off] == 0xff && code[off + 1] == 0x25 && code[off + 6] == 0x68)
+		imm = off + 7;
+	// endbr64; push idx; bnd jmp .plt, the jumps through the GOT are in .plt.sec.
+	else if (!memcmp(code + off, "\xf3\x0f\x1e\xfa\x68", 5))
+		imm = off + 5;
+	u32 pushed;
+	memcpy(&pushed, code + imm, sizeof(u32));
+	return imm && pushed == idx ? imm : 0;
+}
+
+// Drops the `.rela.plt` entries of satisfied imports. Stubs that stay have to push their new index for lazy binding.
+static size bind_plt_relocs(bind_state* s, elf_section* rela)
+{
+	elf_obj* target = s->target;
+	elf_rela* relocs = elf_relocs(target, rela, NULL);
+	const size num = rela->header.sh_size / sizeof(elf_rela);
+	elf_section* plt = elf_section_get(target, ".plt");
+
+	size kept = 0;
+	bool ok = true;
+	for (size r = 0; r < num; r++)
+	{
+		const u32 sym = ELF_R_SYM(relocs[r].r_info);
+		if (ELF_R_TYPE(relocs[r].r_info) == R_X86_64_JUMP_SLOT && sym < s->num_syms && s->copies[sym])
+			continue;
+		ok = ok && (kept == r || bind_push_offset(target, plt, r));
+		kept++;
+	}
+	if (!ok)
+	{
+		log_msg(LOG_WARN, "[%s] lazy binding stubs not recognized, .rela.plt keeps all entries\n", basename(target->file_name));
+		for (size r = 0; r < num; r++)
+		{
+			if (ELF_R_SYM(relocs[r].r_info) < s->num_syms)
+				s->keep[ELF_R_SYM(relocs[r].r_info)] = true;
+		}
+		return 0;
+	}
+
+	relocs = (elf_rela*)elf_section_reserve(target, rela, rela->header.sh_size);
+	kept = 0;
+	for (size r = 0; r < num; r++)
+	{
+		const u32 sym = ELF_R_SYM(relocs[r].r_info);
+		if (ELF_R_TYPE(relocs[r].r_info) == R_X86_64_JUMP_SLOT && sym < s->num_syms && s->copies[sym])
+			continue;
+		if (kept != r)
+		{
+			const u32 idx = (u32)kept;
+			const u64 imm = bind_push_offset(target, plt, r);
+			memcpy(elf_section_reserve(target, plt, plt->header.sh_size) + imm, &idx, sizeof(u32));
+		}
+		relocs[kept++] = relocs[r];
+	}
+	rela->header.sh_size = kept * sizeof(elf_rela);
+	return num - kept;
+}
+
+// Resolves all other relocations against satisfied imports to their copies.
+static void bind_relocs(bind_state* s, elf_section* rela)
+{
+	elf_rela* relocs = (elf_rela*)elf_section_reserve(s->target, rela, rela->header.sh_size);
+	const size num = rela->header.sh_size / sizeof(elf_rela);
+	for (size r = 0; r < num; r++)
+	{
+		const u32 sym = ELF_R_SYM(relocs[r].r_info);
+		const u32 type = ELF_R_TYPE(relocs[r].r_info);
+		if (!sym || sym >= s->num_syms || !s->copies[sym])
+			continue;
+		if (!s->shared[sym] && (type == R_X86_64_GLOB_DAT || type == R_X86_64_64))
+		{
+			relocs[r].r_addend = (i64)s->copies[sym] + (type == R_X86_64_64 ? relocs[r].r_addend : 0);
+			relocs[r].r_info = ELF_R_INFO(0, R_X86_64_RELATIVE);
+		}
+		else
+			s->keep[sym] = true;
+	}
+}
+
+// Removes all symbols marked in `removed` and moves all others down, everything indexed by symbols follows.
+static void bind_symbols(bind_state* s, elf_section* dynsym)
+{
+	elf_obj* target = s->target;
+	elf_symtab* syms = (elf_symtab*)elf_section_reserve(target, dynsym, dynsym->header.sh_size);
+	u32 num_new = 0;
+	for (size i = 0; i < s->num_syms; i++)
+	{
+		if (s->removed[i])
+			continue;
+		s->new_idx[i] = num_new;
+		syms[num_new++] = syms[i];
+	}
+	const u32 num_removed = (u32)s->num_syms - num_new;
+	dynsym->header.sh_size = num_new * sizeof(elf_symtab);
+	str strtab = (str)elf_section_data(target, target->sections + dynsym->header.sh_link);
+
+	for (u16 i = 1; i < target->header.e_shnum; i++)
+	{
+		elf_section* sect = target->sections + i;
+		const elf_section_header* h = &sect->header;
+		if (h->sh_link != target->dynsym_idx || !(h->sh_flags & 2))
+			continue;
+		if (h->sh_type == SHT_RELA)
+		{
+			elf_rela* relocs = (elf_rela*)elf_section_reserve(target, sect, h->sh_size);
+			for (size r = 0; r < h->sh_size / sizeof(elf_rela); r++)
+			{
+				const u32 sym = ELF_R_SYM(relocs[r].r_info);
+				if (sym < s->num_syms)
+					relocs[r].r_info = ELF_R_INFO(s->new_idx[sym], ELF_R_TYPE(relocs[r].r_info));
+			}
+		}
+		else if (h->sh_type == SHT_GNU_VERSYM)
+		{
+			u16* versym = (u16*)elf_section_reserve(target, sect, h->sh_size);
+			for (size v = 0; v < s->num_syms && v < h->sh_size / sizeof(u16); v++)
+			{
+				if (!s->removed[v])
+					versym[s->new_idx[v]] = versym[v];
+			}
+			sect->header.sh_size = num_new * sizeof(u16);
+		}
+		// Only undefined symbols got removed, those all come before the hashed ones.
+		else if (h->sh_type == SHT_GNU_HASH)
+		{
+			u32* hash = (u32*)elf_section_reserve(target, sect, h->sh_size);
+			u32* buckets = (u32*)((u64*)(hash + 4) + hash[2]);
+			for (u32 b = 0; b < hash[0]; b++)
+				buckets[b] -= buckets[b] ? num_removed : 0;
+			hash[1] -= num_removed;
+		}
+		// The chains of `.hash` are indexed by symbol, so it gets built again.
+		else if (h->sh_type == SHT_HASH)
+		{
+			u32* hash = (u32*)elf_section_reserve(target, sect, h->sh_size);
+			const u32 num_buckets = hash[0];
+			u32* buckets = hash + 2;
+			u32* chain = buckets + num_buckets;
+			hash[1] = num_new;
+			memset(buckets, 0, (num_buckets + num_new) * sizeof(u32));
+			for (u32 i = 1; i < num_new && num_buckets; i++)
+			{
+				const u32 b = elf_hash(strtab + syms[i].sym_name) % num_buckets;
+				chain[i] = buckets[b];
+				buckets[b] = i;
+			}
+			sect->header.sh_size = (2 + num_buckets + num_new) * sizeof(u32);
+		}
+	}
+}
+
+// Gets the `DT_SONAME` of a library, `NULL` if it has none or wasn't read.
+static str bind_soname(const elf_obj* lib)
+{
+	for (u16 i = 1; lib->map && i < lib->header.e_shnum; i++)
+	{
+		elf_section* sect = lib->sections + i;
+		if (sect->header.sh_type != SHT_DYNAMIC || lib->header.e_ident_class != 2)
+			continue;
+		const elf_dynamic* dyn = (const elf_dynamic*)elf_section_data(lib, sect);
+		const str strtab = (str)elf_section_data(lib, lib->sections + sect->header.sh_link);
+		for (size d = 0; dyn && strtab && d < sect->header.sh_size / sizeof(elf_dynamic) && dyn[d].d_tag != DT_NULL; d++)
+		{
+			if (dyn[d].d_tag == DT_SONAME)
+				return strtab + dyn[d].d_val;
+		}
+	}
+	return NULL;
+}
+
+// Removes the version needs of a library that isn't needed anymore. ld.so insists on finding every file named there.
+static void bind_verneed(bind_state* s, elf_section* verneed, const str strtab, const str file)
+{
+	elf_obj* target = s->target;
+	u8* data = elf_section_reserve(target, verneed, verneed->header.sh_size);
+	elf_dynamic* head = bind_dyn_get(s, DT_VERNEED);
+	elf_dynamic* count = bind_dyn_get(s, DT_VERNEEDNUM);
+	bind_verneed_entry* prev = NULL;
+	for (u64 off = 0; off + sizeof(bind_verneed_entry) <= verneed->header.sh_size;)
+	{
+		bind_verneed_entry* cur = (bind_verneed_entry*)(data + off);
+		const u32 next = cur->vn_next;
+		if (!strcmp(strtab + cur->vn_file, file))
+		{
+			if (prev)
+				prev->vn_next = next ? prev->vn_next + next : 0;
+			else if (head && next)
+				head->d_val += next;
+			else if (head)
+				bind_dyn_remove(s, head);
+			count = bind_dyn_get(s, DT_VERNEEDNUM);
+			if (count && count->d_val)
+				count->d_val--;
+			if (verneed->header.sh_info)
+				verneed->header.sh_info--;
+		}
+		else
+			prev = cur;
+		if (!next)
+			break;
+		off += next;
+	}
+	if (count && !count->d_val)
+		bind_dyn_remove(s, count);
+}
+
+// Checks if a library defines a symbol the resolution index doesn't know about, like data. Unread libraries might.
+static bool bind_defines(const elf_obj* lib, const str name)
+{
+	return !lib->map || elf_dynsym_lookup(lib, name);
+}
+
+// Drops every library that only provided satisfied imports.
+static u16 bind_needed(bind_state* s, const elf_symtab* syms, u32 num_syms, const str strtab)
+{
+	elf_obj* target = s->target;
+	const resolve_index* index = s->index;
+	bool* still = arena_calloc(&s->mem, index->num_libs ? index->num_libs : 1, sizeof(bool));
+	for (u32 i = 1; i < num_syms; i++)
+	{
+		if (syms[i].sym_shndx || !syms[i].sym_name)
+			continue;
+		const str name = strtab + syms[i].sym_name;
+		const resolve_entry* entry = resolve_find(index, name);
+		if (entry)
+			still[entry->lib] = true;
+		for (u16 l = 0; !entry && l < index->num_libs; l++)
+			still[l] = still[l] || (s->provided[l] && bind_defines(index->libs + l, name));
+	}
+
+	// Collect first, removing the version needs moves the entries of `.dynamic` around.
+	str* dropped = arena_alloc(&s->mem, s->num_dyn * sizeof(str));
+	u16 num_dropped = 0;
+	for (size d = 0; d < s->num_dyn && s->dyn[d].d_tag != DT_NULL;)
+	{
+		const str needed = strtab + s->dyn[d].d_val;
+		bool drop = false;
+		for (u16 l = 0; s->dyn[d].d_tag == DT_NEEDED && l < index->num_libs && !drop; l++)
+		{
+			const str soname = bind_soname(index->libs + l);
+			if (!strcmp(needed, soname ? soname : basename(index->libs[l].file_name)))
+				drop = s->provided[l] && !still[l];
+		}
+		if (!drop)
+		{
+			d++;
+			continue;
+		}
+		log_msg(LOG_INFO, "[%s] doesn't need \"%s\" anymore\n", basename(target->file_name), needed);
+		dropped[num_dropped++] = needed;
+		bind_dyn_remove(s, s->dyn + d);
+	}
+
+	elf_section* verneed = NULL;
+	for (u16 i = 1; i < target->header.e_shnum && !verneed; i++)
+	{
+		if (target->sections[i].header.sh_type == SHT_GNU_VERNEED)
+			verneed = target->sections + i;
+	}
+	for (u16 i = 0; verneed && i < num_dropped; i++)
+		bind_verneed(s, verneed, strtab, dropped[i]);
+	return num_dropped;
+}
+
+bool bind_static(patch_session* session, elf_obj* target, const resolve_index* index)
+{
+	if (!session || !target || !index)
+		return log_msg(LOG_WARN, "couldn't bind imports, no link given!\n");
+	const str name = basename(target->file_name);
+	if (target->header.e_machine != EM_X86_64 || target->header.e_ident_class != 2)
+		return log_msg(LOG_WARN, "[%s] static binding is only supported on x86-64\n", name);
+
+	elf_section* dynamic = NULL;
+	for (u16 i = 1; i < target->header.e_shnum && !dynamic; i++)
+	{
+		if (target->sections[i].header.sh_type == SHT_DYNAMIC)
+			dynamic = target->sections + i;
+	}
+	const elf_section* sect = elf_section_get(target, ".solink");
+	size num_syms = 0;
+	str strtab = NULL;
+	const elf_symtab* syms = elf_dynsym_table(target, &num_syms, &strtab, NULL);
+	if (!dynamic || !sect || !syms || !strtab)
+		return log_msg(LOG_WARN, "[%s] has no imports to bind\n", name);
+	// The tables get rewritten where they are, which needs them in the layout of the host.
+	if ((u8*)syms != elf_section_data(target, target->sections + target->dynsym_idx))
+		return log_msg(LOG_WARN, "[%s] static binding needs a file in the byte order of the host\n", name);
+
+	bind_state s = {
+		.target = target,
+		.index = index,
+		.num_syms = num_syms,
+	};
+	s.dyn = (elf_dynamic*)elf_section_reserve(target, dynamic, dynamic->header.sh_size);
+	s.num_dyn = dynamic->header.sh_size / sizeof(elf_dynamic);
+	s.copies = arena_calloc(&s.mem, num_syms, sizeof(u64));
+	s.keep = arena_calloc(&s.mem, num_syms, sizeof(bool));
+	s.shared = arena_calloc(&s.mem, num_syms, sizeof(bool));
+	s.removed = arena_calloc(&s.mem, num_syms, sizeof(bool));
+	s.new_idx = arena_calloc(&s.mem, num_syms, sizeof(u32));
+	s.provided = arena_calloc(&s.mem, index->num_libs ? index->num_libs : 1, sizeof(bool));
+
+	size num_funcs;
+	const patch_func* funcs = patch_funcs(session, &num_funcs);
+	bool* folded = arena_calloc(&s.mem, num_funcs ? num_funcs : 1, sizeof(bool));
+	for (size i = 0; i < num_funcs; i++)
+	{
+		if (funcs[i].same_as)
+			folded[i] = folded[funcs[i].same_as - 1] = true;
+	}
+	for (size i = 0; i < num_funcs; i++)
+	{
+		if (!funcs[i].plt_addr || funcs[i].import_sym >= num_syms)
+			continue;
+		s.copies[funcs[i].import_sym] = sect->header.sh_addr + funcs[i].offset;
+		s.shared[funcs[i].import_sym] = folded[i];
+		s.provided[funcs[i].lib] = true;
+	}
+
+	// Relocations first, they decide which symbols are still needed.
+	const elf_dynamic* jmprel = bind_dyn_get(&s, DT_JMPREL);
+	size num_plt_removed = 0;
+	for (u16 i = 1; i < target->header.e_shnum; i++)
+	{
+		elf_section* rela = target->sections + i;
+		if (rela->header.sh_type != SHT_RELA || rela->header.sh_link != target->dynsym_idx || !(rela->header.sh_flags & 2))
+			continue;
+		if (jmprel && rela->header.sh_addr == jmprel->d_val)
+			num_plt_removed = bind_plt_relocs(&s, rela);
+		else
+			bind_relocs(&s, rela);
+	}
+	elf_dynamic* pltrelsz = bind_dyn_get(&s, DT_PLTRELSZ);
+	elf_dynamic* rela = bind_dyn_get(&s, DT_RELA);
+	elf_dynamic* relasz = bind_dyn_get(&s, DT_RELASZ);
+	if (pltrelsz)
+		pltrelsz->d_val -= num_plt_removed * sizeof(elf_rela);
+	// Some linkers let the range of DT_RELA cover the PLT relocations as well.
+	if (jmprel && rela && relasz && jmprel->d_val >= rela->d_val && jmprel->d_val < rela->d_val + relasz->d_val)
+		relasz->d_val -= num_plt_removed * sizeof(elf_rela);
+
+	// Only imports nothing refers to anymore can go. With `.gnu.hash`, those all have to come before the hashed ones.
+	const u32* gnu_hash = target->gnu_hash_idx ? (const u32*)elf_section_data(target, target->sections + target->gnu_hash_idx) : NULL;
+	const u32 first_hashed = gnu_hash ? gnu_hash[1] : UINT32_MAX;
+	size num_bound = 0;
+	for (size i = 1; i < num_syms; i++)
+	{
+		s.removed[i] = s.copies[i] && !s.keep[i] && !syms[i].sym_shndx && i < first_hashed;
+		num_bound += s.removed[i];
+	}
+	if (num_bound)
+		bind_symbols(&s, target->sections + target->dynsym_idx);
+
+	syms = elf_dynsym_table(target, &num_syms, &strtab, NULL);
+	const u16 num_dropped = bind_needed(&s, syms, (u32)num_syms, strtab);
+
+	stats_count(STATS_IMPORTS_BOUND, num_bound);
+	log_msg(LOG_INFO, "[%s] bound %zu imports statically, %hu libraries aren't needed anymore\n", name, num_bound, num_dropped);
+	arena_free(&s.mem);
+	return true;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cache.h>
+#include <log.h>
+
+#define CACHE_MAGIC 0x434b4c53 // "SLKC"
+#define CACHE_VERSION 1
+#define CACHE_PATH_MAX 4096
+#define CACHE_ENTRY_PATH_MAX (CACHE_PATH_MAX + 32)
+
+// Layout of a cache entry:
+//   cache_header
+//   u32         hashes[num_syms], padded to 8 bytes
+//   elf_symtab  syms[num_syms], `sym_name` is an offset into `strtab`
+//   char        strtab[strtab_size]
+//   char        path[path_len]
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	u64 dev;
+	u64 ino;
+	u64 size;
+	i64 mtime_sec;
+	i64 mtime_nsec;
+	u64 num_syms;
+	u64 strtab_size;
+	u64 path_len;
+} cache_header;
+
+static char cache_dir[CACHE_PATH_MAX] = {0};
+static pthread_once_t cache_dir_once = PTHREAD_ONCE_INIT;
+
+static void cache_dir_init(void)
+{
+	// Prefer $XDG_CACHE_HOME, fall back to ~/.cache.
+	const str xdg = getenv("XDG_CACHE_HOME");
+	const str home = getenv("HOME");
+	char base[CACHE_PATH_MAX - 16];
+	if (xdg && xdg[0] == '/')
+		snprintf(base, sizeof(base), "%s", xdg);
+	else if (home && home[0])
+		snprintf(base, sizeof(base), "%s/.cache", home);
+	else
+		return;
+
+	mkdir(base, 0755);
+	snprintf(cache_dir, sizeof(cache_dir), "%s/solink", base);
+	if (mkdir(cache_dir, 0755) != 0 && access(cache_dir, W_OK) != 0)
+		cache_dir[0] = '\0';
+}
+
+// Gets the path of the cache entry for a file. Returns `false` if there is no usable cache directory.
+static bool cache_entry_path(const str path, const struct stat* st, char out[CACHE_ENTRY_PATH_MAX])
+{
+	pthread_once(&cache_dir_once, cache_dir_init);
+	if (!cache_dir[0])
+		return false;
+
+	// FNV-1a over the path and file identity. Size and mtime are checked inside the entry,
+	// so a changed library overwrites its old entry instead of piling up new ones.
+	u64 hash = 0xcbf29ce484222325;
+	for (const char* c = path; *c; c++)
+		hash = (hash ^ (u8)*c) * 0x100000001b3;
+	const u64 ident[2] = { st->st_dev, st->st_ino };
+	for (size i = 0; i < sizeof(ident); i++)
+		hash = (hash ^ ((const u8*)ident)[i]) * 0x100000001b3;
+
+	snprintf(out, CACHE_ENTRY_PATH_MAX, "%s/%016lx", cache_dir, hash);
+	return true;
+}
+
+bool cache_stamp_get(const str path, cache_stamp* stamp)
+{
+	struct stat st;
+	if (!path || !stamp || stat(path, &st) != 0)
+		return false;
+	*stamp = (cache_stamp) {
+		.dev = st.st_dev,
+		.ino = st.st_ino,
+		.size = st.st_size,
+		.mtime_sec = st.st_mtim.tv_sec,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+	};
+	return true;
+}
+
+static size cache_hashes_size(u64 num_syms)
+{
+	return ALIGN(num_syms * sizeof(u32), 8);
+}
+
+bool cache_load(const str path, resolve_lib* exports)
+{
+	if (!path || !exports)
+		return false;
+
+	struct stat st;
+	char entry_path[CACHE_ENTRY_PATH_MAX];
+	if (stat(path, &st) != 0 || !cache_entry_path(path, &st, entry_path))
+		return false;
+
+	const i32 fd = open(entry_path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat entry_st;
+	if (fstat(fd, &entry_st) != 0 || (size)entry_st.st_size < sizeof(cache_header))
+	{
+		close(fd);
+		return false;
+	}
+	const size map_size = (size)entry_st.st_size;
+	u8* map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	// Only use the entry if it belongs to exactly this version of the file.
+	const cache_header* hdr = (const cache_header*)map;
+	const size syms_off = sizeof(cache_header) + cache_hashes_size(hdr->num_syms);
+	const size strtab_off = syms_off + hdr->num_syms * sizeof(elf_symtab);
+	const size path_off = strtab_off + hdr->strtab_size;
+	if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+		hdr->dev != (u64)st.st_dev || hdr->ino != (u64)st.st_ino || hdr->size != (u64)st.st_size ||
+		hdr->mtime_sec != st.st_mtim.tv_sec || hdr->mtime_nsec != st.st_mtim.tv_nsec ||
+		hdr->num_syms > map_size || hdr->strtab_size > map_size || hdr->path_len > map_size || path_off + hdr->path_len != map_size ||
+		hdr->path_len != strlen(path) || memcmp(map + path_off, path, hdr->path_len))
+	{
+		munmap(map, map_size);
+		return false;
+	}
+
+	const u32* hashes = (const u32*)(map + sizeof(cache_header));
+	elf_symtab* syms = (elf_symtab*)(map + syms_off);
+	const str strtab = (str)(map + strtab_off);
+
+	// A truncated or corrupt entry is a miss, names have to point into a terminated string table.
+	bool ok = !hdr->num_syms || (hdr->strtab_size && strtab[hdr->strtab_size - 1] == '\0');
+	for (size i = 0; ok && i < hdr->num_syms; i++)
+		ok = syms[i].sym_name < hdr->strtab_size;
+	if (!ok)
+	{
+		munmap(map, map_size);
+		return false;
+	}
+
+	exports->syms = calloc(hdr->num_syms, sizeof(resolve_sym));
+	exports->num_syms = hdr->num_syms;
+	for (size i = 0; i < hdr->num_syms; i++)
+	{
+		exports->syms[i].name = strtab + syms[i].sym_name;
+		exports->syms[i].hash = hashes[i];
+		exports->syms[i].sym = syms + i;
+	}
+	exports->cache = map;
+	exports->cache_size = map_size;
+	return true;
+}
+
+void cache_store(const str path, const resolve_lib* exports)
+{
+	if (!path || !exports)
+		return;
+
+	struct stat st;
+	char entry_path[CACHE_ENTRY_PATH_MAX];
+	if (stat(path, &st) != 0 || !cache_entry_path(path, &st, entry_path))
+		return;
+
+	// Assemble the whole entry in memory.
+	size strtab_size = 0;
+	for (size i = 0; i < exports->num_syms; i++)
+		strtab_size += strlen(exports->syms[i].name) + 1;
+	const size path_len = strlen(path);
+	const size syms_off = sizeof(cache_header) + cache_hashes_size(exports->num_syms);
+	const size strtab_off = syms_off + exports->num_syms * sizeof(elf_symtab);
+	const size total = strtab_off + strtab_size + path_len;
+
+	u8* buf = calloc(1, total);
+	if (!buf)
+		return;
+	*(cache_header*)buf = (cache_header) {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.dev = st.st_dev,
+		.ino = st.st_ino,
+		.size = st.st_size,
+		.mtime_sec = st.st_mtim.tv_sec,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+		.num_syms = exports->num_syms,
+		.strtab_size = strtab_size,
+		.path_len = path_len,
+	};
+	u32* hashes = (u32*)(buf + sizeof(cache_header));
+	elf_symtab* syms = (elf_symtab*)(buf + syms_off);
+	u64 name_off = 0;
+	for (size i = 0; i < exports->num_syms; i++)
+	{
+		const size len = strlen(exports->syms[i].name) + 1;
+		hashes[i] = exports->syms[i].hash;
+		syms[i] = *exports->syms[i].sym;
+		syms[i].sym_name = (u32)name_off;
+		memcpy(buf + strtab_off + name_off, exports->syms[i].name, len);
+		name_off += len;
+	}
+	memcpy(buf + strtab_off + strtab_size, path, path_len);
+
+	// Write to a temporary file first, so readers never see a partial entry.
+	char tmp_path[CACHE_ENTRY_PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", entry_path);
+	const i32 fd = mkstemp(tmp_path);
+	if (fd < 0)
+	{
+		free(buf);
+		return;
+	}
+	bool ok = true;
+	for (size done = 0; ok && done < total;)
+	{
+		const ssize_t n = write(fd, buf + done, total - done);
+		ok = n > 0;
+		done += ok ? (size)n : 0;
+	}
+	close(fd);
+	if (!ok || rename(tmp_path, entry_path) != 0)
+	{
+		unlink(tmp_path);
+		log_msg(LOG_WARN, "couldn't write cache entry \"%s\"\n", entry_path);
+	}
+	free(buf);
+}
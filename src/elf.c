@@ -2,10 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <elf.h>
 #include <instr.h>
+#include <symindex.h>
 #include <log.h>
+#include <stats.h>
+#include <trace.h>
 
 bool elf_check(const elf_obj* elf)
 {
@@ -67,266 +76,548 @@ void elf_free(elf_obj* elf)
 {
 	// Deallocate all arrays.
 	if (!elf) return;
-	free(elf->sections);
-	free(elf->segments);
+	for (u16 i = 0; elf->sections && i < elf->header.e_shnum; i++)
+	{
+		free(elf->sections[i].entries);
+		symindex_free(elf->sections[i].index);
+	}
+	arena_free(&elf->mem);
+	if (elf->map)
+		munmap(elf->map, elf->map_size);
 
 	// Initialize all values to 0.
 	memset(elf, 0, sizeof(elf_obj));
 }
 
-elf_obj elf_read(const str file)
-{
-	if (!file)
-		log_msg(LOG_ERR, "failed to read ELF file, no path given!\n");
+// Fields of the on-disk headers and table entries in file order, as X(field, type, raw, order).
+// The raw layouts and a decoder and encoder for every class and byte order are all generated from these lists.
+#define ELF32_EHDR(X, raw, order) \
+	X(e_type, u16, raw, order) X(e_machine, u16, raw, order) X(e_version, u32, raw, order) \
+	X(e_entry, u32, raw, order) X(e_phoff, u32, raw, order) X(e_shoff, u32, raw, order) X(e_flags, u32, raw, order) \
+	X(e_ehsize, u16, raw, order) X(e_phentsize, u16, raw, order) X(e_phnum, u16, raw, order) \
+	X(e_shentsize, u16, raw, order) X(e_shnum, u16, raw, order) X(e_shstrndx, u16, raw, order)
+#define ELF64_EHDR(X, raw, order) \
+	X(e_type, u16, raw, order) X(e_machine, u16, raw, order) X(e_version, u32, raw, order) \
+	X(e_entry, u64, raw, order) X(e_phoff, u64, raw, order) X(e_shoff, u64, raw, order) X(e_flags, u32, raw, order) \
+	X(e_ehsize, u16, raw, order) X(e_phentsize, u16, raw, order) X(e_phnum, u16, raw, order) \
+	X(e_shentsize, u16, raw, order) X(e_shnum, u16, raw, order) X(e_shstrndx, u16, raw, order)
 
-	elf_obj elf = {0};
-	FILE* f = fopen(file, "r");
-	elf.file_name = file;
+// The flags of a program header moved between the two classes.
+#define ELF32_PHDR(X, raw, order) \
+	X(p_type, u32, raw, order) X(p_offset, u32, raw, order) X(p_vaddr, u32, raw, order) X(p_paddr, u32, raw, order) \
+	X(p_filesz, u32, raw, order) X(p_memsz, u32, raw, order) X(p_flags, u32, raw, order) X(p_align, u32, raw, order)
+#define ELF64_PHDR(X, raw, order) \
+	X(p_type, u32, raw, order) X(p_flags, u32, raw, order) X(p_offset, u64, raw, order) X(p_vaddr, u64, raw, order) \
+	X(p_paddr, u64, raw, order) X(p_filesz, u64, raw, order) X(p_memsz, u64, raw, order) X(p_align, u64, raw, order)
 
-	// Read header.
-	fread(&elf.header.e_ident_magic, sizeof(u32), 1, f);
-	fread(&elf.header.e_ident_class, sizeof(u8), 1, f);
-	fread(&elf.header.e_ident_data, sizeof(u8), 1, f);
-	fread(&elf.header.e_ident_version, sizeof(u8), 1, f);
-	fread(&elf.header.e_ident_osabi, sizeof(u8), 1, f);
-	fread(&elf.header.e_ident_abiversion, sizeof(u8), 1, f);
+#define ELF32_SHDR(X, raw, order) \
+	X(sh_name, u32, raw, order) X(sh_type, u32, raw, order) X(sh_flags, u32, raw, order) X(sh_addr, u32, raw, order) \
+	X(sh_offset, u32, raw, order) X(sh_size, u32, raw, order) X(sh_link, u32, raw, order) X(sh_info, u32, raw, order) \
+	X(sh_addralign, u32, raw, order) X(sh_entsize, u32, raw, order)
+#define ELF64_SHDR(X, raw, order) \
+	X(sh_name, u32, raw, order) X(sh_type, u32, raw, order) X(sh_flags, u64, raw, order) X(sh_addr, u64, raw, order) \
+	X(sh_offset, u64, raw, order) X(sh_size, u64, raw, order) X(sh_link, u32, raw, order) X(sh_info, u32, raw, order) \
+	X(sh_addralign, u64, raw, order) X(sh_entsize, u64, raw, order)
 
-	fseek(f, 7, SEEK_CUR);
+#define ELF32_SYM(X, raw, order) \
+	X(sym_name, u32, raw, order) X(sym_value, u32, raw, order) X(sym_size, u32, raw, order) \
+	X(sym_info, u8, raw, order) X(sym_other, u8, raw, order) X(sym_shndx, u16, raw, order)
+#define ELF64_SYM(X, raw, order) \
+	X(sym_name, u32, raw, order) X(sym_info, u8, raw, order) X(sym_other, u8, raw, order) \
+	X(sym_shndx, u16, raw, order) X(sym_value, u64, raw, order) X(sym_size, u64, raw, order)
 
-	fread(&elf.header.e_type, sizeof(u16), 1, f);
-	fread(&elf.header.e_machine, sizeof(u16), 1, f);
-	fread(&elf.header.e_version, sizeof(u32), 1, f);
+#define ELF32_RELA(X, raw, order) X(r_offset, u32, raw, order) X(r_info, u32, raw, order) X(r_addend, i32, raw, order)
+#define ELF64_RELA(X, raw, order) X(r_offset, u64, raw, order) X(r_info, u64, raw, order) X(r_addend, i64, raw, order)
+#define ELF32_REL(X, raw, order) X(r_offset, u32, raw, order) X(r_info, u32, raw, order)
+#define ELF64_REL(X, raw, order) X(r_offset, u64, raw, order) X(r_info, u64, raw, order)
 
-	if (elf.header.e_ident_class == 1)
-	{
-		fread(&elf.header.e_entry, sizeof(u32), 1, f);
-		fread(&elf.header.e_phoff, sizeof(u32), 1, f);
-		fread(&elf.header.e_shoff, sizeof(u32), 1, f);
+// On-disk layouts, so whole tables can be decoded in one go.
+#define ELF_FIELD(field, type, raw, order) type field;
+typedef struct { u8 e_ident[16]; ELF32_EHDR(ELF_FIELD, _, _) } elf32_ehdr;
+typedef struct { u8 e_ident[16]; ELF64_EHDR(ELF_FIELD, _, _) } elf64_ehdr;
+typedef struct { ELF32_PHDR(ELF_FIELD, _, _) } elf32_phdr;
+typedef struct { ELF64_PHDR(ELF_FIELD, _, _) } elf64_phdr;
+typedef struct { ELF32_SHDR(ELF_FIELD, _, _) } elf32_shdr;
+typedef struct { ELF64_SHDR(ELF_FIELD, _, _) } elf64_shdr;
+typedef struct { ELF32_SYM(ELF_FIELD, _, _) } elf32_sym;
+typedef struct { ELF64_SYM(ELF_FIELD, _, _) } elf64_sym;
+typedef struct { ELF32_RELA(ELF_FIELD, _, _) } elf32_rela;
+typedef struct { ELF64_RELA(ELF_FIELD, _, _) } elf64_rela;
+typedef struct { ELF32_REL(ELF_FIELD, _, _) } elf32_rel;
+typedef struct { ELF64_REL(ELF_FIELD, _, _) } elf64_rel;
+#undef ELF_FIELD
+
+_Static_assert(sizeof(elf32_ehdr) == 52 && sizeof(elf64_ehdr) == 64, "ELF header layout");
+_Static_assert(sizeof(elf32_phdr) == 32 && sizeof(elf64_phdr) == 56, "program header layout");
+_Static_assert(sizeof(elf32_shdr) == 40 && sizeof(elf64_shdr) == 64, "section header layout");
+_Static_assert(sizeof(elf32_sym) == 16 && sizeof(elf64_sym) == 24, "symbol layout");
+_Static_assert(sizeof(elf32_rela) == 12 && sizeof(elf64_rela) == 24, "relocation layout");
+
+// Our in-memory headers, symbols and relocations have the exact ELF64 layout.
+_Static_assert(sizeof(elf_program_header) == sizeof(elf64_phdr), "elf_program_header must match Elf64_Phdr");
+_Static_assert(sizeof(elf_section_header) == sizeof(elf64_shdr), "elf_section_header must match Elf64_Shdr");
+_Static_assert(sizeof(elf_symtab) == sizeof(elf64_sym), "elf_symtab must match Elf64_Sym");
+_Static_assert(sizeof(elf_rela) == sizeof(elf64_rela), "elf_rela must match Elf64_Rela");
+
+// Loads and stores of single fields, either in the byte order of the host or the other one.
+#define ELF_ACCESS(type, bits) \
+	static inline type elf_ld_native_##type(const u8* p) { type v; memcpy(&v, p, sizeof(v)); return v; } \
+	static inline type elf_ld_swap_##type(const u8* p) { return (type)__builtin_bswap##bits((u##bits)elf_ld_native_##type(p)); } \
+	static inline void elf_st_native_##type(u8* p, type v) { memcpy(p, &v, sizeof(v)); } \
+	static inline void elf_st_swap_##type(u8* p, type v) { elf_st_native_##type(p, (type)__builtin_bswap##bits((u##bits)v)); }
+ELF_ACCESS(u16, 16)
+ELF_ACCESS(u32, 32)
+ELF_ACCESS(u64, 64)
+ELF_ACCESS(i32, 32)
+ELF_ACCESS(i64, 64)
+#undef ELF_ACCESS
+static inline u8 elf_ld_native_u8(const u8* p) { return *p; }
+static inline u8 elf_ld_swap_u8(const u8* p) { return *p; }
+static inline void elf_st_native_u8(u8* p, u8 v) { *p = v; }
+static inline void elf_st_swap_u8(u8* p, u8 v) { *p = v; }
+
+#define ELF_GET(field, type, raw, order) out->field = elf_ld_##order##_##type(in + offsetof(raw, field));
+#define ELF_PUT(field, type, raw, order) elf_st_##order##_##type(out + offsetof(raw, field), (type)in->field);
+
+// ELF32 packs the symbol into the upper 24 bits of `r_info`, ELF64 into the upper 32.
+#define ELF_R_INFO_32(info) (((u64)((info) >> 8) << 32) | ((info) & 0xff))
+#define ELF_R_INFO_64(info) (info)
+
+// Generates the decoders and encoders of one class and byte order. None of them branch per field.
+// Native ELF64 program headers are copied as a whole instead, so those can go unused.
+#define ELF_CODEC(cls, order) \
+	static void elf_get_ehdr_##cls##_##order(const u8* in, elf_header* out) { ELF##cls##_EHDR(ELF_GET, elf##cls##_ehdr, order) } \
+	static void elf_put_ehdr_##cls##_##order(const elf_header* in, u8* out) { ELF##cls##_EHDR(ELF_PUT, elf##cls##_ehdr, order) } \
+	__attribute__((unused)) static void elf_get_phdrs_##cls##_##order(const u8* tbl, size num, elf_segment* segs) \
+	{ \
+		for (size i = 0; i < num; i++) \
+		{ \
+			const u8* in = tbl + i * sizeof(elf##cls##_phdr); \
+			elf_program_header* out = &segs[i].header; \
+			ELF##cls##_PHDR(ELF_GET, elf##cls##_phdr, order) \
+		} \
+	} \
+	__attribute__((unused)) static void elf_put_phdrs_##cls##_##order(const elf_segment* segs, size num, u8* tbl) \
+	{ \
+		for (size i = 0; i < num; i++) \
+		{ \
+			const elf_program_header* in = &segs[i].header; \
+			u8* out = tbl + i * sizeof(elf##cls##_phdr); \
+			ELF##cls##_PHDR(ELF_PUT, elf##cls##_phdr, order) \
+		} \
+	} \
+	static void elf_get_shdr_##cls##_##order(const u8* in, elf_section_header* out) { ELF##cls##_SHDR(ELF_GET, elf##cls##_shdr, order) } \
+	static void elf_put_shdr_##cls##_##order(const elf_section_header* in, u8* out) { ELF##cls##_SHDR(ELF_PUT, elf##cls##_shdr, order) } \
+	static void elf_get_syms_##cls##_##order(const u8* tbl, size num, void* syms) \
+	{ \
+		for (size i = 0; i < num; i++) \
+		{ \
+			const u8* in = tbl + i * sizeof(elf##cls##_sym); \
+			elf_symtab* out = (elf_symtab*)syms + i; \
+			ELF##cls##_SYM(ELF_GET, elf##cls##_sym, order) \
+		} \
+	} \
+	static void elf_get_relas_##cls##_##order(const u8* tbl, size num, void* relocs) \
+	{ \
+		for (size i = 0; i < num; i++) \
+		{ \
+			const u8* in = tbl + i * sizeof(elf##cls##_rela); \
+			elf_rela* out = (elf_rela*)relocs + i; \
+			ELF##cls##_RELA(ELF_GET, elf##cls##_rela, order) \
+			out->r_info = ELF_R_INFO_##cls(out->r_info); \
+		} \
+	} \
+	static void elf_get_rels_##cls##_##order(const u8* tbl, size num, void* relocs) \
+	{ \
+		for (size i = 0; i < num; i++) \
+		{ \
+			const u8* in = tbl + i * sizeof(elf##cls##_rel); \
+			elf_rela* out = (elf_rela*)relocs + i; \
+			ELF##cls##_REL(ELF_GET, elf##cls##_rel, order) \
+			out->r_info = ELF_R_INFO_##cls(out->r_info); \
+			out->r_addend = 0; \
+		} \
 	}
-	else
-	{
-		fread(&elf.header.e_entry, sizeof(u64), 1, f);
-		fread(&elf.header.e_phoff, sizeof(u64), 1, f);
-		fread(&elf.header.e_shoff, sizeof(u64), 1, f);
+ELF_CODEC(32, native)
+ELF_CODEC(32, swap)
+ELF_CODEC(64, native)
+ELF_CODEC(64, swap)
+#undef ELF_CODEC
+#undef ELF_GET
+#undef ELF_PUT
+
+// Our headers have the ELF64 layout already, so native ELF64 program headers are copied as they are.
+static void elf_get_phdrs_64_bulk(const u8* tbl, size num, elf_segment* segs)
+{
+	for (size i = 0; i < num; i++)
+		memcpy(&segs[i].header, tbl + i * sizeof(elf64_phdr), sizeof(elf64_phdr));
+}
+
+static void elf_put_phdrs_64_bulk(const elf_segment* segs, size num, u8* tbl)
+{
+	for (size i = 0; i < num; i++)
+		memcpy(tbl + i * sizeof(elf64_phdr), &segs[i].header, sizeof(elf64_phdr));
+}
+
+struct elf_codec
+{
+	u16 ehsize;
+	u16 phentsize;
+	u16 shentsize;
+	u16 symentsize;
+	u16 relaentsize;
+	u16 relentsize;
+	/// `true` if symbols and relocations can be used straight from the file.
+	bool native;
+	/// `true` if the file doesn't use the byte order of the host.
+	bool swapped;
+	void (*get_ehdr)(const u8* in, elf_header* out);
+	void (*put_ehdr)(const elf_header* in, u8* out);
+	void (*get_phdrs)(const u8* in, size num, elf_segment* out);
+	void (*put_phdrs)(const elf_segment* in, size num, u8* out);
+	void (*get_shdr)(const u8* in, elf_section_header* out);
+	void (*put_shdr)(const elf_section_header* in, u8* out);
+	void (*get_syms)(const u8* in, size num, void* out);
+	void (*get_relas)(const u8* in, size num, void* out);
+	void (*get_rels)(const u8* in, size num, void* out);
+};
+
+#define ELF_CODEC_ENTRY(cls, order, phdrs, native, swapped) \
+	{ \
+		sizeof(elf##cls##_ehdr), sizeof(elf##cls##_phdr), sizeof(elf##cls##_shdr), sizeof(elf##cls##_sym), \
+		sizeof(elf##cls##_rela), sizeof(elf##cls##_rel), native, swapped, \
+		elf_get_ehdr_##cls##_##order, elf_put_ehdr_##cls##_##order, elf_get_phdrs_##phdrs, elf_put_phdrs_##phdrs, \
+		elf_get_shdr_##cls##_##order, elf_put_shdr_##cls##_##order, \
+		elf_get_syms_##cls##_##order, elf_get_relas_##cls##_##order, elf_get_rels_##cls##_##order, \
 	}
 
-	fread(&elf.header.e_flags, sizeof(u32), 1, f);
-	fread(&elf.header.e_ehsize, sizeof(u16), 1, f);
-	fread(&elf.header.e_phentsize, sizeof(u16), 1, f);
-	fread(&elf.header.e_phnum, sizeof(u16), 1, f);
-	fread(&elf.header.e_shentsize, sizeof(u16), 1, f);
-	fread(&elf.header.e_shnum, sizeof(u16), 1, f);
-	fread(&elf.header.e_shstrndx, sizeof(u16), 1, f);
+// Indexed by [ELF64][byte order differs from the host].
+static const elf_codec elf_codecs[2][2] = {
+	{ ELF_CODEC_ENTRY(32, native, 32_native, false, false), ELF_CODEC_ENTRY(32, swap, 32_swap, false, true) },
+	{ ELF_CODEC_ENTRY(64, native, 64_bulk, true, false), ELF_CODEC_ENTRY(64, swap, 64_swap, false, true) },
+};
+#undef ELF_CODEC_ENTRY
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ELF_HOST_DATA 1
+#else
+#define ELF_HOST_DATA 2
+#endif
+
+static bool elf_read_header(elf_obj* elf)
+{
+	if (elf->map_size < sizeof(elf32_ehdr))
+		return log_msg(LOG_ERR, "[%s] file is too small to be an ELF!\n", basename(elf->file_name));
+
+	// The identification bytes are the same for both classes.
+	memcpy(&elf->header.e_ident_magic, elf->map, sizeof(u32));
+	elf->header.e_ident_class = elf->map[4];
+	elf->header.e_ident_data = elf->map[5];
+	elf->header.e_ident_version = elf->map[6];
+	elf->header.e_ident_osabi = elf->map[7];
+	elf->header.e_ident_abiversion = elf->map[8];
 
-	// Check header for validity.
-	elf_check(&elf);
+	// Leave anything we can't decode to `elf_check`.
+	if ((elf->header.e_ident_class != 1 && elf->header.e_ident_class != 2) ||
+		(elf->header.e_ident_data != 1 && elf->header.e_ident_data != 2))
+		return true;
+	elf->codec = &elf_codecs[elf->header.e_ident_class == 2][elf->header.e_ident_data != ELF_HOST_DATA];
+	if (elf->map_size < elf->codec->ehsize)
+		return log_msg(LOG_ERR, "[%s] file is too small to be an ELF!\n", basename(elf->file_name));
+	elf->codec->get_ehdr(elf->map, &elf->header);
+	return true;
+}
+
+// Checks if `len` bytes at `off` lie within the mapped file.
+static bool elf_in_bounds(const elf_obj* elf, u64 off, u64 len)
+{
+	return off <= elf->map_size && len <= elf->map_size - off;
+}
+
+static bool elf_read_tables(elf_obj* elf)
+{
+	const elf_codec* codec = elf->codec;
+	const u16 phentsize = codec->phentsize;
+	const u16 shentsize = codec->shentsize;
+
+	// Make sure both tables are fully contained in the file, without overflowing on hostile offsets.
+	if (elf->header.e_phnum && (elf->header.e_phentsize != phentsize ||
+		!elf_in_bounds(elf, elf->header.e_phoff, (u64)elf->header.e_phnum * phentsize)))
+		return log_msg(LOG_ERR, "[%s] program header table is out of bounds!\n", basename(elf->file_name));
+	if (elf->header.e_shnum && (elf->header.e_shentsize != shentsize ||
+		!elf_in_bounds(elf, elf->header.e_shoff, (u64)elf->header.e_shnum * shentsize)))
+		return log_msg(LOG_ERR, "[%s] section header table is out of bounds!\n", basename(elf->file_name));
 
 	// Read program headers.
-	fseek(f, elf.header.e_phoff, SEEK_SET);
-	elf.segments = calloc(elf.header.e_phnum, sizeof(elf_segment));
-	for (u16 i = 0; i < elf.header.e_phnum; i++)
+	elf->segments = arena_calloc(&elf->mem, elf->header.e_phnum, sizeof(elf_segment));
+	elf->segments_cap = elf->header.e_phnum;
+	codec->get_phdrs(elf->map + elf->header.e_phoff, elf->header.e_phnum, elf->segments);
+
+	// Read section headers.
+	const u8* shdr = elf->map + elf->header.e_shoff;
+	elf->sections = arena_calloc(&elf->mem, elf->header.e_shnum, sizeof(elf_section));
+	elf->sections_cap = elf->header.e_shnum;
+	for (u16 i = 0; i < elf->header.e_shnum; i++)
 	{
-		fread(&elf.segments[i].header.p_type, sizeof(u32), 1, f);
-		if (elf.header.e_ident_class == 1)
-		{
-			fread(&elf.segments[i].header.p_offset, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_vaddr, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_paddr, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_filesz, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_memsz, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_flags, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_align, sizeof(u32), 1, f);
-		}
-		else
+		elf_section_header* hdr = &elf->sections[i].header;
+		codec->get_shdr(shdr + (size)i * shentsize, hdr);
+
+		// Section bodies are only loaded once something asks for them, see `elf_section_data`.
+		if (hdr->sh_type != SHT_NOBITS && elf_in_bounds(elf, hdr->sh_offset, hdr->sh_size))
 		{
-			fread(&elf.segments[i].header.p_flags, sizeof(u32), 1, f);
-			fread(&elf.segments[i].header.p_offset, sizeof(u64), 1, f);
-			fread(&elf.segments[i].header.p_vaddr, sizeof(u64), 1, f);
-			fread(&elf.segments[i].header.p_paddr, sizeof(u64), 1, f);
-			fread(&elf.segments[i].header.p_filesz, sizeof(u64), 1, f);
-			fread(&elf.segments[i].header.p_memsz, sizeof(u64), 1, f);
-			fread(&elf.segments[i].header.p_align, sizeof(u64), 1, f);
+			elf->sections[i].file_offset = hdr->sh_offset;
+			elf->sections[i].file_size = hdr->sh_size;
 		}
+
+		// Remember where the dynamic symbols live, so lookups don't have to search for them.
+		if (hdr->sh_type == SHT_DYNSYM)
+			elf->dynsym_idx = i;
+		else if (hdr->sh_type == SHT_GNU_HASH)
+			elf->gnu_hash_idx = i;
+		else if (hdr->sh_type == SHT_HASH)
+			elf->hash_idx = i;
 	}
 
-	// Read section headers.
-	fseek(f, elf.header.e_shoff, SEEK_SET);
-	elf.sections = calloc(elf.header.e_shnum, sizeof(elf_section));
-	for (u16 i = 0; i < elf.header.e_shnum; i++)
+	if (elf->header.e_shstrndx >= elf->header.e_shnum || !elf_section_data(elf, elf->sections + elf->header.e_shstrndx))
+		return log_msg(LOG_ERR, "[%s] invalid section header string table index! (%hu)\n",
+			basename(elf->file_name), elf->header.e_shstrndx);
+	return true;
+}
+
+elf_obj elf_read(const str file)
+{
+	const stats_clock start = stats_start();
+	const u64 span = trace_begin();
+	elf_obj elf = {0};
+	if (!file)
 	{
-		fread(&elf.sections[i].header.sh_name, sizeof(u32), 1, f);
-		fread(&elf.sections[i].header.sh_type, sizeof(u32), 1, f);
-		if (elf.header.e_ident_class == 1)
-		{
-			fread(&elf.sections[i].header.sh_flags, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_addr, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_offset, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_size, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_link, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_info, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_addralign, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_entsize, sizeof(u32), 1, f);
-		}
-		else
-		{
-			fread(&elf.sections[i].header.sh_flags, sizeof(u64), 1, f);
-			fread(&elf.sections[i].header.sh_addr, sizeof(u64), 1, f);
-			fread(&elf.sections[i].header.sh_offset, sizeof(u64), 1, f);
-			fread(&elf.sections[i].header.sh_size, sizeof(u64), 1, f);
-			fread(&elf.sections[i].header.sh_link, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_info, sizeof(u32), 1, f);
-			fread(&elf.sections[i].header.sh_addralign, sizeof(u64), 1, f);
-			fread(&elf.sections[i].header.sh_entsize, sizeof(u64), 1, f);
-		}
+		log_msg(LOG_ERR, "failed to read ELF file, no path given!\n");
+		return elf;
 	}
+	elf.file_name = file;
 
-	// Read section bodies.
-	for (u16 i = 0; i < elf.header.e_shnum; i++)
+	// Map the whole file once, all section bodies are views into it.
+	const i32 fd = open(file, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		log_msg(LOG_ERR, "[%s] failed to open file: %s\n", basename(file), strerror(errno));
+		if (fd >= 0) close(fd);
+		return elf;
+	}
+	elf.map_size = (size)st.st_size;
+	elf.map = elf.map_size ? mmap(NULL, elf.map_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (elf.map == MAP_FAILED)
 	{
-		elf.sections[i].data = malloc(elf.sections[i].header.sh_size);
-		fseek(f, elf.sections[i].header.sh_offset, SEEK_SET);
-		fread(elf.sections[i].data, sizeof(u8), elf.sections[i].header.sh_size, f);
+		elf.map = NULL;
+		log_msg(LOG_ERR, "[%s] failed to map file: %s\n", basename(file), strerror(errno));
+		return elf;
 	}
+	// Don't read ahead, most of a library (debug info, unwind tables, ...) is never looked at.
+	if (elf.map)
+		madvise(elf.map, elf.map_size, MADV_RANDOM);
 
-	// Keep a copy of the old header before we modify it.
-	elf.old_header = elf.header;
+	// Read and check the header for validity.
+	if (!elf_read_header(&elf) || !elf_check(&elf) || !elf_read_tables(&elf))
+	{
+		elf_free(&elf);
+		return elf;
+	}
 
-	// Clean up.
-	fclose(f);
+	stats_count(STATS_BYTES_READ, elf.header.e_ehsize + (u64)elf.header.e_phnum * elf.header.e_phentsize +
+		(u64)elf.header.e_shnum * elf.header.e_shentsize);
+	stats_stop(STATS_READ, start);
+	stats_file(file, elf.map_size, start);
+	trace_end("elf_read", file, NULL, span);
 	return elf;
 }
 
+// Linux and most other systems accept at least this many buffers per vectored write.
+#define ELF_IOV_MAX 1024
+
+// A contiguous piece of the output file.
+typedef struct
+{
+	u64 offset;
+	const void* data;
+	u64 len;
+} elf_extent;
+
+static i32 elf_extent_cmp(const void* a, const void* b)
+{
+	const elf_extent* x = a;
+	const elf_extent* y = b;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static size elf_encode_header(const elf_obj* elf, const elf_codec* codec, u8* buf)
+{
+	memset(buf, 0, codec->ehsize);
+	memcpy(buf, &elf->header.e_ident_magic, sizeof(u32));
+	buf[4] = elf->header.e_ident_class;
+	buf[5] = elf->header.e_ident_data;
+	buf[6] = elf->header.e_ident_version;
+	buf[7] = elf->header.e_ident_osabi;
+	buf[8] = elf->header.e_ident_abiversion;
+	codec->put_ehdr(&elf->header, buf);
+	return codec->ehsize;
+}
+
+// Writes a batch of buffers to consecutive file offsets, continuing partial writes where they stopped.
+static bool elf_writev(i32 fd, struct iovec* iov, i32 num_iov, u64 offset)
+{
+	while (num_iov > 0)
+	{
+		const ssize_t n = pwritev(fd, iov, num_iov, (off_t)offset);
+		if (n <= 0)
+			return false;
+		stats_count(STATS_BYTES_WRITTEN, (u64)n);
+		offset += (u64)n;
+		size done = (size)n;
+		while (num_iov > 0 && done >= iov->iov_len)
+		{
+			done -= iov->iov_len;
+			iov++;
+			num_iov--;
+		}
+		if (num_iov > 0)
+		{
+			iov->iov_base = (u8*)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return true;
+}
+
 void elf_write(const str path, const elf_obj* elf)
 {
 	if (!path)
+	{
 		log_msg(LOG_ERR, "no path given to write to!\n");
+		return;
+	}
 	if (!elf)
+	{
 		log_msg(LOG_ERR, "no object given to write!\n");
+		return;
+	}
+
+	if (!elf_check(elf))
+		return;
 
-	elf_check(elf);
+	const stats_clock start = stats_start();
+	const u64 span = trace_begin();
 
-	FILE* f = fopen(path, "w");
-	fseek(f, 0, SEEK_SET);
+	// The header may have been changed since reading, so it decides how the file gets encoded.
+	const elf_codec* codec = &elf_codecs[elf->header.e_ident_class == 2][elf->header.e_ident_data != ELF_HOST_DATA];
+	const u16 num_seg = elf->header.e_phnum;
+	const u16 num_sect = elf->header.e_shnum;
+	arena mem = {0};
 
-	// Write header.
-	fwrite(&elf->header.e_ident_magic, sizeof(u32), 1, f);
-	fwrite(&elf->header.e_ident_class, sizeof(u8), 1, f);
-	fwrite(&elf->header.e_ident_data, sizeof(u8), 1, f);
-	fwrite(&elf->header.e_ident_version, sizeof(u8), 1, f);
-	fwrite(&elf->header.e_ident_osabi, sizeof(u8), 1, f);
-	fwrite(&elf->header.e_ident_abiversion, sizeof(u8), 1, f);
+	// The offsets in the headers are final, modified files get laid out by `layout_plan` before.
+	// Encode the headers.
+	u8 ehdr[sizeof(elf64_ehdr)];
+	const size ehdr_len = elf_encode_header(elf, codec, ehdr);
 
-	fseek(f, 7, SEEK_CUR);
+	const size phentsize = codec->phentsize;
+	u8* phdrs = arena_alloc(&mem, num_seg * phentsize);
+	codec->put_phdrs(elf->segments, num_seg, phdrs);
 
-	fwrite(&elf->header.e_type, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_machine, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_version, sizeof(u32), 1, f);
+	const size shentsize = codec->shentsize;
+	u8* shdrs = arena_alloc(&mem, num_sect * shentsize);
+	for (u16 i = 0; i < num_sect; i++)
+		codec->put_shdr(&elf->sections[i].header, shdrs + i * shentsize);
 
-	if (elf->header.e_ident_class == 1)
+	// Collect every piece of the file in write order. Section bodies are taken straight from the input mapping.
+	size num_ext = 0;
+	elf_extent* ext = arena_alloc(&mem, (3 + (size)num_sect) * sizeof(elf_extent));
+	ext[num_ext++] = (elf_extent) { 0, ehdr, ehdr_len };
+	if (num_seg)
+		ext[num_ext++] = (elf_extent) { elf->header.e_phoff, phdrs, num_seg * phentsize };
+	for (u16 i = 0; i < num_sect; i++)
 	{
-		fwrite(&elf->header.e_entry, sizeof(u32), 1, f);
-		fwrite(&elf->header.e_phoff, sizeof(u32), 1, f);
-		fwrite(&elf->header.e_shoff, sizeof(u32), 1, f);
+		const u8* data = elf_section_data(elf, elf->sections + i);
+		if (data && elf->sections[i].header.sh_size && elf->sections[i].header.sh_type != SHT_NOBITS)
+			ext[num_ext++] = (elf_extent) { elf->sections[i].header.sh_offset, data, elf->sections[i].header.sh_size };
 	}
-	else
+	if (num_sect)
+		ext[num_ext++] = (elf_extent) { elf->header.e_shoff, shdrs, num_sect * shentsize };
+
+	u64 file_size = 0;
+	for (size i = 0; i < num_ext; i++)
 	{
-		fwrite(&elf->header.e_entry, sizeof(u64), 1, f);
-		fwrite(&elf->header.e_phoff, sizeof(u64), 1, f);
-		fwrite(&elf->header.e_shoff, sizeof(u64), 1, f);
+		if (ext[i].offset + ext[i].len > file_size)
+			file_size = ext[i].offset + ext[i].len;
 	}
 
-	fwrite(&elf->header.e_flags, sizeof(u32), 1, f);
-	fwrite(&elf->header.e_ehsize, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_phentsize, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_phnum, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_shentsize, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_shnum, sizeof(u16), 1, f);
-	fwrite(&elf->header.e_shstrndx, sizeof(u16), 1, f);
-
-	fseeko(f, (off_t)elf->header.e_phoff, SEEK_SET);
-
-	fseeko(f, (off_t)elf->header.e_phoff, SEEK_SET);
-	for (u16 i = 0; i < elf->header.e_phnum; i++)
+	// If pieces overlap, later ones win. Resolve that by assembling the file in memory.
+	bool overlap = false;
+	elf_extent* sorted = arena_alloc(&mem, num_ext * sizeof(elf_extent));
+	memcpy(sorted, ext, num_ext * sizeof(elf_extent));
+	qsort(sorted, num_ext, sizeof(elf_extent), elf_extent_cmp);
+	for (size i = 1; i < num_ext && !overlap; i++)
+		overlap = sorted[i].offset < sorted[i - 1].offset + sorted[i - 1].len;
+	if (overlap)
 	{
-		fwrite(&elf->segments[i].header.p_type, sizeof(u32), 1, f);
-		if (elf->header.e_ident_class == 1)
-		{
-			fwrite(&elf->segments[i].header.p_offset, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_vaddr, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_paddr, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_filesz, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_memsz, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_flags, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_align, sizeof(u32), 1, f);
-		}
-		else
-		{
-			fwrite(&elf->segments[i].header.p_flags, sizeof(u32), 1, f);
-			fwrite(&elf->segments[i].header.p_offset, sizeof(u64), 1, f);
-			fwrite(&elf->segments[i].header.p_vaddr, sizeof(u64), 1, f);
-			fwrite(&elf->segments[i].header.p_paddr, sizeof(u64), 1, f);
-			fwrite(&elf->segments[i].header.p_filesz, sizeof(u64), 1, f);
-			fwrite(&elf->segments[i].header.p_memsz, sizeof(u64), 1, f);
-			fwrite(&elf->segments[i].header.p_align, sizeof(u64), 1, f);
-		}
+		u8* buf = arena_calloc(&mem, file_size, 1);
+		for (size i = 0; i < num_ext; i++)
+			memcpy(buf + ext[i].offset, ext[i].data, ext[i].len);
+		sorted[0] = (elf_extent) { 0, buf, file_size };
+		num_ext = 1;
 	}
 
-	// Write the section bodies.
-	for (u16 i = 0; i < elf->header.e_shnum; i++)
+	const i32 fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
 	{
-		// Important: First check if this sections overlaps with the previous one.
-		// In that case, move the offset away from it.
-		if (i != 0 && elf->sections[i].header.sh_offset <= elf->sections[i - 1].header.sh_offset +
-														   elf->sections[i - 1].header.sh_size)
-			elf->sections[i].header.sh_offset = elf->sections[i - 1].header.sh_offset +
-												elf->sections[i - 1].header.sh_size;
-
-		// Seek to the offset given by each section header.
-		fseek(f, elf->sections[i].header.sh_offset, SEEK_SET);
-		// Write the data.
-		fwrite(elf->sections[i].data, sizeof(u8), elf->sections[i].header.sh_size, f);
+		arena_free(&mem);
+		log_msg(LOG_ERR, "failed to open \"%s\" for writing: %s\n", path, strerror(errno));
+		return;
 	}
 
-	// Write the section headers.
-	fseek(f, (long)elf->header.e_shoff, SEEK_SET);
-	for (u16 i = 0; i < elf->header.e_shnum; i++)
+	// Write the whole file front to back in as few calls as possible.
+	static const u8 zeroes[4096] = {0};
+	struct iovec iov[ELF_IOV_MAX];
+	i32 num_iov = 0;
+	u64 pos = 0, batch = 0;
+	bool ok = true;
+	for (size i = 0; i < num_ext && ok; i++)
 	{
-		fwrite(&elf->sections[i].header.sh_name, sizeof(u32), 1, f);
-		fwrite(&elf->sections[i].header.sh_type, sizeof(u32), 1, f);
-		if (elf->header.e_ident_class == 1)
+		// Small gaps get filled with zeroes to keep the batch contiguous, large ones stay holes.
+		const u64 gap = sorted[i].offset - pos;
+		if (gap > sizeof(zeroes) || num_iov >= ELF_IOV_MAX - 1)
 		{
-			fwrite(&elf->sections[i].header.sh_flags, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_addr, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_offset, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_size, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_link, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_info, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_addralign, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_entsize, sizeof(u32), 1, f);
-		}
-		else
-		{
-			fwrite(&elf->sections[i].header.sh_flags, sizeof(u64), 1, f);
-			fwrite(&elf->sections[i].header.sh_addr, sizeof(u64), 1, f);
-			fwrite(&elf->sections[i].header.sh_offset, sizeof(u64), 1, f);
-			fwrite(&elf->sections[i].header.sh_size, sizeof(u64), 1, f);
-			fwrite(&elf->sections[i].header.sh_link, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_info, sizeof(u32), 1, f);
-			fwrite(&elf->sections[i].header.sh_addralign, sizeof(u64), 1, f);
-			fwrite(&elf->sections[i].header.sh_entsize, sizeof(u64), 1, f);
+			ok = elf_writev(fd, iov, num_iov, batch);
+			num_iov = 0;
+			batch = sorted[i].offset;
 		}
+		else if (gap)
+			iov[num_iov++] = (struct iovec) { (void*)zeroes, gap };
+		iov[num_iov++] = (struct iovec) { (void*)sorted[i].data, sorted[i].len };
+		pos = sorted[i].offset + sorted[i].len;
 	}
+	ok = ok && elf_writev(fd, iov, num_iov, batch);
+	close(fd);
+	arena_free(&mem);
 
-	// Clean up.
-	fclose(f);
+	stats_stop(STATS_WRITE, start);
+	trace_end("elf_write", path, NULL, span);
+	if (!ok)
+		log_msg(LOG_ERR, "failed to write \"%s\": %s\n", path, strerror(errno));
 }
 
 elf_section* elf_section_get(const elf_obj* elf, const str name)
 {
 	if (!name)
+	{
 		log_msg(LOG_ERR, "couldn't find a section, no name given!\n");
+		return NULL;
+	}
 	if (!elf)
+	{
 		log_msg(LOG_ERR, "couldn't find section \"%s\", no ELF given!\n", name);
+		return NULL;
+	}
 
 	// For every section header.
 	for (u16 sect = 0; sect < elf->header.e_shnum; sect++)
@@ -341,6 +632,24 @@ elf_section* elf_section_get(const elf_obj* elf, const str name)
 	return NULL;
 }
 
+elf_section* elf_section_at(const elf_obj* elf, u64 addr)
+{
+	if (!elf)
+	{
+		log_msg(LOG_ERR, "couldn't find a section at %#lx, no ELF given!\n", addr);
+		return NULL;
+	}
+
+	for (u16 sect = 1; sect < elf->header.e_shnum; sect++)
+	{
+		const elf_section_header* hdr = &elf->sections[sect].header;
+		// Only SHF_ALLOC sections have a meaningful address.
+		if ((hdr->sh_flags & 2) && addr >= hdr->sh_addr && addr < hdr->sh_addr + hdr->sh_size)
+			return elf->sections + sect;
+	}
+	return NULL;
+}
+
 u16 elf_section_get_idx(const elf_obj* elf, const elf_section* sect)
 {
 	return (u16)((size)(sect - elf->sections) / sizeof(elf_section));
@@ -349,22 +658,34 @@ u16 elf_section_get_idx(const elf_obj* elf, const elf_section* sect)
 str elf_section_get_name(const elf_obj* elf, u16 idx)
 {
 	if (!elf)
+	{
 		log_msg(LOG_ERR, "failed to get section name, no ELF given!\n");
+		return NULL;
+	}
 	if (idx > elf->header.e_shnum)
+	{
 		log_msg(LOG_ERR, "[%s] failed to get section name, index was out of bounds! (idx = %i, e_shnum = %i)\n", basename(elf->file_name), idx, elf->header.e_shnum);
+		return NULL;
+	}
 
 	// Get the start of the section header string table.
-	u8* shstrtab = elf->sections[elf->header.e_shstrndx].data;
+	u8* shstrtab = elf_section_data(elf, elf->sections + elf->header.e_shstrndx);
 	// Add the offset of the name on top.
 	return (char*)(shstrtab + elf->sections[idx].header.sh_name);
 }
 
-elf_section* elf_section_add(elf_obj* elf, const str name, u64 off)
+elf_section* elf_section_add(elf_obj* elf, const str name)
 {
 	if (!elf)
+	{
 		log_msg(LOG_ERR, "failed to add section, no target given!");
+		return NULL;
+	}
 	if (!name)
+	{
 		log_msg(LOG_ERR, "[%s] failed to add section, no name given.", basename(elf->file_name));
+		return NULL;
+	}
 
 	// If the section already exists, return that.
 	elf_section* find = elf_section_get(elf, name);
@@ -373,47 +694,386 @@ elf_section* elf_section_add(elf_obj* elf, const str name, u64 off)
 
 	// Make room for a new entry.
 	elf->header.e_shnum++;
-	elf->sections = reallocarray(elf->sections, elf->header.e_shnum, sizeof(elf_section));
+	if (elf->header.e_shnum > elf->sections_cap)
+	{
+		const u16 cap = elf->sections_cap ? elf->sections_cap * 2 : 8;
+		elf->sections = arena_realloc(&elf->mem, elf->sections,
+			elf->sections_cap * sizeof(elf_section), cap * sizeof(elf_section));
+		elf->sections_cap = cap;
+	}
+	memset(elf->sections + (elf->header.e_shnum - 1), 0, sizeof(elf_section));
 
 	// Add the section name to the section header string table.
 	elf_section* shstrtab = elf_section_get(elf, ".shstrtab");
 	const u64 old_size = shstrtab->header.sh_size;
 	const u64 new_size = old_size + strlen(name) + 1;
+	memcpy(elf_section_reserve(elf, shstrtab, new_size) + old_size, name, strlen(name) + 1);
 	shstrtab->header.sh_size = new_size;
-	shstrtab->data = realloc(shstrtab->data, new_size);
-	memcpy(shstrtab->data + old_size, name, strlen(name) + 1);
 
-	// Initialize the new section.
+	// Initialize the new section, the layout decides where it goes in memory and in the file.
 	elf_section* result = elf->sections + (elf->header.e_shnum - 1);
-	const elf_section_header hdr = elf->sections[elf->header.e_shnum - 2].header;
-	result->header.sh_offset = hdr.sh_offset + hdr.sh_size;
-	result->header.sh_addr = off;
-	result->header.sh_type = 1; // SH_PROGBITS
-	result->header.sh_flags = 6; // SH_WRITE_ALLOC
+	result->header.sh_type = SHT_PROGBITS;
+	result->header.sh_flags = 6; // SHF_ALLOC | SHF_EXECINSTR
 	result->header.sh_addralign = 1;
 	result->header.sh_name = old_size;
+	result->added = true;
+
+	stats_count(STATS_SECTIONS_ADDED, 1);
+	return result;
+}
+
+elf_segment* elf_segment_add(elf_obj* elf, const elf_program_header* hdr)
+{
+	if (!elf)
+	{
+		log_msg(LOG_ERR, "failed to add segment, no target given!\n");
+		return NULL;
+	}
 
-	// Create a new program header just for this section.
 	elf->header.e_phnum++;
-	elf->segments = reallocarray(elf->segments, elf->header.e_phnum, sizeof(elf_segment));
+	if (elf->header.e_phnum > elf->segments_cap)
+	{
+		const u16 cap = elf->segments_cap ? elf->segments_cap * 2 : 8;
+		elf->segments = arena_realloc(&elf->mem, elf->segments,
+			elf->segments_cap * sizeof(elf_segment), cap * sizeof(elf_segment));
+		elf->segments_cap = cap;
+	}
 	elf_segment* seg = elf->segments + (elf->header.e_phnum - 1);
-	seg->header.p_paddr = off;
-	seg->header.p_vaddr = off;
-	seg->header.p_type = 1; // PT_LOAD
-	seg->header.p_flags = 5; // PF_READ_EXEC
-	seg->header.p_offset = result->header.sh_offset;
-	seg->header.p_align = 4096;
+	memset(seg, 0, sizeof(elf_segment));
+	seg->header = *hdr;
+	seg->added = true;
 
-	return result;
+	stats_count(STATS_SEGMENTS_ADDED, 1);
+	return seg;
+}
+
+u8* elf_section_reserve(elf_obj* elf, elf_section* sect, u64 size)
+{
+	if (!elf)
+	{
+		log_msg(LOG_ERR, "failed to reserve section memory, no ELF given!\n");
+		return NULL;
+	}
+	if (!sect)
+	{
+		log_msg(LOG_ERR, "[%s] failed to reserve section memory, no section given!\n", basename(elf->file_name));
+		return NULL;
+	}
+
+	if (sect->owned && sect->capacity >= size)
+		return sect->data;
+
+	// Grow geometrically so repeated appends stay cheap.
+	u64 cap = sect->capacity ? sect->capacity : 64;
+	while (cap < size)
+		cap *= 2;
+
+	// Copy the body out of the file mapping on first write.
+	u8* buf;
+	if (sect->owned)
+		buf = arena_realloc(&elf->mem, sect->data, sect->capacity, cap);
+	else
+	{
+		const u8* data = elf_section_data(elf, sect);
+		buf = arena_alloc(&elf->mem, cap);
+		if (data)
+		{
+			memcpy(buf, data, sect->file_size < cap ? sect->file_size : cap);
+			stats_count(STATS_BYTES_COPIED, sect->file_size < cap ? sect->file_size : cap);
+		}
+	}
+
+	sect->data = buf;
+	sect->owned = true;
+	sect->capacity = cap;
+	// The decoded entries and the index don't follow changes of the body.
+	free(sect->entries);
+	sect->entries = NULL;
+	symindex_free(sect->index);
+	sect->index = NULL;
+	return buf;
+}
+
+u8* elf_section_data(const elf_obj* elf, elf_section* sect)
+{
+	u8* data = __atomic_load_n(&sect->data, __ATOMIC_ACQUIRE);
+	if (data)
+		return data;
+
+	// Sections without file contents (e.g. .bss or newly added ones) don't have a body.
+	if (!elf->map || sect->file_size == 0)
+		return NULL;
+
+	// Fetch the pages of this section now, instead of faulting them in one by one.
+	data = elf->map + sect->file_offset;
+	const size page = (size)sysconf(_SC_PAGESIZE);
+	const size start = sect->file_offset / page * page;
+	madvise(elf->map + start, sect->file_offset + sect->file_size - start, MADV_WILLNEED);
+
+	// Several threads may get here at once, but they all store the same pointer. Only the first one counts.
+	u8* expected = NULL;
+	if (__atomic_compare_exchange_n(&sect->data, &expected, data, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		stats_count(STATS_BYTES_READ, sect->file_size);
+	return data;
+}
+
+elf_symtab* elf_dynsym_table(const elf_obj* elf, size* num_syms, str* strtab, size* strtab_size)
+{
+	if (!elf)
+	{
+		log_msg(LOG_ERR, "couldn't get the dynamic symbol table, no ELF given!\n");
+		return NULL;
+	}
+
+	if (elf->dynsym_idx == 0)
+		return NULL;
+	elf_section* dynsym = elf->sections + elf->dynsym_idx;
+	const u32 dynstr_idx = dynsym->header.sh_link;
+	if (dynstr_idx >= elf->header.e_shnum)
+		return NULL;
+	elf_section* dynstr = elf->sections + dynstr_idx;
+
+	elf_symtab* syms = elf_symbols(elf, dynsym, num_syms);
+	u8* strs = elf_section_data(elf, dynstr);
+	if (!syms || !strs)
+		return NULL;
+
+	if (strtab)
+		*strtab = (str)strs;
+	if (strtab_size)
+		*strtab_size = dynstr->header.sh_size;
+	return syms;
+}
+
+// Decodes the entries of a table section once. Several threads may get here at once, only the first one wins.
+static void* elf_section_decode(elf_section* sect, const u8* data, size num, size len,
+	void (*decode)(const u8* in, size num, void* out))
+{
+	void* entries = __atomic_load_n(&sect->entries, __ATOMIC_ACQUIRE);
+	if (entries)
+		return entries;
+	entries = malloc(num ? num * len : 1);
+	decode(data, num, entries);
+
+	void* expected = NULL;
+	if (__atomic_compare_exchange_n(&sect->entries, &expected, entries, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		return entries;
+	free(entries);
+	return expected;
+}
+
+elf_symtab* elf_symbols(const elf_obj* elf, elf_section* sect, size* num_syms)
+{
+	if (!elf || !sect)
+	{
+		log_msg(LOG_ERR, "couldn't get symbols, no ELF or section given!\n");
+		return NULL;
+	}
+
+	u8* data = elf_section_data(elf, sect);
+	if (!data)
+		return NULL;
+	const size num = sect->header.sh_size / elf->codec->symentsize;
+	if (num_syms)
+		*num_syms = num;
+	if (elf->codec->native)
+		return (elf_symtab*)data;
+	return elf_section_decode(sect, data, num, sizeof(elf_symtab), elf->codec->get_syms);
+}
+
+elf_rela* elf_relocs(const elf_obj* elf, elf_section* sect, size* num_relocs)
+{
+	if (!elf || !sect)
+	{
+		log_msg(LOG_ERR, "couldn't get relocations, no ELF or section given!\n");
+		return NULL;
+	}
+
+	u8* data = elf_section_data(elf, sect);
+	if (!data)
+		return NULL;
+	const bool rela = sect->header.sh_type != SHT_REL;
+	const size num = sect->header.sh_size / (rela ? elf->codec->relaentsize : elf->codec->relentsize);
+	if (num_relocs)
+		*num_relocs = num;
+	if (elf->codec->native && rela)
+		return (elf_rela*)data;
+	return elf_section_decode(sect, data, num, sizeof(elf_rela), rela ? elf->codec->get_relas : elf->codec->get_rels);
+}
+
+// Checks if the dynamic symbol at `idx` is a defined symbol called `name`.
+static elf_symtab* elf_dynsym_match(const elf_obj* elf, u32 idx, const str name)
+{
+	elf_section* dynsym = elf->sections + elf->dynsym_idx;
+	const elf_section* dynstr = elf->sections + dynsym->header.sh_link;
+	size num_syms = 0;
+	elf_symtab* syms = elf_symbols(elf, dynsym, &num_syms);
+	if (idx >= num_syms)
+		return NULL;
+
+	// The name has to end within the string table.
+	elf_symtab* sym = syms + idx;
+	if (sym->sym_shndx == 0 || sym->sym_name >= dynstr->header.sh_size)
+		return NULL;
+	const str sym_name = (str)dynstr->data + sym->sym_name;
+	const size len = strlen(name);
+	if (len >= dynstr->header.sh_size - sym->sym_name || memcmp(sym_name, name, len) || sym_name[len] != '\0')
+		return NULL;
+	return sym;
+}
+
+static elf_symtab* elf_dynsym_lookup_gnu(const elf_obj* elf, const str name)
+{
+	const elf_section* sect = elf->sections + elf->gnu_hash_idx;
+	const u32* table = (const u32*)sect->data;
+	const u32 num_buckets = table[0];
+	const u32 sym_offset = table[1];
+	const u32 bloom_size = table[2];
+	const u32 bloom_shift = table[3];
+
+	// Bloom filter words are as wide as the ELF class.
+	const u32 word_bits = elf->header.e_ident_class == 1 ? 32 : 64;
+	// Check the header against the section size in 64 bits, before pointing past it.
+	const u64 num_words = sect->header.sh_size / sizeof(u32);
+	const u64 chain_start = 4 + (u64)bloom_size * (word_bits / 32) + num_buckets;
+	if (num_buckets == 0 || bloom_size == 0 || chain_start > num_words)
+		return NULL;
+	const u32* buckets = table + chain_start - num_buckets;
+	const u32* chain = table + chain_start;
+
+	const u32 hash = elf_gnu_hash(name);
+
+	// Reject most misses using the bloom filter.
+	const u32 word_idx = (hash / word_bits) % bloom_size;
+	u64 word, mask;
+	if (word_bits == 32)
+	{
+		word = ((const u32*)(table + 4))[word_idx];
+		mask = (1ull << (hash % 32)) | (1ull << ((hash >> bloom_shift) % 32));
+	}
+	else
+	{
+		memcpy(&word, (const u64*)(table + 4) + word_idx, sizeof(u64));
+		mask = (1ull << (hash % 64)) | (1ull << ((hash >> bloom_shift) % 64));
+	}
+	if ((word & mask) != mask)
+		return NULL;
+
+	u32 idx = buckets[hash % num_buckets];
+	if (idx < sym_offset || (u64)(idx - sym_offset) >= num_words - chain_start)
+		return NULL;
+
+	// Walk the chain, the lowest bit of each entry marks its end.
+	const u32* chain_end = table + num_words;
+	for (const u32* cur = chain + (idx - sym_offset); cur < chain_end; cur++, idx++)
+	{
+		if ((*cur | 1) == (hash | 1))
+		{
+			elf_symtab* sym = elf_dynsym_match(elf, idx, name);
+			if (sym)
+				return sym;
+		}
+		if (*cur & 1)
+			break;
+	}
+	return NULL;
+}
+
+static elf_symtab* elf_dynsym_lookup_sysv(const elf_obj* elf, const str name)
+{
+	const elf_section* sect = elf->sections + elf->hash_idx;
+	const u32* table = (const u32*)sect->data;
+	const u32 num_buckets = table[0];
+	const u32 num_chain = table[1];
+	if (num_buckets == 0 || (2ull + num_buckets + num_chain) * sizeof(u32) > sect->header.sh_size)
+		return NULL;
+	const u32* buckets = table + 2;
+	const u32* chain = buckets + num_buckets;
+
+	for (u32 idx = buckets[elf_hash(name) % num_buckets]; idx != 0 && idx < num_chain; idx = chain[idx])
+	{
+		elf_symtab* sym = elf_dynsym_match(elf, idx, name);
+		if (sym)
+			return sym;
+	}
+	return NULL;
+}
+
+elf_symtab* elf_dynsym_lookup(const elf_obj* elf, const str name)
+{
+	if (!elf)
+	{
+		log_msg(LOG_ERR, "couldn't look up symbol \"%s\", no ELF given!\n", name);
+		return NULL;
+	}
+	if (!name)
+	{
+		log_msg(LOG_ERR, "[%s] couldn't look up symbol, no name given!\n", basename(elf->file_name));
+		return NULL;
+	}
+
+	stats_count(STATS_LOOKUPS, 1);
+
+	// Only the symbol table, its string table and the hash tables have to be loaded.
+	if (elf->dynsym_idx == 0 || !elf_section_data(elf, elf->sections + elf->dynsym_idx))
+		return NULL;
+	const u32 dynstr_idx = elf->sections[elf->dynsym_idx].header.sh_link;
+	if (dynstr_idx >= elf->header.e_shnum || !elf_section_data(elf, elf->sections + dynstr_idx))
+		return NULL;
+
+	// The hash tables are only readable in the byte order of the host.
+	const bool swapped = elf->codec->swapped;
+	if (!swapped && elf->gnu_hash_idx && elf->sections[elf->gnu_hash_idx].header.sh_size >= 4 * sizeof(u32) &&
+		elf_section_data(elf, elf->sections + elf->gnu_hash_idx))
+		return elf_dynsym_lookup_gnu(elf, name);
+	if (!swapped && elf->hash_idx && elf->sections[elf->hash_idx].header.sh_size >= 2 * sizeof(u32) &&
+		elf_section_data(elf, elf->sections + elf->hash_idx))
+		return elf_dynsym_lookup_sysv(elf, name);
+
+	// No hash tables, scan a structure-of-arrays copy of the symbols instead. Several threads may build it at once.
+	elf_section* dynsym = elf->sections + elf->dynsym_idx;
+	size num_sym = 0, strtab_size = 0;
+	str strtab = NULL;
+	elf_symtab* syms = elf_dynsym_table(elf, &num_sym, &strtab, &strtab_size);
+	if (!syms)
+		return NULL;
+	symindex* index = __atomic_load_n(&dynsym->index, __ATOMIC_ACQUIRE);
+	if (!index)
+	{
+		symindex* expected = NULL;
+		index = symindex_build(syms, num_sym, strtab, strtab_size);
+		if (!__atomic_compare_exchange_n(&dynsym->index, &expected, index, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		{
+			symindex_free(index);
+			index = expected;
+		}
+	}
+	const i64 found = symindex_find(index, strtab, name);
+	return found >= 0 ? syms + found : NULL;
 }
 
-size elf_gnu_hash(const str name)
+u32 elf_gnu_hash(const str name)
 {
 	str cur = name;
-	size result = 5381;
+	u32 result = 5381;
 	u8 ch;
 	while ((ch = *cur++) != '\0') {
 		result = (result << 5) + result + ch;
 	}
-	return result & 0xffffffff;
+	return result;
+}
+
+u32 elf_hash(const str name)
+{
+	str cur = name;
+	u32 result = 0;
+	u8 ch;
+	while ((ch = *cur++) != '\0') {
+		result = (result << 4) + ch;
+		const u32 high = result & 0xf0000000;
+		if (high)
+			result ^= high >> 24;
+		result &= ~high;
+	}
+	return result;
 }
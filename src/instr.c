@@ -30,3 +30,254 @@ bool instr_get_bytes(elf_machine type, u32 offset, u8 instr[16])
 
 	return true;
 }
+
+// Checks if a one-byte opcode is followed by a ModRM byte.
+static bool instr_x86_modrm_1(u8 op)
+{
+	if (op < 0x40)
+		return (op & 7) < 4;
+	if (op >= 0x80 && op <= 0x8f)
+		return true;
+	if ((op >= 0xd0 && op <= 0xd3) || (op >= 0xd8 && op <= 0xdf))
+		return true;
+	switch (op)
+	{
+		case 0x63: case 0x69: case 0x6b: case 0xc0: case 0xc1: case 0xc6: case 0xc7:
+		case 0xf6: case 0xf7: case 0xfe: case 0xff:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Gets the size of the immediate (or relative displacement) of a one-byte opcode.
+static u8 instr_x86_imm_1(u8 op, bool op16, bool rex_w, bool addr32, u8 reg)
+{
+	const u8 z = op16 ? 2 : 4;
+	if (op < 0x40)
+		return (op & 7) == 4 ? 1 : (op & 7) == 5 ? z : 0;
+	if ((op >= 0x70 && op <= 0x7f) || (op >= 0xb0 && op <= 0xb7) || (op >= 0xe0 && op <= 0xe7))
+		return 1;
+	if (op >= 0xb8 && op <= 0xbf)
+		return rex_w ? 8 : z;
+	if (op >= 0xa0 && op <= 0xa3)
+		return addr32 ? 4 : 8;
+	switch (op)
+	{
+		case 0x6a: case 0x6b: case 0x80: case 0x82: case 0x83: case 0xa8:
+		case 0xc0: case 0xc1: case 0xc6: case 0xcd: case 0xeb:
+			return 1;
+		case 0x68: case 0x69: case 0x81: case 0xa9: case 0xc7:
+			return z;
+		case 0xe8: case 0xe9:
+			return 4;
+		case 0xc2: case 0xca:
+			return 2;
+		case 0xc8:
+			return 3;
+		case 0xf6:
+			return reg < 2 ? 1 : 0;
+		case 0xf7:
+			return reg < 2 ? z : 0;
+		default:
+			return 0;
+	}
+}
+
+// Checks if a two-byte (0x0f) opcode is followed by a ModRM byte.
+static bool instr_x86_modrm_2(u8 op)
+{
+	if ((op >= 0x30 && op <= 0x37) || (op >= 0x80 && op <= 0x8f) || (op >= 0xc8 && op <= 0xcf))
+		return false;
+	switch (op)
+	{
+		case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0b: case 0x0e:
+		case 0x77: case 0xa0: case 0xa1: case 0xa2: case 0xa8: case 0xa9: case 0xaa:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Gets the size of the immediate of an opcode in the 0x0f map, also used by VEX and EVEX encoded instructions.
+static u8 instr_x86_imm_2(u8 op)
+{
+	if (op >= 0x80 && op <= 0x8f)
+		return 4;
+	switch (op)
+	{
+		case 0x0f: case 0x70: case 0x71: case 0x72: case 0x73: case 0xa4: case 0xac:
+		case 0xba: case 0xc2: case 0xc4: case 0xc5: case 0xc6:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static bool instr_decode_x86_64(const u8* code, size len, instr_info* out)
+{
+	size i = 0;
+	bool op16 = false, addr32 = false, rex_w = false;
+
+	// Legacy prefixes.
+	for (; i < len && i < 14; i++)
+	{
+		const u8 b = code[i];
+		if (b == 0x66)
+			op16 = true;
+		else if (b == 0x67)
+			addr32 = true;
+		else if (!(b == 0xf0 || b == 0xf2 || b == 0xf3 || b == 0x2e || b == 0x36 ||
+			b == 0x3e || b == 0x26 || b == 0x64 || b == 0x65))
+			break;
+	}
+	// REX prefix, has to come right before the opcode.
+	if (i < len && (code[i] & 0xf0) == 0x40)
+	{
+		rex_w = code[i] & 0x08;
+		i++;
+	}
+	if (i >= len)
+		return false;
+
+	u8 map = 0;
+	bool vex = false;
+	bool has_modrm;
+	u8 imm = 0;
+	u8 op = code[i++];
+
+	if (op == 0xc4 || op == 0xc5 || op == 0x62)
+	{
+		// VEX and EVEX prefixes, the payload contains the opcode map.
+		const size payload = op == 0xc5 ? 1 : op == 0xc4 ? 2 : 3;
+		if (i + payload >= len)
+			return false;
+		map = op == 0xc5 ? 1 : op == 0xc4 ? (code[i] & 0x1f) : (code[i] & 0x07);
+		vex = true;
+		i += payload;
+		op = code[i++];
+		has_modrm = !(map == 1 && op == 0x77);
+		imm = map == 3 ? 1 : map == 1 && !(op >= 0x80 && op <= 0x8f) ? instr_x86_imm_2(op) : 0;
+	}
+	else if (op == 0x0f)
+	{
+		if (i >= len)
+			return false;
+		op = code[i++];
+		map = 1;
+		if (op == 0x38 || op == 0x3a)
+		{
+			if (i >= len)
+				return false;
+			map = op == 0x38 ? 2 : 3;
+			op = code[i++];
+			has_modrm = true;
+			imm = map == 3 ? 1 : 0;
+		}
+		else
+		{
+			has_modrm = instr_x86_modrm_2(op);
+			imm = instr_x86_imm_2(op);
+		}
+	}
+	else
+		has_modrm = instr_x86_modrm_1(op);
+
+	*out = (instr_info) { .kind = INSTR_OTHER };
+
+	// ModRM, SIB and displacement.
+	u8 reg = 0;
+	if (has_modrm)
+	{
+		if (i >= len)
+			return false;
+		const u8 modrm = code[i++];
+		const u8 mod = modrm >> 6;
+		const u8 rm = modrm & 7;
+		reg = (modrm >> 3) & 7;
+		u8 disp = 0;
+		if (mod != 3)
+		{
+			if (rm == 4)
+			{
+				if (i >= len)
+					return false;
+				const u8 sib = code[i++];
+				if (mod == 0 && (sib & 7) == 5)
+					disp = 4;
+			}
+			else if (mod == 0 && rm == 5)
+			{
+				disp = 4;
+				out->rip_relative = true;
+				out->rel_offset = (u8)i;
+				out->rel_size = 4;
+			}
+			if (mod == 1)
+				disp = 1;
+			else if (mod == 2)
+				disp = 4;
+		}
+		i += disp;
+	}
+	if (map == 0)
+		imm = instr_x86_imm_1(op, op16, rex_w, addr32, reg);
+
+	// Control flow.
+	if (map == 0)
+	{
+		if (op == 0xe8)
+			out->kind = INSTR_CALL;
+		else if (op == 0xe9 || op == 0xeb)
+			out->kind = INSTR_JUMP;
+		else if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3))
+			out->kind = INSTR_BRANCH;
+		else if (op == 0xc3 || op == 0xc2)
+			out->kind = INSTR_RET;
+		else if (op == 0xff && reg >= 2 && reg <= 5)
+			out->kind = INSTR_INDIRECT;
+	}
+	else if (map == 1 && !vex && op >= 0x80 && op <= 0x8f)
+		out->kind = INSTR_BRANCH;
+
+	if (out->kind == INSTR_CALL || out->kind == INSTR_JUMP || out->kind == INSTR_BRANCH)
+	{
+		out->rel_offset = (u8)i;
+		out->rel_size = imm;
+	}
+
+	i += imm;
+	if (i > len || i > 15)
+		return false;
+	out->length = (u8)i;
+
+	// Resolve where the displacement points to, relative to the start of the instruction.
+	if (out->rel_size)
+	{
+		i64 disp = 0;
+		if (out->rel_size == 1)
+			disp = (i8)code[out->rel_offset];
+		else if (out->rel_size == 4)
+		{
+			i32 val;
+			memcpy(&val, code + out->rel_offset, sizeof(i32));
+			disp = val;
+		}
+		out->rel_target = (i64)out->length + disp;
+	}
+	return true;
+}
+
+bool instr_decode(elf_machine type, const u8* code, size len, instr_info* out)
+{
+	if (!code || !out)
+		return false;
+
+	switch (type)
+	{
+	case EM_X86_64:
+		return instr_decode_x86_64(code, len, out);
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <libgen.h>
+#include <string.h>
+
+#include <layout.h>
+#include <log.h>
+#include <stats.h>
+#include <trace.h>
+
+// Everything of the input that gets mapped, which has to stay where it is so code and data keep their addresses.
+typedef struct
+{
+	/// End of the last mapped byte in the file.
+	u64 file_end;
+	/// End of the highest loadable segment in memory.
+	u64 vaddr_end;
+	/// The largest alignment of all loadable segments, at least a page.
+	u64 page;
+	/// How far the program header table can grow in place.
+	u64 phdr_limit;
+} layout_bounds;
+
+// Rounds up to a multiple of `align`, which doesn't have to be a power of two. 0 and 1 don't align at all.
+static u64 layout_align(u64 x, u64 align)
+{
+	return align > 1 ? (x + align - 1) / align * align : x;
+}
+
+// Gets the first offset from `cursor` on that is congruent to `vaddr` modulo `align`, as the loader requires.
+static u64 layout_congruent(u64 cursor, u64 vaddr, u64 align)
+{
+	if (align <= 1)
+		return cursor;
+	return cursor + (vaddr % align + align - cursor % align) % align;
+}
+
+static bool layout_bounds_get(const elf_obj* elf, layout_bounds* b)
+{
+	const elf_header* ehdr = &elf->header;
+	*b = (layout_bounds) { .file_end = ehdr->e_ehsize };
+	for (u16 i = 0; i < ehdr->e_phnum; i++)
+	{
+		const elf_program_header* p = &elf->segments[i].header;
+		if (elf->segments[i].added || p->p_type != PT_LOAD)
+			continue;
+		if (p->p_offset + p->p_filesz > b->file_end)
+			b->file_end = p->p_offset + p->p_filesz;
+		if (p->p_vaddr + p->p_memsz > b->vaddr_end)
+			b->vaddr_end = p->p_vaddr + p->p_memsz;
+		if (p->p_align > b->page)
+			b->page = p->p_align;
+	}
+	b->page = b->page ? b->page : 4096;
+
+	// The first allocated body behind the program header table limits how far it can grow.
+	b->phdr_limit = b->file_end;
+	for (u16 i = 1; i < ehdr->e_shnum; i++)
+	{
+		const elf_section* sect = elf->sections + i;
+		const elf_section_header* h = &sect->header;
+		if (sect->added || !(h->sh_flags & 2) || h->sh_type == SHT_NOBITS)
+			continue;
+		if (h->sh_size > sect->file_size)
+			return log_msg(LOG_WARN, "[%s] allocated section \"%s\" grew, but can't be moved\n",
+				basename(elf->file_name), elf_section_get_name(elf, i));
+		if (h->sh_offset + h->sh_size > b->file_end)
+			b->file_end = h->sh_offset + h->sh_size;
+		if (h->sh_size && h->sh_offset >= ehdr->e_phoff && h->sh_offset < b->phdr_limit)
+			b->phdr_limit = h->sh_offset;
+	}
+	return true;
+}
+
+// Finds the loadable segment an address belongs to: the one with the highest start at or below it.
+static i32 layout_segment_of(const elf_obj* elf, u64 addr)
+{
+	i32 result = -1;
+	for (u16 i = 0; i < elf->header.e_phnum; i++)
+	{
+		const elf_program_header* p = &elf->segments[i].header;
+		if (p->p_type != PT_LOAD || p->p_vaddr > addr)
+			continue;
+		if (result < 0 || p->p_vaddr > elf->segments[result].header.p_vaddr)
+			result = i;
+	}
+	return result;
+}
+
+// Finds the lowest free address for `len` bytes that is congruent to `off` modulo a page.
+// Candidates are the first such address behind every loadable segment, so a gap between two of them is used if it's
+// large enough. Segments may not share a page, the later mapping would replace the earlier one.
+static u64 layout_find_vaddr(const elf_obj* elf, u64 page, u64 off, u64 len)
+{
+	u64 best = UINT64_MAX;
+	for (u16 i = 0; i < elf->header.e_phnum; i++)
+	{
+		const elf_program_header* p = &elf->segments[i].header;
+		if (p->p_type != PT_LOAD)
+			continue;
+		const u64 cand = layout_align(p->p_vaddr + p->p_memsz, page) + off % page;
+		if (cand >= best)
+			continue;
+		const u64 start = cand / page * page, end = layout_align(cand + len, page);
+		bool free = true;
+		for (u16 j = 0; j < elf->header.e_phnum && free; j++)
+		{
+			const elf_program_header* q = &elf->segments[j].header;
+			if (q->p_type == PT_LOAD && start < layout_align(q->p_vaddr + q->p_memsz, page) && q->p_vaddr / page * page < end)
+				free = false;
+		}
+		if (free)
+			best = cand;
+	}
+	return best == UINT64_MAX ? off : best;
+}
+
+// Converts section flags to the flags of a segment that can hold the section.
+static u32 layout_segment_flags(u64 sh_flags)
+{
+	return 4 | (sh_flags & 1 ? 2 : 0) | (sh_flags & 4 ? 1 : 0); // PF_R, SHF_WRITE -> PF_W, SHF_EXECINSTR -> PF_X
+}
+
+// Added sections only get grouped by whether they are writable and executable.
+#define LAYOUT_NUM_GROUPS 4
+
+static u32 layout_group(u64 sh_flags)
+{
+	return (sh_flags & 1) | (sh_flags & 4 ? 2 : 0);
+}
+
+bool layout_place(elf_obj* elf, u64 code_page)
+{
+	if (!elf)
+		return log_msg(LOG_WARN, "couldn't place sections, no ELF given!\n");
+
+	const stats_clock start = stats_start();
+	const u64 span = trace_begin();
+	elf_header* ehdr = &elf->header;
+	layout_bounds b;
+	if (!layout_bounds_get(elf, &b))
+	{
+		stats_stop(STATS_LAYOUT, start);
+		return false;
+	}
+
+	// Sections that still need an address, by what they may be mapped with.
+	bool pending[LAYOUT_NUM_GROUPS] = {0};
+	for (u16 i = 1; i < ehdr->e_shnum; i++)
+	{
+		const elf_section_header* h = &elf->sections[i].header;
+		if (elf->sections[i].added && (h->sh_flags & 2) && !h->sh_addr)
+			pending[layout_group(h->sh_flags)] = true;
+	}
+
+	// Code that should be mapped with larger pages gets segments of its own. The loader picks the base address of a
+	// position independent file by the largest alignment, existing code can use those pages too if it's congruent.
+	const bool huge = code_page > b.page;
+	for (u16 i = 0; huge && i < ehdr->e_phnum; i++)
+	{
+		elf_program_header* p = &elf->segments[i].header;
+		if (p->p_type == PT_LOAD && (p->p_flags & 1) && p->p_vaddr % code_page == p->p_offset % code_page)
+			p->p_align = code_page;
+	}
+
+	// A segment that ends both the file and the address space can simply grow, which saves a mapping.
+	for (u32 g = 0; g < LAYOUT_NUM_GROUPS; g++)
+	{
+		if (!pending[g] || (huge && g & 2))
+			continue;
+		for (u16 i = 0; i < ehdr->e_phnum && pending[g]; i++)
+		{
+			elf_program_header* p = &elf->segments[i].header;
+			if (elf->segments[i].added || p->p_type != PT_LOAD || p->p_filesz != p->p_memsz ||
+				p->p_offset + p->p_filesz != b.file_end || p->p_vaddr + p->p_memsz != b.vaddr_end)
+				continue;
+			u64 addr = b.vaddr_end;
+			for (u16 j = 1; j < ehdr->e_shnum; j++)
+			{
+				elf_section_header* h = &elf->sections[j].header;
+				if (!elf->sections[j].added || !(h->sh_flags & 2) || h->sh_addr || layout_group(h->sh_flags) != g ||
+					layout_segment_flags(h->sh_flags) != p->p_flags)
+					continue;
+				h->sh_addr = layout_align(addr, h->sh_addralign);
+				addr = h->sh_addr + h->sh_size;
+			}
+			if (addr == b.vaddr_end)
+				continue;
+			p->p_memsz = addr - p->p_vaddr;
+			p->p_filesz = p->p_memsz;
+			b.file_end = p->p_offset + p->p_filesz;
+			b.vaddr_end = addr;
+			pending[g] = false;
+		}
+	}
+
+	// Everything else needs new segments, one per group. The program header table has to fit them as well.
+	u16 num_new = 0;
+	for (u32 g = 0; g < LAYOUT_NUM_GROUPS; g++)
+		num_new += pending[g];
+	const u64 phentsize = ehdr->e_phentsize;
+	const bool move_phdrs = ehdr->e_phnum &&
+		(ehdr->e_phoff < ehdr->e_ehsize || ehdr->e_phoff + (ehdr->e_phnum + num_new) * phentsize > b.phdr_limit);
+	// Without any other new segment, the table gets a read-only one of its own.
+	if (move_phdrs && !num_new)
+	{
+		num_new = 1;
+		pending[0] = true;
+	}
+	const u64 phdr_size = (ehdr->e_phnum + num_new) * phentsize;
+
+	// New segments are placed behind everything that's mapped, both in the file and in memory. Their addresses are
+	// congruent to where they will land in the file, so `layout_plan` doesn't have to pad in front of them.
+	arena mem = {0};
+	u16* members = arena_alloc(&mem, (ehdr->e_shnum ? ehdr->e_shnum : 1) * sizeof(u16));
+	u64* rels = arena_alloc(&mem, (ehdr->e_shnum ? ehdr->e_shnum : 1) * sizeof(u64));
+	bool phdrs_left = move_phdrs;
+	u64 cursor = b.file_end;
+	for (u32 g = 0; g < LAYOUT_NUM_GROUPS; g++)
+	{
+		if (!pending[g])
+			continue;
+
+		// The moved table goes to the start of the first new segment, whatever its flags.
+		const u64 phdr_rel = phdrs_left ? phdr_size : 0;
+		u64 rel = phdr_rel, filesz = rel, align = 8;
+		u32 flags = 4; // PF_R
+		size num_members = 0;
+		for (u16 j = 1; j < ehdr->e_shnum; j++)
+		{
+			const elf_section_header* h = &elf->sections[j].header;
+			if (!elf->sections[j].added || !(h->sh_flags & 2) || h->sh_addr || layout_group(h->sh_flags) != g)
+				continue;
+			flags = layout_segment_flags(h->sh_flags);
+			if (h->sh_addralign > align && h->sh_addralign <= b.page)
+				align = h->sh_addralign;
+			rel = layout_align(rel, h->sh_addralign);
+			members[num_members] = j;
+			rels[num_members++] = rel;
+			rel += h->sh_size;
+			if (h->sh_type != SHT_NOBITS)
+				filesz = rel;
+		}
+
+		// Code for larger pages starts on one and fills its last one up, so every page of it can be mapped as one.
+		const u64 page = huge && g & 2 ? code_page : b.page;
+		if (page != b.page)
+		{
+			elf_section* last = elf->sections + members[num_members - 1];
+			const u64 pad = layout_align(rel, page) - rel;
+			if (pad && last->header.sh_type != SHT_NOBITS)
+			{
+				memset(elf_section_reserve(elf, last, last->header.sh_size + pad) + last->header.sh_size, 0, pad);
+				last->header.sh_size += pad;
+				rel += pad;
+				filesz = rel;
+			}
+			align = page;
+		}
+
+		// The start has to be aligned for every member, their positions are relative to it.
+		const u64 off = layout_align(cursor, align);
+		const u64 vaddr = layout_find_vaddr(elf, page, off, rel);
+		elf_segment_add(elf, &(elf_program_header) {
+			.p_type = PT_LOAD,
+			.p_flags = flags,
+			.p_vaddr = vaddr,
+			.p_paddr = vaddr,
+			.p_filesz = filesz,
+			.p_memsz = rel,
+			.p_align = page,
+		});
+		for (size i = 0; i < num_members; i++)
+			elf->sections[members[i]].header.sh_addr = vaddr + rels[i];
+		if (phdrs_left)
+			elf->phdr_vaddr = vaddr;
+		phdrs_left = false;
+		cursor = off + filesz;
+	}
+	arena_free(&mem);
+
+	stats_stop(STATS_LAYOUT, start);
+	trace_end("layout_place", elf->file_name, NULL, span);
+	return true;
+}
+
+// Loadable segments have to be sorted by address. Only swaps them among themselves, all others keep their place.
+static void layout_sort_loads(elf_obj* elf)
+{
+	for (bool sorted = false; !sorted;)
+	{
+		sorted = true;
+		i32 prev = -1;
+		for (u16 i = 0; i < elf->header.e_phnum; i++)
+		{
+			if (elf->segments[i].header.p_type != PT_LOAD)
+				continue;
+			if (prev >= 0 && elf->segments[prev].header.p_vaddr > elf->segments[i].header.p_vaddr)
+			{
+				const elf_segment tmp = elf->segments[prev];
+				elf->segments[prev] = elf->segments[i];
+				elf->segments[i] = tmp;
+				sorted = false;
+			}
+			prev = i;
+		}
+	}
+}
+
+static bool layout_run(elf_obj* elf)
+{
+	const str name = basename(elf->file_name);
+	elf_header* ehdr = &elf->header;
+	layout_bounds b;
+	if (!layout_bounds_get(elf, &b))
+		return false;
+
+	const u64 phdr_size = ehdr->e_phnum * ehdr->e_phentsize;
+	if (!elf->phdr_vaddr && ehdr->e_phnum && (ehdr->e_phoff < ehdr->e_ehsize || ehdr->e_phoff + phdr_size > b.phdr_limit))
+		return log_msg(LOG_WARN, "[%s] the program header table doesn't fit anymore, it has to be moved by layout_place\n", name);
+	for (u16 j = 1; j < ehdr->e_shnum; j++)
+	{
+		const elf_section_header* h = &elf->sections[j].header;
+		if (elf->sections[j].added && (h->sh_flags & 2) && (!h->sh_addr || layout_segment_of(elf, h->sh_addr) < 0))
+			return log_msg(LOG_WARN, "[%s] section \"%s\" has no place in memory, it has to be placed by layout_place\n",
+				name, elf_section_get_name(elf, j));
+	}
+
+	// Added segments go first, at offsets congruent to their addresses.
+	u64 cursor = b.file_end;
+	for (u16 i = 0; i < ehdr->e_phnum; i++)
+	{
+		elf_program_header* p = &elf->segments[i].header;
+		if (!elf->segments[i].added || p->p_type != PT_LOAD)
+			continue;
+		p->p_offset = layout_congruent(cursor, p->p_vaddr, p->p_align);
+		p->p_filesz = 0;
+		p->p_memsz = 0;
+		if (elf->phdr_vaddr && layout_segment_of(elf, elf->phdr_vaddr) == i)
+		{
+			p->p_filesz = elf->phdr_vaddr - p->p_vaddr + phdr_size;
+			p->p_memsz = p->p_filesz;
+		}
+		for (u16 j = 1; j < ehdr->e_shnum; j++)
+		{
+			const elf_section_header* h = &elf->sections[j].header;
+			if (!elf->sections[j].added || !(h->sh_flags & 2) || layout_segment_of(elf, h->sh_addr) != i)
+				continue;
+			const u64 end = h->sh_addr - p->p_vaddr + h->sh_size;
+			if (end > p->p_memsz)
+				p->p_memsz = end;
+			if (h->sh_type != SHT_NOBITS && end > p->p_filesz)
+				p->p_filesz = end;
+		}
+		cursor = p->p_offset + p->p_filesz;
+	}
+
+	// Added sections sit at the same distance from the start of their segment as in memory, whichever segment it is.
+	for (u16 j = 1; j < ehdr->e_shnum; j++)
+	{
+		elf_section_header* h = &elf->sections[j].header;
+		if (!elf->sections[j].added || !(h->sh_flags & 2))
+			continue;
+		const elf_program_header* p = &elf->segments[layout_segment_of(elf, h->sh_addr)].header;
+		if (h->sh_addralign > 1 && h->sh_addr % h->sh_addralign)
+			log_msg(LOG_WARN, "[%s] section \"%s\" at %#lx isn't aligned to %lu bytes\n",
+				name, elf_section_get_name(elf, j), h->sh_addr, h->sh_addralign);
+		h->sh_offset = p->p_offset + (h->sh_addr - p->p_vaddr);
+	}
+
+	// The program header table either moved into an added segment, or grew in place and has to stay covered.
+	if (elf->phdr_vaddr)
+	{
+		const elf_program_header* p = &elf->segments[layout_segment_of(elf, elf->phdr_vaddr)].header;
+		ehdr->e_phoff = p->p_offset + (elf->phdr_vaddr - p->p_vaddr);
+	}
+	for (u16 i = 0; i < ehdr->e_phnum; i++)
+	{
+		elf_program_header* p = &elf->segments[i].header;
+		if (p->p_type == PT_PHDR)
+		{
+			p->p_offset = ehdr->e_phoff;
+			p->p_filesz = phdr_size;
+			p->p_memsz = phdr_size;
+			if (elf->phdr_vaddr)
+			{
+				p->p_vaddr = elf->phdr_vaddr;
+				p->p_paddr = p->p_vaddr;
+			}
+		}
+		else if (!elf->phdr_vaddr && p->p_type == PT_LOAD && !elf->segments[i].added &&
+			ehdr->e_phoff >= p->p_offset && ehdr->e_phoff < p->p_offset + p->p_filesz &&
+			ehdr->e_phoff + phdr_size > p->p_offset + p->p_filesz)
+		{
+			p->p_filesz = ehdr->e_phoff + phdr_size - p->p_offset;
+			if (p->p_memsz < p->p_filesz)
+				p->p_memsz = p->p_filesz;
+		}
+	}
+
+	// Everything that doesn't get mapped is packed behind that, in the order of the section headers.
+	for (u16 j = 1; j < ehdr->e_shnum; j++)
+	{
+		elf_section_header* h = &elf->sections[j].header;
+		if (h->sh_flags & 2)
+			continue;
+		h->sh_offset = layout_align(cursor, h->sh_addralign);
+		if (h->sh_type != SHT_NOBITS)
+			cursor = h->sh_offset + h->sh_size;
+	}
+	ehdr->e_shoff = ehdr->e_shnum ? layout_align(cursor, 8) : 0;
+
+	layout_sort_loads(elf);
+	const elf_program_header* prev = NULL;
+	for (u16 i = 0; i < ehdr->e_phnum; i++)
+	{
+		const elf_program_header* p = &elf->segments[i].header;
+		if (p->p_type != PT_LOAD)
+			continue;
+		if (prev && prev->p_vaddr + prev->p_memsz > p->p_vaddr)
+			return log_msg(LOG_WARN, "[%s] segments at %#lx and %#lx overlap\n", name, prev->p_vaddr, p->p_vaddr);
+		prev = p;
+	}
+	return true;
+}
+
+bool layout_plan(elf_obj* elf)
+{
+	if (!elf)
+		return log_msg(LOG_WARN, "couldn't lay out a file, no ELF given!\n");
+
+	const stats_clock start = stats_start();
+	const u64 span = trace_begin();
+	const bool result = layout_run(elf);
+	stats_stop(STATS_LAYOUT, start);
+	trace_end("layout_plan", elf->file_name, NULL, span);
+	return result;
+}
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <load.h>
+#include <cache.h>
+#include <args.h>
+#include <log.h>
+
+typedef struct
+{
+	const str* files;
+	u16 num_files;
+	u16 num_libs;
+	elf_obj* elfs;
+	resolve_lib* exports;
+	/// Captured messages of each file.
+	void** logs;
+	bool* ok;
+	/// Which files to read, `NULL` for all of them.
+	const bool* required;
+	/// The next file to be picked up by a worker.
+	atomic_uint next;
+} load_state;
+
+static void load_file(load_state* state, u16 i)
+{
+	// Errors must not exit while other threads are still working, so collect them instead.
+	log_capture_begin();
+	if (state->required)
+	{
+		// Only read what's required and hasn't been read yet.
+		if (state->required[i] && !state->elfs[i].map)
+			state->elfs[i] = elf_read(state->files[i]);
+		state->ok[i] = log_capture_end(state->logs + i) && (!state->required[i] || state->elfs[i].map);
+		return;
+	}
+
+	// Libraries with a valid cache entry don't need to be read until something gets linked from them.
+	if (i < state->num_libs && !ARGS.no_cache && cache_load(state->files[i], state->exports + i))
+	{
+		state->elfs[i].file_name = state->files[i];
+		state->ok[i] = log_capture_end(state->logs + i);
+		return;
+	}
+
+	state->elfs[i] = elf_read(state->files[i]);
+	if (state->elfs[i].map && i < state->num_libs)
+	{
+		state->exports[i] = resolve_lib_exports(state->elfs + i);
+		if (!ARGS.no_cache)
+			cache_store(state->files[i], state->exports + i);
+	}
+	state->ok[i] = log_capture_end(state->logs + i) && state->elfs[i].map;
+}
+
+static void* load_worker(void* arg)
+{
+	load_state* state = arg;
+	u32 i;
+	while ((i = atomic_fetch_add(&state->next, 1)) < state->num_files)
+		load_file(state, (u16)i);
+	return NULL;
+}
+
+static bool load_run(load_state* state, u16 jobs)
+{
+	state->logs = calloc(state->num_files, sizeof(void*));
+	state->ok = calloc(state->num_files, sizeof(bool));
+	atomic_init(&state->next, 0);
+
+	// Never spawn more threads than there are files. The calling thread works too.
+	if (jobs > state->num_files)
+		jobs = state->num_files;
+	const u16 num_threads = jobs > 1 ? jobs - 1 : 0;
+	pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+	u16 started = 0;
+	for (; started < num_threads; started++)
+	{
+		if (pthread_create(threads + started, NULL, load_worker, state) != 0)
+			break;
+	}
+	load_worker(state);
+	for (u16 i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// Report everything in input order, so the output is the same for any amount of jobs.
+	bool result = true;
+	for (u16 i = 0; i < state->num_files; i++)
+	{
+		log_replay(state->logs[i]);
+		result &= state->ok[i];
+	}
+
+	free(threads);
+	free(state->logs);
+	free(state->ok);
+	return result;
+}
+
+bool load_files(const str* files, u16 num_files, u16 num_libs, u16 jobs, elf_obj* elfs, resolve_lib* exports)
+{
+	if (!files || !elfs || (num_libs && !exports))
+		return log_msg(LOG_ERR, "couldn't load files, no buffers given!\n");
+
+	load_state state = {
+		.files = files,
+		.num_files = num_files,
+		.num_libs = num_libs,
+		.elfs = elfs,
+		.exports = exports,
+	};
+	return load_run(&state, jobs);
+}
+
+bool load_required(const str* files, u16 num_files, const bool* required, u16 jobs, elf_obj* elfs)
+{
+	if (!files || !elfs || !required)
+		return log_msg(LOG_ERR, "couldn't load files, no buffers given!\n");
+
+	load_state state = {
+		.files = files,
+		.num_files = num_files,
+		.elfs = elfs,
+		.required = required,
+	};
+	return load_run(&state, jobs);
+}
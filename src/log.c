@@ -1,15 +1,32 @@
 #include <log.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 bool log_quiet = false;
 bool log_warn = true;
 
-bool log_msg(log_level level, const str fmt, ...)
+typedef struct
 {
-	va_list args;
-	va_start(args, fmt);
+	log_level level;
+	str text;
+} log_entry;
+
+typedef struct
+{
+	size num_entries;
+	size cap;
+	log_entry* entries;
+	bool failed;
+	/// The capture that was active before this one started.
+	void* prev;
+} log_buffer;
+
+// Messages of the current thread get collected here while capturing.
+static _Thread_local log_buffer* log_capture = NULL;
 
+static void log_print(log_level level, const str text)
+{
 	FILE* f = stdout;
 	str log = _ERR;
 	str col = _BOLD _RED;
@@ -32,14 +49,92 @@ bool log_msg(log_level level, const str fmt, ...)
 			break;
 	}
 	if (talk)
+		fprintf(f, "%s%s%s", col, log, text);
+}
+
+// Keeps a message around until the owner of the current capture replays it.
+static void log_keep(log_level level, str text)
+{
+	if (log_capture->num_entries == log_capture->cap)
 	{
-		fprintf(f, "%s%s", col, log);
-		vfprintf(f, fmt, args);
+		log_capture->cap = log_capture->cap ? log_capture->cap * 2 : 8;
+		log_capture->entries = reallocarray(log_capture->entries, log_capture->cap, sizeof(log_entry));
 	}
+	log_capture->entries[log_capture->num_entries++] = (log_entry) { level, text };
+	if (level > 0)
+		log_capture->failed = true;
+}
+
+bool log_msg(log_level level, const str fmt, ...)
+{
+	va_list args, args_len;
+	va_start(args, fmt);
+	va_copy(args_len, args);
+	// Format into a buffer first, captured messages need to outlive this call.
+	const i32 len = vsnprintf(NULL, 0, fmt, args_len);
+	va_end(args_len);
+	str text = len < 0 ? NULL : malloc((size)len + 1);
+	if (text)
+		vsnprintf(text, (size)len + 1, fmt, args);
 	va_end(args);
 
+	if (log_capture)
+	{
+		log_keep(level, text);
+		return false;
+	}
+
+	if (text)
+		log_print(level, text);
+	free(text);
+
 	if (level > 0)
 		exit(level);
 
 	return false;
 }
+
+void log_capture_begin(void)
+{
+	log_buffer* capture = calloc(1, sizeof(log_buffer));
+	capture->prev = log_capture;
+	log_capture = capture;
+}
+
+bool log_capture_end(void** buf)
+{
+	log_buffer* capture = log_capture;
+	log_capture = capture ? capture->prev : NULL;
+	if (buf)
+		*buf = capture;
+	return capture && !capture->failed;
+}
+
+void log_drain(void* buf, void (*sink)(log_level level, const str text, void* arg), void* arg)
+{
+	log_buffer* capture = buf;
+	if (!capture)
+		return;
+	for (size i = 0; i < capture->num_entries; i++)
+	{
+		if (capture->entries[i].text)
+			sink(capture->entries[i].level, capture->entries[i].text, arg);
+		free(capture->entries[i].text);
+	}
+	free(capture->entries);
+	free(capture);
+}
+
+static void log_replay_one(log_level level, const str text, void* arg)
+{
+	// Replaying inside of another capture hands the messages to that one instead.
+	if (log_capture)
+		log_keep(level, strdup(text));
+	else
+		log_print(level, text);
+}
+
+void log_replay(void* buf)
+{
+	log_drain(buf, log_replay_one, NULL);
+}
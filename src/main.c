@@ -1,88 +1,99 @@
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-// FIXME: This header is POSIX only, swap this for a portable function later!
-#include <libgen.h>
 
 #include <args.h>
+#include <batch.h>
 #include <elf.h>
-#include <patch.h>
+#include <load.h>
+#include <relink.h>
+#include <resolve.h>
+#include <serve.h>
+#include <stats.h>
+#include <trace.h>
 #include <log.h>
 
-i32 main(i32 argc, str* argv)
+// Loads all inputs and links them once.
+static bool main_link_files(void)
 {
-	// Parse arguments.
-	args_parse(argc, argv);
-
-	// Open all libraries.
-	elf_obj* libs = calloc(ARGS.num_files, sizeof(elf_obj));
-	for (u16 i = 0; i < ARGS.num_files; i++)
-		libs[i] = elf_read(ARGS.files[i]);
+	// Nothing to do if no input changed since the last link.
+	if (!ARGS.batch && !ARGS.no_incremental && relink_up_to_date(ARGS.output, ARGS.files, ARGS.num_files))
+		return true;
 
-	const u16 num_libs = ARGS.num_files - 1;
-	elf_obj* target = &libs[num_libs]; // Target is the last given file.
+	// Memory for everything that lives as long as this link.
+	arena mem = {0};
 
-	// Print a table with matching library symbols.
-	log_msg(LOG_INFO, "linking %s...\n", basename(ARGS.files[num_libs]));
+	// Open all libraries and index all symbols they provide, once for the whole run.
+	// In batch mode, all given files are libraries.
+	const u16 num_libs = ARGS.batch ? ARGS.num_files : ARGS.num_files - 1;
+	elf_obj* libs = arena_calloc(&mem, ARGS.num_files, sizeof(elf_obj));
+	resolve_lib* exports = arena_calloc(&mem, num_libs, sizeof(resolve_lib));
+	bool ok = load_files(ARGS.files, ARGS.num_files, num_libs, ARGS.jobs, libs, exports);
+	if (!ok)
+		log_msg(LOG_ERR, "failed to load all input files!\n");
+	resolve_index index = ok ? resolve_build(libs, exports, num_libs) : (resolve_index) {0};
 
-	// Get all symbol names from the target.
-	str* symbols = NULL; // List of symbol names.
-	size num_sym = patch_get_symbols(target, &symbols); // Amount of symbol names.
-	i32* sym_idx = calloc(num_sym, sizeof(i32)); // List of indices into all ELFs, where each symbol is located.
-	size strs_len = 0; // Size of the longest symbol string, for nice table formatting.
-
-	// Try to resolve the symbols.
-	for (size sym = 0; sym < num_sym; sym++)
+	if (ok && ARGS.batch)
 	{
-		if (symbols[sym] == NULL)
-			continue;
-		// Find which library provides this symbol.
-		sym_idx[sym] = -1;
-		for (u16 lib = 0; lib < num_libs; lib++)
-		{
-			if (patch_find_sym(libs + lib, symbols[sym]))
-			{
-				sym_idx[sym] = lib;
-				break;
-			}
-		}
-		// FIXME: There's probably a nicer way to do this.
-		if (strlen(symbols[sym]) > strs_len)
-			strs_len = strlen(symbols[sym]);
+		// Targets get linked concurrently, so every library has to be read before any of them starts.
+		bool* required = arena_alloc(&mem, num_libs * sizeof(bool));
+		memset(required, 1, num_libs * sizeof(bool));
+		if (!(ok = load_required(ARGS.files, num_libs, required, ARGS.jobs, libs)))
+			log_msg(LOG_ERR, "failed to load all libraries!\n");
+		ok = ok && batch_link(ARGS.batch, &index, ARGS.jobs);
 	}
+	else if (ok)
+		ok = batch_link_one(&libs[num_libs], &index, ARGS.output); // Target is the last given file.
 
-	// Print table header.
-	log_msg(LOG_INFO, _BOLD "link\tname");
-	for (size i = 0; i < strs_len - 4; i++) // Pad len - "name"
-		log_msg(LOG_INFO, " ");
-	log_msg(LOG_INFO, _BOLD "\tsource\n");
+	resolve_free(&index);
+	for (u16 i = 0; i < num_libs; i++)
+		resolve_lib_free(exports + i);
+	for (u16 i = 0; i < ARGS.num_files; i++)
+		elf_free(libs + i);
+	arena_free(&mem);
+	return ok;
+}
 
-	for (size sym = 0; sym < num_sym; sym++)
+// Links once and reports where the time went, if requested.
+static bool main_link(void)
+{
+	const bool ok = main_link_files();
+	if (ARGS.stats)
+	{
+		stats_report(ARGS.stats_json);
+		// Every link of watch mode gets a report of its own.
+		stats_reset();
+	}
+	if (ARGS.trace)
 	{
-		if (symbols[sym] == NULL)
-			continue;
+		// In watch mode, the trace always holds the last link.
+		trace_write(ARGS.trace);
+		trace_reset();
+	}
+	return ok;
+}
 
-		// Padding string for nice formatting.
-		const size pad_len = strs_len - strlen(symbols[sym]);
-		char pad_str[256];
-		memset(pad_str, ' ', pad_len);
-		pad_str[pad_len] = '\0';
+i32 main(i32 argc, str* argv)
+{
+	stats_reset();
+	trace_reset();
 
-		if (sym_idx[sym] >= 0)
-			log_msg(LOG_INFO, "[" _GREEN "x" _REGULAR "]\t%s%s\t%s\n", symbols[sym], pad_str, basename(ARGS.files[sym_idx[sym]]));
-		else
-			log_msg(LOG_INFO, "[" _RED "-" _REGULAR "]\t" _RED "%s%s\tn/a\n", symbols[sym], pad_str);
-	}
+	// Parse arguments.
+	const stats_clock start = stats_start();
+	args_parse(argc, argv);
+	stats_stop(STATS_ARGS, start);
 
-	// TODO: Finish linking code
-	// Patch input executable with all libraries.
-	if (!patch_link_library(target, libs, num_libs))
-		log_msg(LOG_ERR, "failed to link against a library!\n");
+	// Either keep libraries around for other processes, or let a server do all the work.
+	if (ARGS.serve)
+		return serve_run(ARGS.serve) ? 0 : 1;
+	if (ARGS.client)
+		return serve_client(ARGS.client, ARGS.files, ARGS.num_files, ARGS.output) ? 0 : 1;
 
-	// Write the result to file.
-	elf_write(ARGS.output, target);
-	log_msg(LOG_INFO, _GREEN "wrote the patched binary to \"%s\"\n", ARGS.output);
+	// Link again whenever an input changes.
+	if (ARGS.watch)
+	{
+		if (!relink_watch(ARGS.files, ARGS.num_files, main_link))
+			log_msg(LOG_ERR, "failed to watch the input files!\n");
+		return 0;
+	}
 
-	free(libs);
-	return 0;
+	return main_link() ? 0 : 1;
 }
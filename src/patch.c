@@ -1,36 +1,48 @@
+#define _GNU_SOURCE
 #include "elf.h"
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include <patch.h>
+#include <layout.h>
+#include <bind.h>
+#include <profile.h>
 #include <string.h>
 #include <instr.h>
 #include <args.h>
 #include <log.h>
+#include <stats.h>
+#include <trace.h>
 
-size patch_get_symbols(const elf_obj* elf, str** names)
+size patch_get_symbols(const elf_obj* elf, arena* mem, str** names)
 {
+	if (!mem)
+		return log_msg(LOG_ERR, "couldn't get symbols, no arena given!\n");
 	if (!names)
 		return log_msg(LOG_ERR, "couldn't get symbols, no name buffer given!\n");
 	if (!elf)
 		return log_msg(LOG_ERR, "couldn't get symbols, no ELF given!\n");
 
 	// Get the dynamic symbol table.
-	elf_section* lib_sym = elf_section_get(elf, ".dynsym");
-	elf_section* lib_str = elf_section_get(elf, ".dynstr");
-	size num_sym = lib_sym->header.sh_size / lib_sym->header.sh_entsize;
+	size num_sym;
+	str lib_str;
+	elf_symtab* lib_sym = elf_dynsym_table(elf, &num_sym, &lib_str, NULL);
+	if (!lib_sym)
+		num_sym = 0;
 
 	// Allocate a max size of all dynamic symbols.
-	str* buf = calloc(num_sym, sizeof(str));
+	str* buf = arena_calloc(mem, num_sym, sizeof(str));
 	// Write all present function symbols to the buffer.
 	for (size i = 0; i < num_sym; i++)
 	{
 		// Reinterpret the data as an array of symbols.
-		elf_symtab* sym = ((elf_symtab*)lib_sym->data) + i;
+		elf_symtab* sym = lib_sym + i;
 		// Only match symbols with info == STB_GLOBAL | STB_FUNC
 		if (sym->sym_info == 0x12)
-			buf[i] = (char*)(lib_str->data + sym->sym_name);
+			buf[i] = lib_str + sym->sym_name;
 		else
 			buf[i] = NULL;
 	}
@@ -41,203 +53,1078 @@ size patch_get_symbols(const elf_obj* elf, str** names)
 elf_symtab* patch_find_sym(const elf_obj* elf, str name)
 {
 	if (!name)
+	{
 		log_msg(LOG_ERR, "[%s] couldn't find symbol, no name given!\n", basename(elf->file_name));
+		return NULL;
+	}
 	if (!elf)
+	{
 		log_msg(LOG_ERR, "couldn't find symbol \"%s\", no ELF given!\n", name);
+		return NULL;
+	}
+
+	// Only match symbols with info == STB_GLOBAL | STB_FUNC
+	elf_symtab* sym = elf_dynsym_lookup(elf, name);
+	if (sym && sym->sym_info == 0x12)
+		return sym;
+	return NULL;
+}
+
+// A relative reference inside a copied function that has to follow the function to its new location.
+typedef struct
+{
+	/// Offsets of the 32-bit displacement and the end of its instruction, relative to the start of the function.
+	u32 at;
+	u32 end;
+	/// The copied function the reference points to, or -1 if it points to `addr` in the target.
+	i32 dest;
+	u64 addr;
+} patch_fixup;
+
+// Function boundaries of a library, sorted by address.
+typedef struct
+{
+	bool built;
+	size num;
+	u64* addrs;
+	u64* sizes;
+	u16* shndx;
+	str* names;
+} patch_lib_funcs;
+
+// Where the PLT stubs of an ELF live and which imports they belong to.
+typedef struct
+{
+	bool built;
+	/// Address of the first stub and the distance between two stubs.
+	u64 base;
+	u64 stride;
+	/// The `.rela.plt` entries, stub `i` belongs to `relocs[i]`.
+	size num_relocs;
+	const elf_rela* relocs;
+	/// The dynamic symbol table the relocations refer to.
+	size num_syms;
+	const elf_symtab* syms;
+	str strtab;
+} patch_plt;
+
+struct patch_session
+{
+	/// Memory for everything that only lives as long as this link.
+	arena mem;
+	elf_obj* target;
+	const resolve_index* index;
+	/// The section all functions get copied into.
+	elf_section* sect;
+
+	size num_funcs;
+	size funcs_cap;
+	patch_func* funcs;
+	size num_fixups;
+	size fixups_cap;
+	patch_fixup* fixups;
+	/// Maps (library, address) to an index into `funcs` + 1, open addressing.
+	size map_cap;
+	u32* map;
+
+	/// Per library information, built on first use.
+	patch_lib_funcs* lib_funcs;
+	patch_plt* lib_plts;
+	patch_plt target_plt;
+};
+
+static u64 patch_func_key(u16 lib, u64 addr)
+{
+	u64 key = addr ^ ((u64)lib << 48);
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccd;
+	key ^= key >> 33;
+	return key;
+}
+
+// Finds a function that's already part of the link, returns -1 if there is none.
+static i32 patch_func_find(const patch_session* session, u16 lib, u64 addr)
+{
+	if (!session->map_cap)
+		return -1;
+	const size mask = session->map_cap - 1;
+	for (size i = patch_func_key(lib, addr) & mask; session->map[i]; i = (i + 1) & mask)
+	{
+		const patch_func* func = session->funcs + (session->map[i] - 1);
+		if (func->lib == lib && func->addr == addr)
+			return (i32)(session->map[i] - 1);
+	}
+	return -1;
+}
+
+// Gets a library of the session, reading it first if it only came from the cache.
+static elf_obj* patch_lib(patch_session* session, u16 lib)
+{
+	elf_obj* elf = session->index->libs + lib;
+	if (!elf->map)
+		*elf = elf_read(elf->file_name);
+	return elf;
+}
+
+// Adds a function to the link if it isn't part of it yet. Returns its index.
+static i32 patch_func_add(patch_session* session, u16 lib, u16 shndx, u64 addr, u64 len, str name)
+{
+	i32 found = patch_func_find(session, lib, addr);
+	if (found >= 0)
+		return found;
+
+	if (session->num_funcs == session->funcs_cap)
+	{
+		const size cap = session->funcs_cap ? session->funcs_cap * 2 : 64;
+		session->funcs = arena_realloc(&session->mem, session->funcs,
+			session->funcs_cap * sizeof(patch_func), cap * sizeof(patch_func));
+		session->funcs_cap = cap;
+	}
+	// Keep the map at most half full.
+	if ((session->num_funcs + 1) * 2 > session->map_cap)
+	{
+		const size cap = session->map_cap ? session->map_cap * 2 : 128;
+		u32* map = arena_calloc(&session->mem, cap, sizeof(u32));
+		for (size i = 0; i < session->num_funcs; i++)
+		{
+			size slot = patch_func_key(session->funcs[i].lib, session->funcs[i].addr) & (cap - 1);
+			while (map[slot])
+				slot = (slot + 1) & (cap - 1);
+			map[slot] = (u32)i + 1;
+		}
+		session->map = map;
+		session->map_cap = cap;
+	}
+
+	const i32 idx = (i32)session->num_funcs++;
+	session->funcs[idx] = (patch_func) {
+		.name = name,
+		.lib = lib,
+		.shndx = shndx,
+		.addr = addr,
+		.size = len,
+	};
+	size slot = patch_func_key(lib, addr) & (session->map_cap - 1);
+	while (session->map[slot])
+		slot = (slot + 1) & (session->map_cap - 1);
+	session->map[slot] = (u32)idx + 1;
+	return idx;
+}
+
+// Adds the function behind a resolved symbol. Returns its index, or -1 if it can't be linked.
+static i32 patch_func_add_entry(patch_session* session, const resolve_entry* entry)
+{
+	const resolve_index* index = session->index;
+	if (entry->conflict != -1)
+	{
+		log_msg(LOG_ERR, "conflict detected: %s and %s both provide \"%s\"\n",
+			basename(index->libs[entry->conflict].file_name), basename(index->libs[entry->lib].file_name), entry->name);
+		return -1;
+	}
+	if (entry->sym->sym_size == 0)
+	{
+		log_msg(LOG_WARN, "[%s <- %s] symbol \"%s\" has no data, skipping...\n",
+			basename(session->target->file_name), basename(index->libs[entry->lib].file_name), entry->name);
+		return -1;
+	}
+	return patch_func_add(session, entry->lib, entry->sym->sym_shndx, entry->sym->sym_value, entry->sym->sym_size, entry->name);
+}
 
-	elf_section* lib_sym = elf_section_get(elf, ".dynsym");
+static i32 patch_cmp_addr(const void* a, const void* b, void* arg)
+{
+	const u64* addrs = arg;
+	const u64 x = addrs[*(const size*)a];
+	const u64 y = addrs[*(const size*)b];
+	return x < y ? -1 : x > y;
+}
 
-	str* sym_names;
-	size num_names = patch_get_symbols(elf, &sym_names);
-	for (size i = 0; i < num_names; i++)
+// Collects the start, size and name of every function in a library.
+static const patch_lib_funcs* patch_lib_funcs_get(patch_session* session, u16 lib)
+{
+	patch_lib_funcs* funcs = session->lib_funcs + lib;
+	if (funcs->built)
+		return funcs;
+	funcs->built = true;
+	elf_obj* elf = patch_lib(session, lib);
+
+	// Prefer the full symbol table, it also knows about local functions.
+	elf_symtab* syms = NULL;
+	size num_syms = 0;
+	str strtab = NULL;
+	for (u16 i = 1; i < elf->header.e_shnum && !syms; i++)
 	{
-		if (sym_names[i] == NULL)
+		elf_section* sect = elf->sections + i;
+		if (sect->header.sh_type != SHT_SYMTAB || sect->header.sh_link >= elf->header.e_shnum)
 			continue;
-		if (!strcmp(sym_names[i], name))
-			return ((elf_symtab*)lib_sym->data) + i;
+		syms = elf_symbols(elf, sect, &num_syms);
+		strtab = (str)elf_section_data(elf, elf->sections + sect->header.sh_link);
 	}
-	return NULL;
+	if (!syms || !strtab)
+		syms = elf_dynsym_table(elf, &num_syms, &strtab, NULL);
+	if (!syms)
+		return funcs;
+
+	// Sort all defined functions by address.
+	size* order = arena_alloc(&session->mem, num_syms * sizeof(size));
+	u64* addrs = arena_alloc(&session->mem, num_syms * sizeof(u64));
+	size num = 0;
+	for (size i = 0; i < num_syms; i++)
+	{
+		addrs[i] = syms[i].sym_value;
+		// STT_FUNC with a body.
+		if ((syms[i].sym_info & 0xf) == 2 && syms[i].sym_shndx != 0 && syms[i].sym_size != 0)
+			order[num++] = i;
+	}
+	qsort_r(order, num, sizeof(size), patch_cmp_addr, addrs);
+
+	funcs->addrs = arena_alloc(&session->mem, num * sizeof(u64));
+	funcs->sizes = arena_alloc(&session->mem, num * sizeof(u64));
+	funcs->shndx = arena_alloc(&session->mem, num * sizeof(u16));
+	funcs->names = arena_alloc(&session->mem, num * sizeof(str));
+	for (size i = 0; i < num; i++)
+	{
+		const elf_symtab* sym = syms + order[i];
+		// Aliases share the same address, only keep the first one.
+		if (funcs->num && funcs->addrs[funcs->num - 1] == sym->sym_value)
+			continue;
+		funcs->addrs[funcs->num] = sym->sym_value;
+		funcs->sizes[funcs->num] = sym->sym_size;
+		funcs->shndx[funcs->num] = sym->sym_shndx;
+		funcs->names[funcs->num] = strtab + sym->sym_name;
+		funcs->num++;
+	}
+	return funcs;
 }
 
-bool patch_link_library(elf_obj* target, const elf_obj* library, u16 num_lib)
+// Finds the function starting exactly at the given address, returns -1 if there is none.
+static i64 patch_lib_funcs_find(const patch_lib_funcs* funcs, u64 addr)
 {
-	// Get all symbols of the target.
-	str* names;
-	size num_names = patch_get_symbols(target, &names);
+	size lo = 0, hi = funcs->num;
+	while (lo < hi)
+	{
+		const size mid = lo + (hi - lo) / 2;
+		if (funcs->addrs[mid] < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < funcs->num && funcs->addrs[lo] == addr ? (i64)lo : -1;
+}
 
-	// Find which symbols are available in each library. -1 means nothing provides it.
-	i32* provides = calloc(num_names, sizeof(i32));
-	for (size sym = 0; sym < num_names; sym++)
+// Finds the PLT stubs of an ELF and the `.rela.plt` entries that belong to them.
+static void patch_plt_build(const elf_obj* elf, patch_plt* plt)
+{
+	plt->built = true;
+	const elf_section* rela = elf_section_get(elf, ".rela.plt");
+	elf_section* plt_sec = elf_section_get(elf, ".plt.sec");
+	elf_section* plt_sect = elf_section_get(elf, ".plt");
+	if (!rela || (!plt_sec && !plt_sect))
+		return;
+	// Only the x86_64 stub layout is known, any other PLT is treated as if there was none.
+	if (elf->header.e_machine != EM_X86_64)
 	{
-		if (names[sym] == NULL)
+		log_msg(LOG_WARN, "[%s] PLT stubs of architecture %#x aren't supported\n", basename(elf->file_name), elf->header.e_machine);
+		return;
+	}
+
+	plt->relocs = elf_relocs(elf, (elf_section*)rela, &plt->num_relocs);
+	if (!plt->relocs)
+		plt->num_relocs = 0;
+	plt->syms = elf_dynsym_table(elf, &plt->num_syms, &plt->strtab, NULL);
+
+	// With IBT, the stubs that get called live in .plt.sec. Otherwise the first .plt entry is the resolver stub.
+	// Linkers usually record the stub size in `sh_entsize`, the x86_64 stubs are 16 bytes otherwise.
+	const elf_section* stubs = plt_sec ? plt_sec : plt_sect;
+	plt->stride = stubs->header.sh_entsize ? stubs->header.sh_entsize : 16;
+	plt->base = plt_sec ? plt_sec->header.sh_addr : plt_sect->header.sh_addr + plt->stride;
+}
+
+// Gets the name of the import whose PLT stub starts at `addr`, or `NULL` if there is none.
+static str patch_plt_name(const patch_plt* plt, u64 addr)
+{
+	if (!plt->relocs || !plt->syms || addr < plt->base || (addr - plt->base) % plt->stride)
+		return NULL;
+	const size idx = (addr - plt->base) / plt->stride;
+	if (idx >= plt->num_relocs || ELF_R_TYPE(plt->relocs[idx].r_info) != R_X86_64_JUMP_SLOT)
+		return NULL;
+	const u32 sym = ELF_R_SYM(plt->relocs[idx].r_info);
+	return sym < plt->num_syms ? plt->strtab + plt->syms[sym].sym_name : NULL;
+}
+
+// Gets the address of the PLT stub of an import, or 0 if it doesn't have one.
+static u64 patch_plt_addr(const patch_plt* plt, const str name)
+{
+	for (size i = 0; plt->syms && i < plt->num_relocs; i++)
+	{
+		const u32 sym = ELF_R_SYM(plt->relocs[i].r_info);
+		if (ELF_R_TYPE(plt->relocs[i].r_info) == R_X86_64_JUMP_SLOT && sym < plt->num_syms &&
+			!strcmp(plt->strtab + plt->syms[sym].sym_name, name))
+			return plt->base + i * plt->stride;
+	}
+	return 0;
+}
+
+// Records a fixup of the function that is currently being scanned.
+static void patch_fixup_add(patch_session* session, patch_fixup fixup)
+{
+	if (session->num_fixups == session->fixups_cap)
+	{
+		const size cap = session->fixups_cap ? session->fixups_cap * 2 : 64;
+		session->fixups = arena_realloc(&session->mem, session->fixups,
+			session->fixups_cap * sizeof(patch_fixup), cap * sizeof(patch_fixup));
+		session->fixups_cap = cap;
+	}
+	session->fixups[session->num_fixups++] = fixup;
+}
+
+// Gets the bytes of a function in its library.
+static const u8* patch_func_bytes(patch_session* session, const patch_func* func)
+{
+	elf_obj* lib = patch_lib(session, func->lib);
+	elf_section* sect = func->shndx && func->shndx < lib->header.e_shnum ?
+		lib->sections + func->shndx : elf_section_at(lib, func->addr);
+	if (!sect || func->addr < sect->header.sh_addr ||
+		func->addr + func->size > sect->header.sh_addr + sect->header.sh_size)
+		return NULL;
+	const u8* data = elf_section_data(lib, sect);
+	return data ? data + (func->addr - sect->header.sh_addr) : NULL;
+}
+
+// Decodes a function and adds everything it calls to the link.
+static void patch_func_scan(patch_session* session, size idx)
+{
+	const patch_func func = session->funcs[idx];
+	const elf_obj* lib = patch_lib(session, func.lib);
+	const str lib_name = basename(lib->file_name);
+	session->funcs[idx].first_fixup = session->num_fixups;
+
+	const u8* code = patch_func_bytes(session, &func);
+	if (!code)
+	{
+		log_msg(LOG_WARN, "[%s] couldn't find the code of \"%s\"\n", lib_name, func.name);
+		session->funcs[idx].pinned = true;
+		return;
+	}
+
+	patch_plt* plt = session->lib_plts + func.lib;
+	if (!plt->built)
+		patch_plt_build(lib, plt);
+
+	for (u64 pos = 0; pos < func.size;)
+	{
+		instr_info instr;
+		if (!instr_decode(lib->header.e_machine, code + pos, func.size - pos, &instr))
+		{
+			log_msg(LOG_WARN, "[%s] couldn't decode \"%s\" at %#lx, not following its calls\n",
+				lib_name, func.name, func.addr + pos);
+			session->funcs[idx].pinned = true;
+			break;
+		}
+		const u64 dest = func.addr + pos + instr.rel_target;
+		const u64 at = pos;
+		pos += instr.length;
+
+		// Only references that leave the function have to be followed.
+		if (!instr.rel_size || (dest >= func.addr && dest < func.addr + func.size))
+			continue;
+		if (instr.rip_relative)
+		{
+			log_msg(LOG_WARN, "[%s] \"%s\" references data at %#lx, which doesn't get copied\n",
+				lib_name, func.name, dest);
+			session->funcs[idx].pinned = true;
+			continue;
+		}
+		if (instr.rel_size != 4)
+		{
+			log_msg(LOG_WARN, "[%s] \"%s\" has a short branch out of the function at %#lx\n",
+				lib_name, func.name, func.addr + at);
+			session->funcs[idx].pinned = true;
 			continue;
-		provides[sym] = -1;
-		for (u16 lib = 0; lib < num_lib; lib++)
+		}
+
+		patch_fixup fixup = { .at = (u32)(at + instr.rel_offset), .end = (u32)pos, .dest = -1 };
+		const str import = patch_plt_name(plt, dest);
+		if (import)
 		{
-			if (patch_find_sym(library + lib, names[sym]))
+			// Calls through the PLT go to whatever library provides the symbol.
+			const resolve_entry* entry = resolve_find(session->index, import);
+			if (entry)
+				fixup.dest = patch_func_add_entry(session, entry);
+			// Nothing provides it, but the target can still call it through its own PLT.
+			else if (!(fixup.addr = patch_plt_addr(&session->target_plt, import)))
 			{
-				// If another library has already provided this symbol, we have a conflict!
-				if (provides[sym] != -1)
-					return log_msg(LOG_ERR, "conflict detected: %s and %s both provide \"%s\"\n",
-						basename(library[lib].file_name), basename(library[provides[sym]].file_name), names[sym]
-					);
-				provides[sym] = (i32)lib;
+				log_msg(LOG_WARN, "[%s] \"%s\" calls \"%s\", which nothing provides\n", lib_name, func.name, import);
+				session->funcs[idx].pinned = true;
+				continue;
 			}
 		}
+		else
+		{
+			// Direct calls into the same library.
+			const patch_lib_funcs* funcs = patch_lib_funcs_get(session, func.lib);
+			const i64 callee = patch_lib_funcs_find(funcs, dest);
+			if (callee < 0)
+			{
+				log_msg(LOG_WARN, "[%s] \"%s\" branches to %#lx, which isn't a known function\n",
+					lib_name, func.name, dest);
+				session->funcs[idx].pinned = true;
+				continue;
+			}
+			fixup.dest = patch_func_add(session, func.lib, funcs->shndx[callee], dest, funcs->sizes[callee], funcs->names[callee]);
+		}
+		if (fixup.dest < 0 && !fixup.addr)
+		{
+			session->funcs[idx].pinned = true;
+			continue;
+		}
+		patch_fixup_add(session, fixup);
 	}
+	session->funcs[idx].num_fixups = session->num_fixups - session->funcs[idx].first_fixup;
+}
 
-	// Create new section for all libraries on the target, or find an existing one.
-	str sect_name = ".solink";
-	elf_section* add_sect = elf_section_add(target, sect_name, 0x410000);
+// Drops the functions that can't be copied from the link. Their callers keep calling them through the target's PLT if
+// the target imports them, otherwise the callers can't be copied either. Returns the amount of imports that got dropped.
+static size patch_drop_pinned(patch_session* session)
+{
+	// Pinning spreads to callers until nothing changes anymore.
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (size i = 0; i < session->num_funcs; i++)
+		{
+			patch_func* func = session->funcs + i;
+			for (size f = func->first_fixup; !func->pinned && f < func->first_fixup + func->num_fixups; f++)
+			{
+				patch_fixup* fixup = session->fixups + f;
+				if (fixup->dest < 0 || !session->funcs[fixup->dest].pinned)
+					continue;
+				// The PLT entry of the callee doesn't get redirected, so it still leads to the library.
+				if (session->funcs[fixup->dest].plt_addr)
+				{
+					fixup->addr = session->funcs[fixup->dest].plt_addr;
+					fixup->dest = -1;
+					continue;
+				}
+				func->pinned = true;
+				changed = true;
+			}
+		}
+	}
 
-	// FIXME: This could probably be written nicer.
+	// Move all functions that stay down, together with their fixups.
+	const str target_name = basename(session->target->file_name);
+	u32* new_idx = arena_alloc(&session->mem, (session->num_funcs ? session->num_funcs : 1) * sizeof(u32));
+	size num_kept = 0, num_dropped = 0;
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		const patch_func* func = session->funcs + i;
+		new_idx[i] = func->pinned ? UINT32_MAX : (u32)num_kept++;
+		if (func->pinned && func->plt_addr)
+		{
+			log_msg(LOG_WARN, "[%s <- %s] \"%s\" can't be copied, calls to it keep going through the PLT\n",
+				target_name, basename(session->index->libs[func->lib].file_name), func->name);
+			num_dropped++;
+		}
+	}
+	size num_fixups = 0;
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		patch_func func = session->funcs[i];
+		if (func.pinned)
+			continue;
+		const size first = num_fixups;
+		for (size f = func.first_fixup; f < func.first_fixup + func.num_fixups; f++)
+		{
+			patch_fixup fixup = session->fixups[f];
+			if (fixup.dest >= 0)
+				fixup.dest = (i32)new_idx[fixup.dest];
+			session->fixups[num_fixups++] = fixup;
+		}
+		func.first_fixup = first;
+		session->funcs[new_idx[i]] = func;
+	}
+	session->num_funcs = num_kept;
+	session->num_fixups = num_fixups;
+
+	// The lookup map still points to the old places.
+	memset(session->map, 0, session->map_cap * sizeof(u32));
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		size slot = patch_func_key(session->funcs[i].lib, session->funcs[i].addr) & (session->map_cap - 1);
+		while (session->map[slot])
+			slot = (slot + 1) & (session->map_cap - 1);
+		session->map[slot] = (u32)i + 1;
+	}
+	return num_dropped;
+}
+
+patch_session* patch_begin(elf_obj* target, const resolve_index* index)
+{
+	if (!target || !index)
+	{
+		log_msg(LOG_ERR, "couldn't plan the link, no target or index given!\n");
+		return NULL;
+	}
+
+	const stats_clock start = stats_start();
+	patch_session* session = calloc(1, sizeof(patch_session));
+	session->target = target;
+	session->index = index;
+	session->lib_funcs = arena_calloc(&session->mem, index->num_libs, sizeof(patch_lib_funcs));
+	session->lib_plts = arena_calloc(&session->mem, index->num_libs, sizeof(patch_plt));
+	patch_plt_build(target, &session->target_plt);
+
+	// Get all symbols of the target.
+	str* names;
+	size num_names = patch_get_symbols(target, &session->mem, &names);
 	for (size sym = 0; sym < num_names; sym++)
 	{
-		if (names[sym] == NULL)
+		if (!names[sym])
 			continue;
 		// If nothing provides this symbol.
-		if (provides[sym] == -1)
-		{
+		const bool resolved = resolve_find(index, names[sym]);
+		stats_count(resolved ? STATS_SYMS_RESOLVED : STATS_SYMS_UNRESOLVED, 1);
+		if (!resolved)
 			log_msg(LOG_WARN, "[%s <- ?] nothing provides symbol \"%s\"\n",
 				basename(target->file_name), names[sym]);
+	}
+
+	// Start from the imports the target actually calls through its PLT.
+	const patch_plt* plt = &session->target_plt;
+	for (size i = 0; plt->syms && i < plt->num_relocs; i++)
+	{
+		const u32 sym = ELF_R_SYM(plt->relocs[i].r_info);
+		if (ELF_R_TYPE(plt->relocs[i].r_info) != R_X86_64_JUMP_SLOT || sym >= plt->num_syms)
+			continue;
+		const resolve_entry* entry = resolve_find(index, plt->strtab + plt->syms[sym].sym_name);
+		if (!entry)
 			continue;
-		}
 
+		const i32 func = patch_func_add_entry(session, entry);
 		// Deliberately ignoring result, as not all symbols might be used.
-		bool linked = patch_link_symbol(target, add_sect, library + provides[sym], names[sym]);
-		// Unless the force flag is set.
-		if (ARGS.force && !linked)
-			return log_msg(LOG_WARN, "[%s <- %s] failed to link symbol \"%s\"\n",
-				basename(target->file_name), basename(library->file_name), names[sym]);
+		if (func < 0)
+		{
+			// Unless the force flag is set.
+			if (!ARGS.force)
+				continue;
+			log_msg(LOG_WARN, "[%s <- %s] failed to link symbol \"%s\"\n",
+				basename(target->file_name), basename(index->libs[entry->lib].file_name), entry->name);
+			patch_end(session);
+			stats_stop(STATS_LINK, start);
+			return NULL;
+		}
+		session->funcs[func].plt_addr = plt->base + i * plt->stride;
+		session->funcs[func].import_sym = sym;
 	}
-	patch_fix_offsets(target);
-	return true;
+
+	// Pull in everything the called functions need, and nothing else.
+	for (size i = 0; i < session->num_funcs; i++)
+		patch_func_scan(session, i);
+
+	// Functions whose copies wouldn't work stay where they are.
+	if (patch_drop_pinned(session) && ARGS.force)
+	{
+		log_msg(LOG_WARN, "[%s] not all functions can be copied\n", basename(target->file_name));
+		patch_end(session);
+		stats_stop(STATS_LINK, start);
+		return NULL;
+	}
+	stats_stop(STATS_LINK, start);
+	return session;
 }
 
-static u64 basic = 0;
+patch_func* patch_funcs(patch_session* session, size* num_funcs)
+{
+	*num_funcs = session ? session->num_funcs : 0;
+	return session ? session->funcs : NULL;
+}
 
-bool patch_link_symbol(elf_obj* target, elf_section* sect, const elf_obj* library, str name)
+// Gets the function whose copy a function uses, which is itself unless it got folded.
+static size patch_fold_rep(const patch_session* session, size idx)
 {
-	if (!name)
-		return log_msg(LOG_WARN, "failed to link a symbol, no name given\n");
-	if (!target)
-		return log_msg(LOG_WARN, "[? <- ?] failed to link symbol \"%s\", no target given\n", name);
-	if (!sect)
-		return log_msg(LOG_WARN, "[%s <- ?] failed to link symbol \"%s\", no section given\n", basename(target->file_name), name);
-	if (!library)
-		return log_msg(LOG_WARN, "[%s <- ?] failed to link symbol \"%s\", no library given\n",
-			basename(target->file_name), name);
+	while (session->funcs[idx].same_as)
+		idx = session->funcs[idx].same_as - 1;
+	return idx;
+}
 
-	// Get bytes from library function.
-	elf_symtab* sym = patch_find_sym(library, name);
-	elf_symtab* target_sym = patch_find_sym(target, name);
-	if (!sym)
-		return log_msg(LOG_WARN, "[%s <- %s] couldn't find symbol \"%s\" in the library\n",
-			basename(target->file_name), basename(library->file_name), name);
-	if (sym->sym_size == 0)
-		return log_msg(LOG_WARN, "[%s <- %s] symbol \"%s\" has no data, skipping...\n",
-			basename(target->file_name), basename(library->file_name), name);
-
-	const u64 old_size = sect->header.sh_size;
-	const u64 new_size = old_size + sym->sym_size;
-	sect->data = reallocarray(sect->data, new_size, sizeof(u64));
-
-	// Get the section this symbol is located in, take its file offset and use that as a baseline
-	// to get the relative offset.
-	const elf_section* sym_section = library->sections + sym->sym_shndx;
-	const u64 offset = sym->sym_value - sym_section->header.sh_offset;
-	// Append the bytes to the end of the section.
-	memcpy(sect->data + old_size, sym_section->data + offset, sym->sym_size);
-
-	// Update the new section header.
-	sect->header.sh_size = new_size;
-	target->segments[target->header.e_phnum - 1].header.p_memsz = new_size;
-	target->segments[target->header.e_phnum - 1].header.p_filesz = new_size;
-
-	// TODO: Let the symbol know where the data lives now.
-	if (!target_sym)
-		// This should never happen, we've already established that the symbol exists.
-		// This means memory got corrupted!
-		return log_msg(LOG_WARN, "[%s <- %s] couldn't find symbol \"%s\" in the target, possible memory corruption!\n",
-			basename(target->file_name), basename(library->file_name), name);
-
-	//target_sym->sym_value = sym_section->header.sh_addr + new_size;
-	//target_sym->sym_size = new_size;
-	//target_sym->sym_shndx = elf_section_get_idx(target, sect);
-
-	// Update the PLT section.
-	elf_section* plt = elf_section_get(target, ".plt");
-
-	// TODO: Get the offset of the symbol in the PLT.
-	u64 plt_symoff = 0x30;
-	plt_symoff += basic;
-	basic += 0x10;
-
-	// Get the vaddr of the PLT section and calculate the offset to the .solink section.
-	u64 addr = (sect->header.sh_addr + old_size) - // Symbol text offset.
-			   (plt->header.sh_addr + plt_symoff); // PLT entry for this symbol.
-
-	// Get the instruction bytes.
-	u8 instr[0x10];
-	if (!instr_get_bytes(target->header.e_machine, addr, instr))
-		log_msg(LOG_ERR, "unsupported architecture! (%x)\n", target->header.e_machine);
-	// Overwrite the PLT entry.
-	memcpy(plt->data + plt_symoff, instr, 0x10);
+// Hashes the code of a function, with every reference replaced by where it points to.
+static u64 patch_fold_hash(const patch_session* session, size idx, const u8* code)
+{
+	const patch_func* func = session->funcs + idx;
+	u64 hash = 0xcbf29ce484222325 ^ func->size;
+	u64 pos = 0;
+	for (size i = func->first_fixup; i <= func->first_fixup + func->num_fixups; i++)
+	{
+		const bool last = i == func->first_fixup + func->num_fixups;
+		const patch_fixup* fixup = session->fixups + i;
+		const u64 end = last ? func->size : fixup->at;
+		for (; pos < end; pos++)
+			hash = (hash ^ code[pos]) * 0x100000001b3;
+		if (last)
+			break;
+		hash = (hash ^ (fixup->dest >= 0 ? patch_fold_rep(session, fixup->dest) : fixup->addr)) * 0x100000001b3;
+		pos = fixup->at + sizeof(i32);
+	}
+	return hash;
+}
 
-	log_msg(LOG_INFO, "[%s <- %s] linked \"%s\" <%p>\n",
-		basename(target->file_name), basename(library->file_name), name, sym->sym_value);
-	return true;
+// Checks if two functions end up with the same copy, given the functions that were folded so far.
+static bool patch_fold_same(const patch_session* session, size a, size b, const u8* code_a, const u8* code_b)
+{
+	const patch_func* x = session->funcs + a;
+	const patch_func* y = session->funcs + b;
+	if (x->size != y->size || x->num_fixups != y->num_fixups)
+		return false;
+	u64 pos = 0;
+	for (size i = 0; i < x->num_fixups; i++)
+	{
+		const patch_fixup* fx = session->fixups + x->first_fixup + i;
+		const patch_fixup* fy = session->fixups + y->first_fixup + i;
+		if (fx->at != fy->at || fx->end != fy->end || (fx->dest < 0) != (fy->dest < 0) || memcmp(code_a + pos, code_b + pos, fx->at - pos))
+			return false;
+		if (fx->dest >= 0 ? patch_fold_rep(session, fx->dest) != patch_fold_rep(session, fy->dest) : fx->addr != fy->addr)
+			return false;
+		pos = fx->at + sizeof(i32);
+	}
+	return !memcmp(code_a + pos, code_b + pos, x->size - pos);
+}
+
+static i32 patch_cmp_hash(const void* a, const void* b, void* arg)
+{
+	const u64* hashes = arg;
+	const size x = *(const size*)a, y = *(const size*)b;
+	if (hashes[x] != hashes[y])
+		return hashes[x] < hashes[y] ? -1 : 1;
+	return x < y ? -1 : x > y;
 }
 
-void patch_fix_offsets(elf_obj* elf)
+// Lets functions with identical code share one copy. Functions only count as identical once everything they reference
+// is, so this repeats until nothing changes anymore. Returns the amount of functions that got folded.
+static size patch_fold(patch_session* session)
 {
-	for (u16 i = 0; i < elf->header.e_shnum; i++)
+	const size num = session->num_funcs;
+	const u8** code = arena_alloc(&session->mem, (num ? num : 1) * sizeof(u8*));
+	u64* hashes = arena_alloc(&session->mem, (num ? num : 1) * sizeof(u64));
+	size* order = arena_alloc(&session->mem, (num ? num : 1) * sizeof(size));
+	for (size i = 0; i < num; i++)
+		code[i] = session->funcs[i].pinned ? NULL : patch_func_bytes(session, session->funcs + i);
+
+	size num_folded = 0;
+	for (bool changed = true; changed;)
 	{
-		const u64 segm_limit = elf->header.e_ehsize + (elf->header.e_phentsize * elf->header.e_phnum);
-		if (elf->sections[i].header.sh_offset < segm_limit)
+		changed = false;
+		for (size i = 0; i < num; i++)
 		{
-			elf->sections[i].header.sh_offset = segm_limit;
+			order[i] = i;
+			hashes[i] = code[i] && !session->funcs[i].same_as ? patch_fold_hash(session, i, code[i]) : 0;
 		}
-		if (i != 0)
+		qsort_r(order, num, sizeof(size), patch_cmp_hash, hashes);
+
+		// Every function goes to the first identical one, so the copy that's kept is the one found first.
+		for (size first = 0, next; first < num; first = next)
 		{
-			// Important: First check if this sections overlaps with the previous one.
-			// In that case, move the offset away from it.
-			const u64 prev_limit = elf->sections[i - 1].header.sh_offset + elf->sections[i - 1].header.sh_size;
-			if (elf->sections[i].header.sh_offset < prev_limit)
+			for (next = first + 1; next < num && hashes[order[next]] == hashes[order[first]]; next++)
+				;
+			for (size a = first; a < next && hashes[order[first]]; a++)
 			{
-				elf->sections[i].header.sh_offset = prev_limit + prev_limit % elf->sections[i].header.sh_addralign;
+				const size x = order[a];
+				for (size b = a + 1; b < next && !session->funcs[x].same_as; b++)
+				{
+					const size y = order[b];
+					if (session->funcs[y].same_as || !patch_fold_same(session, x, y, code[x], code[y]))
+						continue;
+					session->funcs[y].same_as = x + 1;
+					num_folded++;
+					changed = true;
+				}
 			}
 		}
 	}
 
-	// Finally, adjust the ELF header.
-	const elf_section* last = elf->sections + (elf->header.e_shnum - 1);
-	elf->header.e_shoff = last->header.sh_offset + last->header.sh_size;
-	// Align.
-	elf->header.e_shoff = ALIGN(elf->header.e_shoff, 16);
+	// A function can be folded into one that got folded itself later on.
+	for (size i = 0; i < num; i++)
+	{
+		const size rep = patch_fold_rep(session, i);
+		session->funcs[i].same_as = rep != i ? rep + 1 : 0;
+	}
+	stats_count(STATS_FUNCS_FOLDED, num_folded);
+	log_msg(LOG_INFO, "[%s] folded %zu of %zu functions into identical ones\n",
+		basename(session->target->file_name), num_folded, num);
+	return num_folded;
+}
+
+// Orders functions by their samples in the profile, the most first. Ties keep the order they were found in.
+static i32 patch_cmp_hot(const void* a, const void* b, void* arg)
+{
+	const u64* counts = arg;
+	const size x = *(const size*)a, y = *(const size*)b;
+	if (counts[x] != counts[y])
+		return counts[x] > counts[y] ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+// Gets the order to lay out the functions of a link in. Hot functions go first if there is a profile.
+static size* patch_order(patch_session* session)
+{
+	size* order = arena_alloc(&session->mem, (session->num_funcs ? session->num_funcs : 1) * sizeof(size));
+	for (size i = 0; i < session->num_funcs; i++)
+		order[i] = i;
+	profile* prof = ARGS.profile ? profile_acquire(ARGS.profile) : NULL;
+	if (!prof)
+		return order;
+
+	u64* counts = arena_alloc(&session->mem, (session->num_funcs ? session->num_funcs : 1) * sizeof(u64));
+	size num_hot = 0;
+	for (size i = 0; i < session->num_funcs; i++)
+		counts[i] = profile_count(prof, session->funcs[i].name);
+	// A shared copy is as hot as all functions using it.
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		if (session->funcs[i].same_as)
+			counts[session->funcs[i].same_as - 1] += counts[i];
+	}
+	for (size i = 0; i < session->num_funcs; i++)
+		num_hot += counts[i] != 0;
+	profile_release(prof);
+	qsort_r(order, session->num_funcs, sizeof(size), patch_cmp_hot, counts);
+	log_msg(LOG_INFO, "[%s] %zu of %zu functions are hot\n", basename(session->target->file_name), num_hot, session->num_funcs);
+	return order;
+}
+
+// How many functions a worker of the copy phase picks up at once.
+#define PATCH_CHUNK 64
+
+typedef struct
+{
+	patch_session* session;
+	size num_chunks;
+	/// Captured messages of each chunk.
+	void** logs;
+	bool* ok;
+	/// The first function of each chunk that couldn't be linked, `SIZE_MAX` if there is none.
+	size* failed;
+	/// The next chunk to be picked up by a worker.
+	atomic_size_t next;
+} patch_copy_state;
+
+static void* patch_copy_worker(void* arg)
+{
+	patch_copy_state* state = arg;
+	patch_session* session = state->session;
+	size chunk;
+	while ((chunk = atomic_fetch_add(&state->next, 1)) < state->num_chunks)
+	{
+		const stats_clock start = stats_start();
+		// Errors must not exit while other threads are still working, so collect them instead.
+		log_capture_begin();
+		state->failed[chunk] = SIZE_MAX;
+		const size end = (chunk + 1) * PATCH_CHUNK < session->num_funcs ? (chunk + 1) * PATCH_CHUNK : session->num_funcs;
+		for (size i = chunk * PATCH_CHUNK; i < end; i++)
+		{
+			const u64 span = trace_begin();
+			const bool linked = patch_link_symbol(session, i);
+			trace_end("patch_link_symbol", session->index->libs[session->funcs[i].lib].file_name, session->funcs[i].name, span);
+			if (!linked && state->failed[chunk] == SIZE_MAX)
+				state->failed[chunk] = i;
+		}
+		state->ok[chunk] = log_capture_end(state->logs + chunk);
+		stats_stop(STATS_LINK, start);
+	}
+	return NULL;
+}
+
+// Copies all functions to their offsets and redirects their PLT entries, using up to `jobs` threads.
+// Every function has a place of its own by now, so the workers never write to the same bytes.
+static bool patch_copy(patch_session* session, u16 jobs)
+{
+	elf_obj* target = session->target;
+	// Sections the workers write to have to be copied out of the file mapping before they start.
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		elf_section* plt = session->funcs[i].plt_addr ? elf_section_at(target, session->funcs[i].plt_addr) : NULL;
+		if (plt)
+			elf_section_reserve(target, plt, plt->header.sh_size);
+	}
+
+	patch_copy_state state = {
+		.session = session,
+		.num_chunks = (session->num_funcs + PATCH_CHUNK - 1) / PATCH_CHUNK,
+	};
+	state.logs = calloc(state.num_chunks ? state.num_chunks : 1, sizeof(void*));
+	state.ok = calloc(state.num_chunks ? state.num_chunks : 1, sizeof(bool));
+	state.failed = calloc(state.num_chunks ? state.num_chunks : 1, sizeof(size));
+	atomic_init(&state.next, 0);
+
+	// Never spawn more threads than there are chunks. The calling thread works too.
+	if (jobs > state.num_chunks)
+		jobs = (u16)state.num_chunks;
+	const u16 num_threads = jobs > 1 ? jobs - 1 : 0;
+	pthread_t* threads = calloc(num_threads ? num_threads : 1, sizeof(pthread_t));
+	u16 started = 0;
+	for (; started < num_threads; started++)
+	{
+		if (pthread_create(threads + started, NULL, patch_copy_worker, &state) != 0)
+			break;
+	}
+	patch_copy_worker(&state);
+	for (u16 i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// Report everything in the order of the functions, so the output is the same for any amount of jobs.
+	bool ok = true;
+	size failed = SIZE_MAX;
+	for (size c = 0; c < state.num_chunks; c++)
+	{
+		log_replay(state.logs[c]);
+		ok &= state.ok[c];
+		if (failed == SIZE_MAX)
+			failed = state.failed[c];
+	}
+	free(threads);
+	free(state.logs);
+	free(state.ok);
+	free(state.failed);
+
+	// Other copies may already point at a function that failed, so the link can't go on without it.
+	if (!ok || failed != SIZE_MAX)
+		return log_msg(LOG_ERR, "[%s] failed to copy all functions!\n", basename(target->file_name));
+	return true;
+}
+
+bool patch_apply(patch_session* session)
+{
+	if (!session)
+		return log_msg(LOG_ERR, "couldn't link, no session given!\n");
+	elf_obj* target = session->target;
+	stats_clock start = stats_start();
+
+	// Create new section for all libraries on the target, or find an existing one.
+	str sect_name = ".solink";
+	session->sect = elf_section_add(target, sect_name);
+	session->sect->header.sh_addralign = 16;
 
-	// Fix special program headers.
-	for (u16 i = 0; i < elf->header.e_phnum; i++)
+	// Lay out all functions, then copy them. Folded functions take the place of the one they were folded into.
+	if (ARGS.fold_identical)
+		patch_fold(session);
+	const size* order = patch_order(session);
+	u64 total = session->sect->header.sh_size;
+	for (size i = 0; i < session->num_funcs; i++)
 	{
-		// PT_INERP
-		if (elf->segments[i].header.p_type == 3)
+		if (session->funcs[order[i]].same_as)
+			continue;
+		total = ALIGN(total, 16);
+		session->funcs[order[i]].offset = total;
+		total += session->funcs[order[i]].size;
+	}
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		if (session->funcs[i].same_as)
+			session->funcs[i].offset = session->funcs[session->funcs[i].same_as - 1].offset;
+	}
+	u8* data = elf_section_reserve(target, session->sect, total);
+	memset(data + session->sect->header.sh_size, 0x90, total - session->sect->header.sh_size); // nop
+	session->sect->header.sh_size = total;
+
+	// The copies get pointed at their final addresses, so those have to be known first.
+	stats_stop(STATS_LINK, start);
+	if (!layout_place(target, ARGS.hugepage_align ? LAYOUT_HUGE_PAGE : 0))
+		return false;
+
+	// Batch mode already links a target per job.
+	if (!patch_copy(session, ARGS.batch || !ARGS.jobs ? 1 : ARGS.jobs))
+		return false;
+	start = stats_start();
+	if (ARGS.direct_calls)
+		patch_direct_calls(session);
+	if (ARGS.static_bind)
+		bind_static(session, target, session->index);
+	stats_stop(STATS_LINK, start);
+
+	return layout_plan(target);
+}
+
+void patch_end(patch_session* session)
+{
+	if (!session)
+		return;
+	arena_free(&session->mem);
+	free(session);
+}
+
+bool patch_link_library(elf_obj* target, const resolve_index* index)
+{
+	patch_session* session = patch_begin(target, index);
+	const bool result = session && patch_apply(session);
+	patch_end(session);
+	return result;
+}
+
+bool patch_code(patch_session* session, size idx, u64 base, u8* out)
+{
+	if (!session || !out)
+		return log_msg(LOG_WARN, "failed to copy a function, no session or buffer given\n");
+	if (idx >= session->num_funcs)
+		return log_msg(LOG_WARN, "failed to copy a function, index %zu is out of bounds\n", idx);
+
+	const patch_func* func = session->funcs + idx;
+	const str target_name = basename(session->target->file_name);
+	const str lib_name = basename(session->index->libs[func->lib].file_name);
+
+	// Get bytes from library function.
+	const u8* code = patch_func_bytes(session, func);
+	if (!code)
+		return log_msg(LOG_WARN, "[%s <- %s] couldn't find the code of \"%s\"\n", target_name, lib_name, func->name);
+	memcpy(out, code, func->size);
+	stats_count(STATS_BYTES_COPIED, func->size);
+
+	// Make all references that leave the function point to where their destination lives now.
+	const u64 new_addr = base + func->offset;
+	for (size i = func->first_fixup; i < func->first_fixup + func->num_fixups; i++)
+	{
+		const patch_fixup* fixup = session->fixups + i;
+		const u64 dest = fixup->dest >= 0 ? base + session->funcs[fixup->dest].offset : fixup->addr;
+		const i64 disp = (i64)dest - (i64)(new_addr + fixup->end);
+		if (disp < INT32_MIN || disp > INT32_MAX)
+			return log_msg(LOG_WARN, "[%s <- %s] \"%s\" can't reach %#lx from its new location\n",
+				target_name, lib_name, func->name, dest);
+		const i32 rel = (i32)disp;
+		memcpy(out + fixup->at, &rel, sizeof(i32));
+	}
+	return true;
+}
+
+bool patch_link_symbol(patch_session* session, size idx)
+{
+	if (!session || !session->sect)
+		return log_msg(LOG_WARN, "failed to link a symbol, no session given\n");
+	if (idx >= session->num_funcs)
+		return log_msg(LOG_WARN, "failed to link a symbol, index %zu is out of bounds\n", idx);
+
+	elf_obj* target = session->target;
+	const patch_func* func = session->funcs + idx;
+	const str name = func->name;
+	const elf_obj* library = session->index->libs + func->lib;
+
+	// Copy the function and point it to its new surroundings, unless it shares the copy of an identical one.
+	if (!func->same_as && !patch_code(session, idx, session->sect->header.sh_addr, session->sect->data + func->offset))
+		return false;
+	const u64 new_addr = session->sect->header.sh_addr + func->offset;
+
+	// Redirect the PLT entry of the target to the copy.
+	if (func->plt_addr)
+	{
+		elf_section* plt = elf_section_at(target, func->plt_addr);
+		if (!plt)
+			return log_msg(LOG_WARN, "[%s <- %s] couldn't find the PLT entry of \"%s\"\n",
+				basename(target->file_name), basename(library->file_name), name);
+
+		// Get the instruction bytes.
+		u8 instr[0x10];
+		if (!instr_get_bytes(target->header.e_machine, (u32)(new_addr - func->plt_addr), instr))
 		{
-			elf->segments[i].header.p_offset = elf_section_get(elf, ".interp")->header.sh_offset;
+			log_msg(LOG_ERR, "unsupported architecture! (%x)\n", target->header.e_machine);
+			return false;
 		}
+		// Overwrite the PLT entry.
+		const u64 plt_off = func->plt_addr - plt->header.sh_addr;
+		const u64 len = plt->header.sh_size - plt_off < sizeof(instr) ? plt->header.sh_size - plt_off : sizeof(instr);
+		memcpy(elf_section_reserve(target, plt, plt->header.sh_size) + plt_off, instr, len);
+	}
+
+	log_msg(LOG_INFO, "[%s <- %s] linked \"%s\" <%p>\n",
+		basename(target->file_name), basename(library->file_name), name, func->addr);
+	return true;
+}
+
+// Points the `call rel32` or `jmp rel32` whose displacement is at `pos` of a section at the copy behind its PLT stub.
+static bool patch_retarget(patch_session* session, elf_section* sect, const u64* dests, u64 pos)
+{
+	const patch_plt* plt = &session->target_plt;
+	const u8* data = sect->data;
+	if (pos < 1 || pos + sizeof(i32) > sect->header.sh_size || (data[pos - 1] != 0xe8 && data[pos - 1] != 0xe9))
+		return false;
+	i32 disp;
+	memcpy(&disp, data + pos, sizeof(i32));
+	const u64 next = sect->header.sh_addr + pos + sizeof(i32);
+	const u64 dest = next + (i64)disp;
+	if (dest < plt->base || (dest - plt->base) % plt->stride || (dest - plt->base) / plt->stride >= plt->num_relocs)
+		return false;
+	const u64 copy = dests[(dest - plt->base) / plt->stride];
+	const i64 new_disp = (i64)copy - (i64)next;
+	if (!copy || new_disp < INT32_MIN || new_disp > INT32_MAX)
+		return false;
+
+	disp = (i32)new_disp;
+	memcpy(elf_section_reserve(session->target, sect, sect->header.sh_size) + pos, &disp, sizeof(i32));
+	return true;
+}
+
+size patch_direct_calls(patch_session* session)
+{
+	if (!session || !session->sect)
+		return log_msg(LOG_WARN, "failed to rewrite calls, no session given\n");
+	elf_obj* target = session->target;
+	const str target_name = basename(target->file_name);
+	if (target->header.e_machine != EM_X86_64)
+		return log_msg(LOG_WARN, "[%s] rewriting calls is only supported on x86-64\n", target_name);
 
-		// ELF Header loading segment, usually the third one.
-		if (elf->segments[i].header.p_type == 1 &&
-			elf->segments[i].header.p_flags == 4 &&
-			elf->segments[i].header.p_offset == 0)
+	// Where every PLT stub leads to now, 0 for the ones that weren't redirected.
+	const patch_plt* plt = &session->target_plt;
+	u64* dests = arena_calloc(&session->mem, plt->num_relocs ? plt->num_relocs : 1, sizeof(u64));
+	for (size i = 0; i < session->num_funcs; i++)
+	{
+		if (session->funcs[i].plt_addr)
+			dests[(session->funcs[i].plt_addr - plt->base) / plt->stride] = session->sect->header.sh_addr + session->funcs[i].offset;
+	}
+
+	size num_calls = 0;
+	for (u16 i = 1; i < target->header.e_shnum; i++)
+	{
+		// Only code of the target, the copies already call each other directly and the stubs stay as they are.
+		elf_section* sect = target->sections + i;
+		if ((sect->header.sh_flags & 6) != 6 || sect->added || sect->header.sh_type == SHT_NOBITS ||
+			!strncmp(elf_section_get_name(target, i), ".plt", 4) || !elf_section_data(target, sect))
+			continue;
+
+		// Relocations name every call site exactly, if the target kept them.
+		elf_section* rela = NULL;
+		for (u16 j = 1; j < target->header.e_shnum && !rela; j++)
+		{
+			if ((target->sections[j].header.sh_type == SHT_RELA || target->sections[j].header.sh_type == SHT_REL) &&
+				target->sections[j].header.sh_info == i)
+				rela = target->sections + j;
+		}
+		size num_relocs = 0;
+		const elf_rela* relocs = rela ? elf_relocs(target, rela, &num_relocs) : NULL;
+		if (relocs)
 		{
-			if (i != 2)
-				log_msg(LOG_WARN, "possible segment corruption, expected elf->egments[2] to be the ELF header at %p, but index was %hu\n", elf->segments[i].header.p_vaddr, i);
+			for (size r = 0; r < num_relocs; r++)
+			{
+				const u32 type = ELF_R_TYPE(relocs[r].r_info);
+				if ((type == R_X86_64_PC32 || type == R_X86_64_PLT32) && relocs[r].r_offset >= sect->header.sh_addr)
+					num_calls += patch_retarget(session, sect, dests, relocs[r].r_offset - sect->header.sh_addr);
+			}
+			continue;
+		}
 
-			const u64 hdr_size = (elf->header.e_phnum - elf->old_header.e_phnum) * elf->header.e_phentsize;
-			elf->segments[i].header.p_memsz += hdr_size;
-			elf->segments[i].header.p_filesz += hdr_size;
-			elf->segments[i].header.p_memsz = ALIGN(elf->segments[i].header.p_memsz, elf->segments[i].header.p_align);
-			elf->segments[i].header.p_filesz = ALIGN(elf->segments[i].header.p_filesz, elf->segments[i].header.p_align);
+		// Otherwise, walk the instructions front to back.
+		for (u64 pos = 0; pos < sect->header.sh_size;)
+		{
+			instr_info info;
+			if (!instr_decode(target->header.e_machine, sect->data + pos, sect->header.sh_size - pos, &info))
+			{
+				log_msg(LOG_WARN, "[%s] couldn't decode %s at %#lx, its remaining calls keep going through the PLT\n",
+					target_name, elf_section_get_name(target, i), sect->header.sh_addr + pos);
+				break;
+			}
+			if ((info.kind == INSTR_CALL || info.kind == INSTR_JUMP) && info.rel_size == sizeof(i32) &&
+				info.rel_offset + sizeof(i32) == info.length)
+				num_calls += patch_retarget(session, sect, dests, pos + info.rel_offset);
+			pos += info.length;
 		}
 	}
+
+	stats_count(STATS_CALLS_REWRITTEN, num_calls);
+	log_msg(LOG_INFO, "[%s] %zu calls bypass the PLT now\n", target_name, num_calls);
+	return num_calls;
 }
@@ -0,0 +1,222 @@
+#include <ctype.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <profile.h>
+#include <arena.h>
+#include <cache.h>
+#include <elf.h>
+#include <log.h>
+
+// The most whitespace separated fields of a line that get looked at.
+#define PROFILE_MAX_FIELDS 32
+
+typedef struct
+{
+	/// Name of the function, `NULL` if the slot is empty.
+	str name;
+	u32 hash;
+	u64 count;
+} profile_entry;
+
+struct profile
+{
+	str path;
+	cache_stamp stamp;
+	/// Links currently using the profile.
+	u32 refs;
+	/// The file changed since, so the profile goes away once it isn't used anymore.
+	bool stale;
+	/// Memory for the names.
+	arena mem;
+	/// Open addressing hash table, `cap` is always a power of two.
+	size cap;
+	size num_entries;
+	profile_entry* entries;
+};
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile* profile_current = NULL;
+
+static void profile_free(profile* prof)
+{
+	arena_free(&prof->mem);
+	free(prof->entries);
+	free(prof->path);
+	free(prof);
+}
+
+// Finds the slot for a name, either the one holding it or the empty one it would go into.
+static profile_entry* profile_slot(const profile* prof, const str name, u32 hash)
+{
+	const size mask = prof->cap - 1;
+	for (size i = hash & mask;; i = (i + 1) & mask)
+	{
+		profile_entry* entry = prof->entries + i;
+		if (!entry->name || (entry->hash == hash && !strcmp(entry->name, name)))
+			return entry;
+	}
+}
+
+static void profile_add(profile* prof, const str name, u64 count)
+{
+	// Keep the load factor at or below 50%.
+	if ((prof->num_entries + 1) * 2 > prof->cap)
+	{
+		const size old_cap = prof->cap;
+		profile_entry* old = prof->entries;
+		prof->cap = old_cap ? old_cap * 2 : 256;
+		prof->entries = calloc(prof->cap, sizeof(profile_entry));
+		for (size i = 0; i < old_cap; i++)
+		{
+			if (old[i].name)
+				*profile_slot(prof, old[i].name, old[i].hash) = old[i];
+		}
+		free(old);
+	}
+
+	const u32 hash = elf_gnu_hash(name);
+	profile_entry* entry = profile_slot(prof, name, hash);
+	if (!entry->name)
+	{
+		entry->name = strcpy(arena_alloc(&prof->mem, strlen(name) + 1), name);
+		entry->hash = hash;
+		prof->num_entries++;
+	}
+	entry->count += count;
+}
+
+static bool profile_is_number(const str field, bool hex)
+{
+	if (!*field)
+		return false;
+	for (str c = field; *c; c++)
+	{
+		if (!(hex ? isxdigit((u8)*c) : isdigit((u8)*c)))
+			return false;
+	}
+	return true;
+}
+
+// Gets the function and the amount of samples a line of a profile stands for. Returns `NULL` if it names none.
+static str profile_parse_line(str line, u64* count)
+{
+	str fields[PROFILE_MAX_FIELDS];
+	u32 num_fields = 0;
+	char* save;
+	for (str field = strtok_r(line, " \t\r\n", &save); field && num_fields < PROFILE_MAX_FIELDS;
+		field = strtok_r(NULL, " \t\r\n", &save))
+		fields[num_fields++] = field;
+	if (!num_fields || fields[0][0] == '#')
+		return NULL;
+
+	str name = NULL;
+	*count = 1;
+	// Symbol counts: "<name> <count>" or "<count> <name>".
+	if (num_fields == 2 && profile_is_number(fields[0], false) != profile_is_number(fields[1], false))
+	{
+		const bool count_first = profile_is_number(fields[0], false);
+		name = fields[count_first ? 1 : 0];
+		*count = strtoull(fields[count_first ? 0 : 1], NULL, 10);
+	}
+	// `perf script`: "<ip> <symbol>[+0x<offset>] (<dso>)", alone for a stack frame or at the end of a sample.
+	for (u32 i = 1; !name && i + 1 < num_fields; i++)
+	{
+		if (fields[i + 1][0] == '(' && profile_is_number(fields[i - 1], true) && fields[i][0] != '[')
+			name = fields[i];
+	}
+	if (!name)
+		return NULL;
+
+	// Offsets and versions aren't part of the function name.
+	str offset = strstr(name, "+0x");
+	if (offset)
+		*offset = '\0';
+	str version = strchr(name, '@');
+	if (version)
+		*version = '\0';
+	return *name ? name : NULL;
+}
+
+static profile* profile_read(const str path, const cache_stamp* stamp)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		log_msg(LOG_WARN, "couldn't open profile \"%s\"!\n", path);
+		return NULL;
+	}
+
+	profile* prof = calloc(1, sizeof(profile));
+	prof->path = strdup(path);
+	prof->stamp = *stamp;
+	char* line = NULL;
+	size line_cap = 0;
+	u64 num_samples = 0;
+	while (getline(&line, &line_cap, file) != -1)
+	{
+		u64 count;
+		const str name = profile_parse_line(line, &count);
+		if (name && count)
+		{
+			profile_add(prof, name, count);
+			num_samples += count;
+		}
+	}
+	free(line);
+	fclose(file);
+
+	log_msg(LOG_INFO, "[%s] read %lu samples of %zu functions\n", basename(prof->path), num_samples, prof->num_entries);
+	return prof;
+}
+
+profile* profile_acquire(const str path)
+{
+	if (!path)
+		return NULL;
+	cache_stamp stamp;
+	if (!cache_stamp_get(path, &stamp))
+	{
+		log_msg(LOG_WARN, "couldn't access profile \"%s\"!\n", path);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&profile_lock);
+	// Read the profile again if the file changed since it was read.
+	profile* cur = profile_current;
+	if (cur && (strcmp(cur->path, path) || memcmp(&cur->stamp, &stamp, sizeof(stamp))))
+	{
+		cur->stale = true;
+		if (!cur->refs)
+			profile_free(cur);
+		profile_current = NULL;
+	}
+	if (!profile_current)
+		profile_current = profile_read(path, &stamp);
+	cur = profile_current;
+	if (cur)
+		cur->refs++;
+	pthread_mutex_unlock(&profile_lock);
+	return cur;
+}
+
+void profile_release(profile* prof)
+{
+	if (!prof)
+		return;
+	pthread_mutex_lock(&profile_lock);
+	if (--prof->refs == 0 && prof->stale)
+		profile_free(prof);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+u64 profile_count(const profile* prof, const str name)
+{
+	if (!prof || !name || !prof->entries)
+		return 0;
+	const profile_entry* entry = profile_slot(prof, name, elf_gnu_hash(name));
+	return entry->name ? entry->count : 0;
+}
@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+// FIXME: This header is POSIX only, swap this for a portable function later!
+#include <libgen.h>
+
+#include <relink.h>
+#include <args.h>
+#include <cache.h>
+#include <log.h>
+#include <stats.h>
+
+#define RELINK_MAGIC 0x4d4b4c53 // "SLKM"
+#define RELINK_VERSION 2
+#define RELINK_PATH_MAX (4096 + 32)
+// How long files have to stay unchanged before relinking, in milliseconds.
+#define RELINK_SETTLE_MS 50
+// Link options that change more of the output than just the copied functions.
+#define RELINK_OPT_DIRECT_CALLS 1
+#define RELINK_OPT_STATIC_BIND 2
+#define RELINK_OPT_PROFILE 4
+#define RELINK_OPT_HUGEPAGE_ALIGN 8
+#define RELINK_OPT_FOLD_IDENTICAL 16
+
+// Layout of a manifest:
+//   relink_header
+//   relink_file files[num_files], the libraries followed by the target
+//   relink_func funcs[num_funcs]
+//   char        strtab[strtab_size]
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	/// The output as it was after the last link.
+	cache_stamp output;
+	/// The options the output was linked with, an output linked with other ones can't be updated in place.
+	u64 options;
+	/// Address and file offset of `.solink` in the output.
+	u64 sect_addr;
+	u64 sect_offset;
+	u64 num_files;
+	u64 num_funcs;
+	u64 strtab_size;
+} relink_header;
+
+typedef struct
+{
+	cache_stamp stamp;
+	/// Offset of the path in `strtab`.
+	u64 path;
+} relink_file;
+
+typedef struct
+{
+	/// Offset of the name in `strtab`.
+	u64 name;
+	/// The library the function was copied from.
+	u64 lib;
+	/// Where the copy lives in `.solink`, and how much space it has there.
+	u64 offset;
+	u64 slot;
+	u64 size;
+	/// The PLT entry of the target that jumps to the copy, 0 if there is none.
+	u64 plt_addr;
+	/// FNV-1a of the whole slot as it was written.
+	u64 hash;
+} relink_func;
+
+typedef struct
+{
+	u8* data;
+	const relink_header* header;
+	const relink_file* files;
+	relink_func* funcs;
+	str strtab;
+} relink_manifest;
+
+static void relink_manifest_path(const str output, char out[RELINK_PATH_MAX])
+{
+	snprintf(out, RELINK_PATH_MAX, "%s.solink-manifest", output);
+}
+
+static u64 relink_hash(const u8* data, size len)
+{
+	u64 hash = 0xcbf29ce484222325;
+	for (size i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash;
+}
+
+static u64 relink_options(void)
+{
+	return (ARGS.direct_calls ? RELINK_OPT_DIRECT_CALLS : 0) | (ARGS.static_bind ? RELINK_OPT_STATIC_BIND : 0) |
+		(ARGS.profile ? RELINK_OPT_PROFILE : 0) | (ARGS.hugepage_align ? RELINK_OPT_HUGEPAGE_ALIGN : 0) |
+		(ARGS.fold_identical ? RELINK_OPT_FOLD_IDENTICAL : 0);
+}
+
+// Reads and validates the manifest of an output. Returns `false` if there is no usable one.
+static bool relink_load(const str output, relink_manifest* manifest)
+{
+	char path[RELINK_PATH_MAX];
+	relink_manifest_path(output, path);
+	const i32 fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	u8* data = NULL;
+	bool ok = fstat(fd, &st) == 0 && (size)st.st_size >= sizeof(relink_header);
+	if (ok)
+	{
+		data = malloc(st.st_size);
+		ok = read(fd, data, st.st_size) == st.st_size;
+	}
+	close(fd);
+
+	const relink_header* header = (const relink_header*)data;
+	ok = ok && header->magic == RELINK_MAGIC && header->version == RELINK_VERSION &&
+		header->options == relink_options() &&
+		header->num_files <= UINT16_MAX + 1 && header->num_funcs <= st.st_size / sizeof(relink_func) &&
+		sizeof(relink_header) + header->num_files * sizeof(relink_file) + header->num_funcs * sizeof(relink_func) +
+		header->strtab_size == (u64)st.st_size && header->strtab_size && data[st.st_size - 1] == '\0';
+	if (!ok)
+	{
+		free(data);
+		return false;
+	}
+
+	*manifest = (relink_manifest) {
+		.data = data,
+		.header = header,
+		.files = (const relink_file*)(header + 1),
+	};
+	manifest->funcs = (relink_func*)(manifest->files + header->num_files);
+	manifest->strtab = (str)(manifest->funcs + header->num_funcs);
+
+	// Every name has to be inside of the string table.
+	for (u64 i = 0; i < header->num_files && ok; i++)
+		ok = manifest->files[i].path < header->strtab_size;
+	for (u64 i = 0; i < header->num_funcs && ok; i++)
+		ok = manifest->funcs[i].name < header->strtab_size && manifest->funcs[i].lib + 1 < header->num_files;
+	if (!ok)
+		free(data);
+	return ok;
+}
+
+// Writes a manifest for the current state of all files.
+static void relink_store(const str output, const str* files, u16 num_files, u64 sect_addr, u64 sect_offset,
+	const relink_func* funcs, const str* names, size num_funcs)
+{
+	// Put all strings behind each other.
+	u64 strtab_size = 0;
+	for (u16 i = 0; i < num_files; i++)
+		strtab_size += strlen(files[i]) + 1;
+	for (size i = 0; i < num_funcs; i++)
+		strtab_size += strlen(names[i]) + 1;
+
+	const size total = sizeof(relink_header) + num_files * sizeof(relink_file) + num_funcs * sizeof(relink_func) + strtab_size;
+	u8* data = calloc(1, total);
+	relink_header* header = (relink_header*)data;
+	relink_file* out_files = (relink_file*)(header + 1);
+	relink_func* out_funcs = (relink_func*)(out_files + num_files);
+	str strtab = (str)(out_funcs + num_funcs);
+
+	bool ok = cache_stamp_get(output, &header->output);
+	header->magic = RELINK_MAGIC;
+	header->version = RELINK_VERSION;
+	header->options = relink_options();
+	header->sect_addr = sect_addr;
+	header->sect_offset = sect_offset;
+	header->num_files = num_files;
+	header->num_funcs = num_funcs;
+	header->strtab_size = strtab_size;
+
+	u64 pos = 0;
+	for (u16 i = 0; i < num_files && ok; i++)
+	{
+		ok = cache_stamp_get(files[i], &out_files[i].stamp);
+		out_files[i].path = pos;
+		pos += sprintf(strtab + pos, "%s", files[i]) + 1;
+	}
+	for (size i = 0; i < num_funcs; i++)
+	{
+		out_funcs[i] = funcs[i];
+		out_funcs[i].name = pos;
+		pos += sprintf(strtab + pos, "%s", names[i]) + 1;
+	}
+
+	// Write to a temporary file first, so a crash never leaves a broken manifest behind.
+	char path[RELINK_PATH_MAX], tmp[RELINK_PATH_MAX + 8];
+	relink_manifest_path(output, path);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	const i32 fd = ok ? mkstemp(tmp) : -1;
+	if (fd >= 0)
+	{
+		ok = write(fd, data, total) == (ssize_t)total;
+		close(fd);
+		if (!ok || rename(tmp, path) != 0)
+			unlink(tmp);
+	}
+	free(data);
+}
+
+// Checks that the manifest was recorded for the same files and output. Only libraries may have changed.
+static bool relink_check(const relink_manifest* manifest, const str* files, u16 num_files, bool libs_changed, const str output)
+{
+	cache_stamp stamp;
+	if (manifest->header->num_files != num_files || !cache_stamp_get(output, &stamp) ||
+		memcmp(&stamp, &manifest->header->output, sizeof(stamp)))
+		return false;
+	for (u16 i = 0; i < num_files; i++)
+	{
+		if (strcmp(manifest->strtab + manifest->files[i].path, files[i]))
+			return false;
+		// The target always has to be the same, libraries are checked function by function.
+		if ((i == num_files - 1 || !libs_changed) &&
+			(!cache_stamp_get(files[i], &stamp) || memcmp(&stamp, &manifest->files[i].stamp, sizeof(stamp))))
+			return false;
+	}
+	return true;
+}
+
+bool relink_up_to_date(const str output, const str* files, u16 num_files)
+{
+	relink_manifest manifest;
+	if (!output || !files || !relink_load(output, &manifest))
+		return false;
+	const bool result = relink_check(&manifest, files, num_files, false, output);
+	free(manifest.data);
+	if (result)
+		log_msg(LOG_INFO, "\"%s\" is up to date\n", output);
+	return result;
+}
+
+static i32 relink_cmp_func(const void* a, const void* b, void* arg)
+{
+	const relink_manifest* manifest = arg;
+	const relink_func* x = manifest->funcs + *(const u64*)a;
+	const relink_func* y = manifest->funcs + *(const u64*)b;
+	if (x->lib != y->lib)
+		return x->lib < y->lib ? -1 : 1;
+	return strcmp(manifest->strtab + x->name, manifest->strtab + y->name);
+}
+
+// Finds a function of the manifest by library and name. Returns -1 if there is none, or more than one.
+static i64 relink_find(const relink_manifest* manifest, const u64* order, u64 lib, const str name)
+{
+	size lo = 0, hi = manifest->header->num_funcs;
+	while (lo < hi)
+	{
+		const size mid = lo + (hi - lo) / 2;
+		const relink_func* func = manifest->funcs + order[mid];
+		const i32 cmp = func->lib != lib ? (func->lib < lib ? -1 : 1) : strcmp(manifest->strtab + func->name, name);
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo >= manifest->header->num_funcs)
+		return -1;
+	const relink_func* found = manifest->funcs + order[lo];
+	if (found->lib != lib || strcmp(manifest->strtab + found->name, name))
+		return -1;
+	// Static functions of different files can share a name, those can't be told apart.
+	if (lo + 1 < manifest->header->num_funcs)
+	{
+		const relink_func* next = manifest->funcs + order[lo + 1];
+		if (next->lib == lib && !strcmp(manifest->strtab + next->name, name))
+			return -1;
+	}
+	return (i64)order[lo];
+}
+
+static i32 relink_cmp_offset(const void* a, const void* b, void* arg)
+{
+	const patch_func* funcs = arg;
+	const u64 x = funcs[*(const u64*)a].offset, y = funcs[*(const u64*)b].offset;
+	return x < y ? -1 : x > y;
+}
+
+bool relink_update(patch_session* session, const elf_obj* target, const resolve_index* index, const str output)
+{
+	if (!session || !target || !index || !output)
+		return false;
+	relink_manifest manifest;
+	if (!relink_load(output, &manifest))
+		return false;
+
+	const u16 num_files = index->num_libs + 1;
+	str* files = malloc(num_files * sizeof(str));
+	for (u16 i = 0; i < index->num_libs; i++)
+		files[i] = index->libs[i].file_name;
+	files[index->num_libs] = target->file_name;
+
+	size num_funcs;
+	patch_func* funcs = patch_funcs(session, &num_funcs);
+	const u64 num_old = manifest.header->num_funcs;
+	u64* order = malloc((num_old ? num_old : 1) * sizeof(u64));
+	bool* matched = calloc(num_old ? num_old : 1, sizeof(bool));
+	relink_func* entries = calloc(num_funcs ? num_funcs : 1, sizeof(relink_func));
+	str* names = calloc(num_funcs ? num_funcs : 1, sizeof(str));
+	u8** code = calloc(num_funcs ? num_funcs : 1, sizeof(u8*));
+	u64* by_offset = malloc((num_funcs ? num_funcs : 1) * sizeof(u64));
+	i32 fd = -1;
+	size num_changed = 0;
+
+	bool ok = relink_check(&manifest, files, num_files, true, output);
+	if (!ok)
+		goto done;
+
+	// Every function has to get its old place back, otherwise the layout changes.
+	for (u64 i = 0; i < num_old; i++)
+		order[i] = i;
+	qsort_r(order, num_old, sizeof(u64), relink_cmp_func, &manifest);
+	for (size i = 0; i < num_funcs && ok; i++)
+	{
+		const i64 old = relink_find(&manifest, order, funcs[i].lib, funcs[i].name);
+		ok = old >= 0 && !matched[old] && funcs[i].size <= manifest.funcs[old].slot &&
+			funcs[i].plt_addr == manifest.funcs[old].plt_addr;
+		if (!ok)
+		{
+			log_msg(LOG_INFO, "[%s] layout of \"%s\" changed, relinking from scratch...\n", basename(output), funcs[i].name);
+			break;
+		}
+		matched[old] = true;
+		funcs[i].offset = manifest.funcs[old].offset;
+		entries[i] = manifest.funcs[old];
+		entries[i].size = funcs[i].size;
+		names[i] = funcs[i].name;
+	}
+	// A PLT entry must never be left pointing at a copy that's not part of the link anymore.
+	for (u64 i = 0; i < num_old && ok; i++)
+		ok = matched[i] || !manifest.funcs[i].plt_addr;
+	if (!ok)
+		goto done;
+
+	// Find out which functions changed, before touching anything.
+	for (size i = 0; i < num_funcs && ok; i++)
+	{
+		u8* buf = malloc(entries[i].slot ? entries[i].slot : 1);
+		memset(buf, 0x90, entries[i].slot); // nop
+		ok = patch_code(session, i, manifest.header->sect_addr, buf);
+		const u64 hash = relink_hash(buf, entries[i].slot);
+		if (ok && hash != entries[i].hash)
+		{
+			entries[i].hash = hash;
+			code[i] = buf;
+			num_changed++;
+		}
+		else
+			free(buf);
+	}
+
+	// Functions that share a copy have to stay identical, otherwise they need copies of their own.
+	for (size i = 0; i < num_funcs; i++)
+		by_offset[i] = i;
+	qsort_r(by_offset, num_funcs, sizeof(u64), relink_cmp_offset, funcs);
+	for (size i = 1; i < num_funcs && ok; i++)
+	{
+		const u64 a = by_offset[i - 1], b = by_offset[i];
+		ok = funcs[a].offset != funcs[b].offset || entries[a].hash == entries[b].hash;
+		if (!ok)
+			log_msg(LOG_INFO, "[%s] \"%s\" and \"%s\" aren't identical anymore, relinking from scratch...\n",
+				basename(output), funcs[a].name, funcs[b].name);
+	}
+	if (!ok)
+		goto done;
+
+	// Write just the functions that changed.
+	const stats_clock start = stats_start();
+	fd = ok && num_changed ? open(output, O_WRONLY | O_CLOEXEC) : -1;
+	ok = ok && (!num_changed || fd >= 0);
+	for (size i = 0; i < num_funcs && ok; i++)
+	{
+		if (!code[i])
+			continue;
+		ok = pwrite(fd, code[i], entries[i].slot, manifest.header->sect_offset + entries[i].offset) == (ssize_t)entries[i].slot;
+		stats_count(STATS_BYTES_WRITTEN, ok ? entries[i].slot : 0);
+	}
+	if (fd >= 0)
+		close(fd);
+	stats_stop(STATS_WRITE, start);
+	if (!ok)
+	{
+		log_msg(LOG_WARN, "[%s] couldn't update in place, relinking from scratch...\n", basename(output));
+		goto done;
+	}
+
+	relink_store(output, files, num_files, manifest.header->sect_addr, manifest.header->sect_offset, entries, names, num_funcs);
+	log_msg(LOG_INFO, _GREEN "updated %zu of %zu functions of \"%s\" in place\n", num_changed, num_funcs, output);
+
+done:
+	for (size i = 0; i < num_funcs; i++)
+		free(code[i]);
+	free(code);
+	free(by_offset);
+	free(names);
+	free(entries);
+	free(matched);
+	free(order);
+	free(files);
+	free(manifest.data);
+	return ok;
+}
+
+void relink_record(patch_session* session, const elf_obj* target, const resolve_index* index, const str output)
+{
+	if (!session || !target || !index || !output)
+		return;
+	const elf_section* sect = elf_section_get(target, ".solink");
+	if (!sect || !sect->data)
+		return;
+
+	// The layout is planned before writing, so `.solink` ends up exactly where its header says.
+	const u64 sect_offset = sect->header.sh_offset;
+
+	const u16 num_files = index->num_libs + 1;
+	str* files = malloc(num_files * sizeof(str));
+	for (u16 i = 0; i < index->num_libs; i++)
+		files[i] = index->libs[i].file_name;
+	files[index->num_libs] = target->file_name;
+
+	// Each function can grow up to where the next copy in the section starts, which needn't be the next one found.
+	// Folded functions share their copy and its slot.
+	size num_funcs;
+	const patch_func* funcs = patch_funcs(session, &num_funcs);
+	relink_func* entries = calloc(num_funcs ? num_funcs : 1, sizeof(relink_func));
+	str* names = calloc(num_funcs ? num_funcs : 1, sizeof(str));
+	u64* order = calloc(num_funcs ? num_funcs : 1, sizeof(u64));
+	u64* ends = calloc(num_funcs ? num_funcs : 1, sizeof(u64));
+	for (u64 i = 0; i < num_funcs; i++)
+		order[i] = i;
+	qsort_r(order, num_funcs, sizeof(u64), relink_cmp_offset, (void*)funcs);
+	for (size i = num_funcs; i-- > 0;)
+	{
+		const bool shared = i + 1 < num_funcs && funcs[order[i + 1]].offset == funcs[order[i]].offset;
+		ends[order[i]] = shared ? ends[order[i + 1]] : i + 1 < num_funcs ? funcs[order[i + 1]].offset : sect->header.sh_size;
+	}
+	for (size i = 0; i < num_funcs; i++)
+	{
+		const u64 end = ends[i];
+		entries[i] = (relink_func) {
+			.lib = funcs[i].lib,
+			.offset = funcs[i].offset,
+			.slot = end - funcs[i].offset,
+			.size = funcs[i].size,
+			.plt_addr = funcs[i].plt_addr,
+			.hash = relink_hash(sect->data + funcs[i].offset, end - funcs[i].offset),
+		};
+		names[i] = funcs[i].name;
+	}
+	relink_store(output, files, num_files, sect->header.sh_addr, sect_offset, entries, names, num_funcs);
+
+	free(ends);
+	free(order);
+	free(names);
+	free(entries);
+	free(files);
+}
+
+// Adds a watch for the directory of a file. Files get replaced by renames, so watching them directly isn't enough.
+static i32 relink_watch_dir(i32 fd, const str file)
+{
+	str copy = strdup(file);
+	const i32 wd = inotify_add_watch(fd, dirname(copy), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+	free(copy);
+	return wd;
+}
+
+// Checks if an event is about one of the watched files.
+static bool relink_watch_match(const struct inotify_event* event, const i32* wds, const str* files, u16 num_files)
+{
+	if (!event->len)
+		return false;
+	for (u16 i = 0; i < num_files; i++)
+	{
+		const str name = strrchr(files[i], '/');
+		if (wds[i] == event->wd && !strcmp(name ? name + 1 : files[i], event->name))
+			return true;
+	}
+	return false;
+}
+
+bool relink_watch(const str* files, u16 num_files, bool (*link)(void))
+{
+	if (!files || !link)
+		return log_msg(LOG_WARN, "couldn't watch files, no files or link given!\n");
+
+	const i32 fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0)
+		return log_msg(LOG_WARN, "couldn't watch files: %s\n", strerror(errno));
+	i32* wds = calloc(num_files, sizeof(i32));
+	for (u16 i = 0; i < num_files; i++)
+	{
+		if ((wds[i] = relink_watch_dir(fd, files[i])) < 0)
+		{
+			log_msg(LOG_WARN, "couldn't watch \"%s\": %s\n", files[i], strerror(errno));
+			free(wds);
+			close(fd);
+			return false;
+		}
+	}
+
+	// Events have to be aligned for `struct inotify_event`.
+	_Alignas(struct inotify_event) char buf[4096];
+	for (;;)
+	{
+		// Errors of a link must not end the loop.
+		log_capture_begin();
+		link();
+		void* logs;
+		log_capture_end(&logs);
+		log_replay(logs);
+		log_msg(LOG_INFO, "watching %hu files for changes...\n", num_files);
+		// Output may be piped to another tool that's waiting for this round to finish.
+		fflush(stdout);
+
+		// Wait for a change, then until the files settle down, so a library that's still being written isn't read.
+		bool changed = false;
+		i32 timeout = -1;
+		for (;;)
+		{
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			const i32 ready = poll(&pfd, 1, timeout);
+			if (ready < 0 && errno == EINTR)
+				continue;
+			if (ready < 0)
+				break;
+			if (ready == 0)
+				break;
+			const ssize_t len = read(fd, buf, sizeof(buf));
+			if (len <= 0)
+				break;
+			for (ssize_t pos = 0; pos < len;)
+			{
+				const struct inotify_event* event = (const struct inotify_event*)(buf + pos);
+				changed |= relink_watch_match(event, wds, files, num_files);
+				pos += sizeof(struct inotify_event) + event->len;
+			}
+			if (changed)
+				timeout = RELINK_SETTLE_MS;
+		}
+		if (!changed)
+			break;
+		log_msg(LOG_INFO, "files changed, relinking...\n");
+	}
+
+	log_msg(LOG_WARN, "stopped watching files: %s\n", strerror(errno));
+	free(wds);
+	close(fd);
+	return false;
+}
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <resolve.h>
+#include <log.h>
+#include <stats.h>
+
+resolve_lib resolve_lib_exports(const elf_obj* lib)
+{
+	resolve_lib result = {0};
+	if (!lib)
+	{
+		log_msg(LOG_ERR, "couldn't collect exported symbols, no library given!\n");
+		return result;
+	}
+	size num_sym, strtab_size;
+	str strtab;
+	const stats_clock start = stats_start();
+	elf_symtab* syms = elf_dynsym_table(lib, &num_sym, &strtab, &strtab_size);
+	if (!syms)
+		return result;
+
+	result.syms = calloc(num_sym, sizeof(resolve_sym));
+	for (size i = 0; i < num_sym; i++)
+	{
+		elf_symtab* sym = syms + i;
+		// Only export defined symbols with info == STB_GLOBAL | STB_FUNC
+		if (sym->sym_info != 0x12 || sym->sym_shndx == 0 || sym->sym_name >= strtab_size)
+			continue;
+
+		resolve_sym* cur = result.syms + result.num_syms++;
+		cur->name = strtab + sym->sym_name;
+		cur->hash = elf_gnu_hash(cur->name);
+		cur->sym = sym;
+	}
+	stats_stop(STATS_RESOLVE, start);
+	return result;
+}
+
+void resolve_lib_free(resolve_lib* exports)
+{
+	if (!exports) return;
+	free(exports->syms);
+	if (exports->cache)
+		munmap(exports->cache, exports->cache_size);
+	memset(exports, 0, sizeof(resolve_lib));
+}
+
+// Finds the slot for a name, either the one holding it or the empty one it would go into.
+static resolve_entry* resolve_slot(const resolve_index* index, const str name, u32 hash)
+{
+	const size mask = index->cap - 1;
+	for (size i = hash & mask;; i = (i + 1) & mask)
+	{
+		resolve_entry* entry = index->entries + i;
+		if (!entry->name || (entry->hash == hash && !strcmp(entry->name, name)))
+			return entry;
+	}
+}
+
+resolve_index resolve_build(elf_obj* libs, const resolve_lib* exports, u16 num_libs)
+{
+	resolve_index index = {0};
+	if (!exports && num_libs)
+	{
+		log_msg(LOG_ERR, "couldn't build resolution index, no symbols given!\n");
+		return index;
+	}
+	index.libs = libs;
+	index.num_libs = num_libs;
+	const stats_clock start = stats_start();
+
+	// Keep the load factor at or below 50%.
+	size total = 0;
+	for (u16 lib = 0; lib < num_libs; lib++)
+		total += exports[lib].num_syms;
+	index.cap = 16;
+	while (index.cap < total * 2)
+		index.cap *= 2;
+	index.entries = calloc(index.cap, sizeof(resolve_entry));
+
+	// Insert libraries in order, so the first library providing a symbol always wins.
+	for (u16 lib = 0; lib < num_libs; lib++)
+	{
+		for (size i = 0; i < exports[lib].num_syms; i++)
+		{
+			const resolve_sym* sym = exports[lib].syms + i;
+			resolve_entry* entry = resolve_slot(&index, sym->name, sym->hash);
+			if (entry->name)
+			{
+				// Another library already provides this symbol.
+				if (entry->lib != lib && entry->conflict == -1)
+					entry->conflict = lib;
+				continue;
+			}
+			entry->name = sym->name;
+			entry->hash = sym->hash;
+			entry->lib = lib;
+			entry->conflict = -1;
+			entry->sym = sym->sym;
+			index.num_entries++;
+		}
+	}
+	stats_stop(STATS_RESOLVE, start);
+	return index;
+}
+
+const resolve_entry* resolve_find(const resolve_index* index, const str name)
+{
+	if (!index)
+	{
+		log_msg(LOG_ERR, "couldn't resolve symbol \"%s\", no index given!\n", name);
+		return NULL;
+	}
+	if (!name)
+	{
+		log_msg(LOG_ERR, "couldn't resolve symbol, no name given!\n");
+		return NULL;
+	}
+	stats_count(STATS_LOOKUPS, 1);
+	if (!index->entries)
+		return NULL;
+
+	const resolve_entry* entry = resolve_slot(index, name, elf_gnu_hash(name));
+	return entry->name ? entry : NULL;
+}
+
+void resolve_free(resolve_index* index)
+{
+	if (!index) return;
+	free(index->entries);
+	memset(index, 0, sizeof(resolve_index));
+}
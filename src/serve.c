@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <serve.h>
+#include <args.h>
+#include <batch.h>
+#include <cache.h>
+#include <load.h>
+#include <resolve.h>
+#include <log.h>
+
+#define SERVE_MAGIC 0x524b4c53 // "SLKR"
+#define SERVE_VERSION 1
+#define SERVE_PATH_MAX 4096
+// Frame kind that ends a response, its payload is the exit status.
+#define SERVE_STATUS 2
+
+// A request is:
+//   serve_request
+//   u32         lengths[num_files + 1], output first
+//   char        paths[], without terminators
+// A response is any amount of frames, the last one being of kind `SERVE_STATUS`.
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	u32 num_files;
+} serve_request;
+
+typedef struct
+{
+	/// A `log_level` or `SERVE_STATUS`.
+	i32 kind;
+	u32 len;
+} serve_frame;
+
+// A set of libraries that has been loaded and indexed together.
+typedef struct serve_set
+{
+	struct serve_set* next;
+	u16 num_libs;
+	str* files;
+	cache_stamp* stamps;
+	elf_obj* libs;
+	resolve_lib* exports;
+	resolve_index index;
+	/// The amount of requests currently using this set.
+	u32 refs;
+	/// Set once a library changed, the set gets freed when the last request is done with it.
+	bool stale;
+	/// Set while the first request reads the libraries, others wait on `loaded` instead of reading them again.
+	bool loading;
+	/// Set if the libraries couldn't be read.
+	bool failed;
+	pthread_cond_t loaded;
+} serve_set;
+
+static pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+static serve_set* serve_sets = NULL;
+
+static void serve_set_free(serve_set* set)
+{
+	resolve_free(&set->index);
+	for (u16 i = 0; i < set->num_libs; i++)
+	{
+		resolve_lib_free(set->exports + i);
+		elf_free(set->libs + i);
+		free(set->files[i]);
+	}
+	pthread_cond_destroy(&set->loaded);
+	free(set->files);
+	free(set->stamps);
+	free(set->libs);
+	free(set->exports);
+	free(set);
+}
+
+// Creates an empty set for the given libraries, to be filled by `serve_set_load`.
+static serve_set* serve_set_new(const str* files, u16 num_libs)
+{
+	serve_set* set = calloc(1, sizeof(serve_set));
+	set->num_libs = num_libs;
+	set->files = calloc(num_libs, sizeof(str));
+	set->stamps = calloc(num_libs, sizeof(cache_stamp));
+	set->libs = calloc(num_libs, sizeof(elf_obj));
+	set->exports = calloc(num_libs, sizeof(resolve_lib));
+	for (u16 i = 0; i < num_libs; i++)
+		set->files[i] = strdup(files[i]);
+	pthread_cond_init(&set->loaded, NULL);
+	return set;
+}
+
+// Reads and indexes the libraries of a set. Returns `false` if any of them couldn't be loaded.
+static bool serve_set_load(serve_set* set)
+{
+	for (u16 i = 0; i < set->num_libs; i++)
+	{
+		// Stamp before reading, so a change during the read invalidates the set next time.
+		if (!cache_stamp_get(set->files[i], set->stamps + i))
+			return log_msg(LOG_ERR, "\"%s\": %s\n", set->files[i], strerror(errno));
+	}
+
+	// Requests share the libraries concurrently, so everything has to be read up front.
+	bool* required = malloc(set->num_libs * sizeof(bool));
+	memset(required, 1, set->num_libs * sizeof(bool));
+	const bool ok = load_files(set->files, set->num_libs, set->num_libs, ARGS.jobs, set->libs, set->exports) &&
+		load_required(set->files, set->num_libs, required, ARGS.jobs, set->libs);
+	free(required);
+	if (ok)
+		set->index = resolve_build(set->libs, set->exports, set->num_libs);
+	return ok;
+}
+
+// Takes a set out of the list, so no new request finds it. Must be called with `serve_lock` held.
+static void serve_set_unlink(serve_set* set)
+{
+	for (serve_set** it = &serve_sets; *it; it = &(*it)->next)
+	{
+		if (*it == set)
+		{
+			*it = set->next;
+			break;
+		}
+	}
+	set->stale = true;
+}
+
+static void serve_set_release(serve_set* set)
+{
+	pthread_mutex_lock(&serve_lock);
+	if (--set->refs == 0 && set->stale)
+		serve_set_free(set);
+	pthread_mutex_unlock(&serve_lock);
+}
+
+// Finds an up to date set for the given libraries, or loads a new one.
+// Only the lookup happens under `serve_lock`, so a slow load doesn't hold up requests for other sets.
+static serve_set* serve_set_acquire(const str* files, u16 num_libs)
+{
+	pthread_mutex_lock(&serve_lock);
+	serve_set* set = NULL;
+	for (serve_set* cur = serve_sets; cur; cur = cur->next)
+	{
+		if (cur->num_libs != num_libs)
+			continue;
+		bool same = true;
+		for (u16 i = 0; i < num_libs && same; i++)
+			same = !strcmp(cur->files[i], files[i]);
+		if (!same)
+			continue;
+
+		// Drop the set if any library changed since it was loaded. One that is still loading was just stamped.
+		for (u16 i = 0; i < num_libs && !cur->loading && !cur->stale; i++)
+		{
+			cache_stamp stamp;
+			cur->stale = !cache_stamp_get(files[i], &stamp) || memcmp(&stamp, cur->stamps + i, sizeof(stamp));
+		}
+		if (cur->stale)
+		{
+			log_msg(LOG_INFO, "libraries changed, reloading them...\n");
+			serve_set_unlink(cur);
+			if (!cur->refs)
+				serve_set_free(cur);
+		}
+		else
+			set = cur;
+		break;
+	}
+
+	if (set)
+	{
+		set->refs++;
+		// Another request is reading these libraries already, wait for it instead of reading them again.
+		while (set->loading)
+			pthread_cond_wait(&set->loaded, &serve_lock);
+		pthread_mutex_unlock(&serve_lock);
+		if (set->failed)
+		{
+			serve_set_release(set);
+			log_msg(LOG_ERR, "failed to load all libraries!\n");
+			return NULL;
+		}
+		return set;
+	}
+
+	// Put the set in place before loading it, so requests for the same libraries find it and wait.
+	set = serve_set_new(files, num_libs);
+	set->refs = 1;
+	set->loading = true;
+	set->next = serve_sets;
+	serve_sets = set;
+	pthread_mutex_unlock(&serve_lock);
+
+	const bool ok = serve_set_load(set);
+
+	pthread_mutex_lock(&serve_lock);
+	set->loading = false;
+	set->failed = !ok;
+	// A failed set is gone once the requests waiting for it are done, the next one tries again.
+	if (!ok)
+		serve_set_unlink(set);
+	pthread_cond_broadcast(&set->loaded);
+	pthread_mutex_unlock(&serve_lock);
+	if (!ok)
+	{
+		serve_set_release(set);
+		return NULL;
+	}
+	return set;
+}
+
+static bool serve_read(i32 fd, void* buf, size len)
+{
+	for (size done = 0; done < len;)
+	{
+		const ssize_t n = read(fd, (u8*)buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool serve_write(i32 fd, const void* buf, size len)
+{
+	for (size done = 0; done < len;)
+	{
+		const ssize_t n = write(fd, (const u8*)buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static void serve_send_frame(i32 fd, i32 kind, const void* data, u32 len)
+{
+	const serve_frame frame = { kind, len };
+	// If the client is gone, there's nobody to report to anyway.
+	if (serve_write(fd, &frame, sizeof(frame)))
+		serve_write(fd, data, len);
+}
+
+static void serve_send_log(log_level level, const str text, void* arg)
+{
+	serve_send_frame(*(i32*)arg, level, text, strlen(text));
+}
+
+// Reads a request. The first path is the output, followed by all libraries and the target.
+static str* serve_read_request(i32 fd, u32* num_paths)
+{
+	serve_request req;
+	if (!serve_read(fd, &req, sizeof(req)) || req.magic != SERVE_MAGIC || req.version != SERVE_VERSION ||
+		req.num_files < 2 || req.num_files > UINT16_MAX)
+		return NULL;
+
+	*num_paths = req.num_files + 1;
+	u32* lens = calloc(*num_paths, sizeof(u32));
+	str* paths = calloc(*num_paths, sizeof(str));
+	bool ok = serve_read(fd, lens, *num_paths * sizeof(u32));
+	for (u32 i = 0; ok && i < *num_paths; i++)
+	{
+		ok = lens[i] > 0 && lens[i] < SERVE_PATH_MAX;
+		paths[i] = ok ? calloc(lens[i] + 1, 1) : NULL;
+		ok = ok && serve_read(fd, paths[i], lens[i]);
+	}
+	free(lens);
+	if (!ok)
+	{
+		for (u32 i = 0; i < *num_paths; i++)
+			free(paths[i]);
+		free(paths);
+		return NULL;
+	}
+	return paths;
+}
+
+static void* serve_conn(void* arg)
+{
+	const i32 fd = (i32)(intptr_t)arg;
+	u32 num_paths;
+	str* paths = serve_read_request(fd, &num_paths);
+	if (!paths)
+	{
+		close(fd);
+		return NULL;
+	}
+	const str output = paths[0];
+	const str* libs = paths + 1;
+	const u16 num_libs = (u16)(num_paths - 2);
+	const str target_path = paths[num_paths - 1];
+
+	// Everything that happens for this request gets sent to the client instead of our output.
+	log_capture_begin();
+	serve_set* set = serve_set_acquire(libs, num_libs);
+	if (set)
+	{
+		elf_obj target = elf_read(target_path);
+		if (target.map)
+			batch_link_one(&target, &set->index, output);
+		elf_free(&target);
+		serve_set_release(set);
+	}
+	void* logs;
+	const i32 status = log_capture_end(&logs) && set ? 0 : 1;
+	log_drain(logs, serve_send_log, (void*)&fd);
+	serve_send_frame(fd, SERVE_STATUS, &status, sizeof(status));
+
+	close(fd);
+	for (u32 i = 0; i < num_paths; i++)
+		free(paths[i]);
+	free(paths);
+	return NULL;
+}
+
+static bool serve_address(const str socket, struct sockaddr_un* addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socket) >= sizeof(addr->sun_path))
+		return log_msg(LOG_ERR, "socket path \"%s\" is too long!\n", socket);
+	strcpy(addr->sun_path, socket);
+	return true;
+}
+
+bool serve_run(const str socket_path)
+{
+	struct sockaddr_un addr;
+	if (!socket_path || !serve_address(socket_path, &addr))
+		return log_msg(LOG_ERR, "couldn't start server, no socket given!\n");
+
+	// A client that hangs up early must not take the server down with it.
+	signal(SIGPIPE, SIG_IGN);
+
+	const i32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return log_msg(LOG_ERR, "couldn't create socket: %s\n", strerror(errno));
+	// Replace a socket left behind by a previous server, but nothing else.
+	struct stat st;
+	if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socket_path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+	{
+		close(fd);
+		return log_msg(LOG_ERR, "couldn't listen on \"%s\": %s\n", socket_path, strerror(errno));
+	}
+	log_msg(LOG_INFO, "listening on \"%s\"...\n", socket_path);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;)
+	{
+		const i32 conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, serve_conn, (void*)(intptr_t)conn) != 0)
+		{
+			log_msg(LOG_WARN, "couldn't handle a request: %s\n", strerror(errno));
+			close(conn);
+		}
+	}
+	log_msg(LOG_WARN, "stopped accepting requests: %s\n", strerror(errno));
+	pthread_attr_destroy(&attr);
+	close(fd);
+	return false;
+}
+
+bool serve_client(const str socket_path, const str* files, u16 num_files, const str output)
+{
+	struct sockaddr_un addr;
+	if (!socket_path || !files || !output || !serve_address(socket_path, &addr))
+		return log_msg(LOG_ERR, "couldn't send request, no socket, files or output given!\n");
+
+	const i32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+		return log_msg(LOG_ERR, "couldn't connect to \"%s\": %s\n", socket_path, strerror(errno));
+
+	// Send the paths, output first.
+	const serve_request req = { SERVE_MAGIC, SERVE_VERSION, num_files };
+	u32* lens = calloc(num_files + 1, sizeof(u32));
+	lens[0] = strlen(output);
+	for (u16 i = 0; i < num_files; i++)
+		lens[i + 1] = strlen(files[i]);
+	bool ok = serve_write(fd, &req, sizeof(req)) && serve_write(fd, lens, (num_files + 1) * sizeof(u32)) &&
+		serve_write(fd, output, lens[0]);
+	for (u16 i = 0; ok && i < num_files; i++)
+		ok = serve_write(fd, files[i], lens[i + 1]);
+	free(lens);
+
+	// Print everything the server reports, until it sends the result.
+	i32 status = 1;
+	bool done = false;
+	while (ok && !done)
+	{
+		serve_frame frame;
+		ok = serve_read(fd, &frame, sizeof(frame));
+		if (!ok)
+			break;
+		if (frame.kind == SERVE_STATUS)
+		{
+			ok = frame.len == sizeof(status) && serve_read(fd, &status, sizeof(status));
+			done = true;
+			continue;
+		}
+		str text = malloc((size)frame.len + 1);
+		ok = serve_read(fd, text, frame.len);
+		text[frame.len] = '\0';
+		// Errors of the server are reported, but only the final status decides if we failed.
+		if (ok)
+		{
+			log_capture_begin();
+			log_msg(frame.kind, "%s", text);
+			void* buf;
+			log_capture_end(&buf);
+			log_replay(buf);
+		}
+		free(text);
+	}
+	close(fd);
+
+	if (!ok || !done)
+		return log_msg(LOG_ERR, "lost the connection to \"%s\"!\n", socket_path);
+	return status == 0;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/resource.h>
+
+#include <stats.h>
+#include <args.h>
+
+#define STATS_NS 1000000000ull
+
+static const str stats_phase_names[STATS_NUM_PHASES] = {
+	"args", "read", "resolve", "link", "layout", "write",
+};
+
+static const str stats_counter_names[STATS_NUM_COUNTERS] = {
+	"symbols_resolved", "symbols_unresolved", "lookups", "bytes_read", "bytes_copied", "bytes_written",
+	"sections_added", "segments_added", "calls_rewritten", "imports_bound", "functions_folded", "allocations", "allocation_blocks",
+};
+
+typedef struct
+{
+	str path;
+	u64 bytes;
+	u64 wall;
+	u64 cpu;
+} stats_file_time;
+
+// Time spent in every phase, in nanoseconds.
+static atomic_ullong stats_wall[STATS_NUM_PHASES];
+static atomic_ullong stats_cpu[STATS_NUM_PHASES];
+static atomic_ullong stats_counters[STATS_NUM_COUNTERS];
+
+// Files get read on several threads at once.
+static pthread_mutex_t stats_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_file_time* stats_files = NULL;
+static size stats_num_files = 0;
+static size stats_files_cap = 0;
+
+// When recording started, to report the total.
+static u64 stats_origin_wall = 0;
+static u64 stats_origin_cpu = 0;
+
+static u64 stats_clock_ns(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (u64)ts.tv_sec * STATS_NS + (u64)ts.tv_nsec;
+}
+
+// CPU time of all threads of the process.
+static u64 stats_process_cpu(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return ((u64)usage.ru_utime.tv_sec + (u64)usage.ru_stime.tv_sec) * STATS_NS +
+		((u64)usage.ru_utime.tv_usec + (u64)usage.ru_stime.tv_usec) * 1000;
+}
+
+stats_clock stats_start(void)
+{
+	// Always take the time, since parsing the arguments is timed before the flag is known.
+	return (stats_clock) { stats_clock_ns(CLOCK_MONOTONIC), stats_clock_ns(CLOCK_THREAD_CPUTIME_ID) };
+}
+
+void stats_stop(stats_phase phase, stats_clock start)
+{
+	if (!ARGS.stats)
+		return;
+	atomic_fetch_add_explicit(stats_wall + phase, stats_clock_ns(CLOCK_MONOTONIC) - start.wall, memory_order_relaxed);
+	atomic_fetch_add_explicit(stats_cpu + phase, stats_clock_ns(CLOCK_THREAD_CPUTIME_ID) - start.cpu, memory_order_relaxed);
+}
+
+void stats_file(const str file, u64 bytes, stats_clock start)
+{
+	if (!ARGS.stats)
+		return;
+	const stats_file_time time = {
+		.path = strdup(file),
+		.bytes = bytes,
+		.wall = stats_clock_ns(CLOCK_MONOTONIC) - start.wall,
+		.cpu = stats_clock_ns(CLOCK_THREAD_CPUTIME_ID) - start.cpu,
+	};
+
+	pthread_mutex_lock(&stats_files_lock);
+	if (stats_num_files == stats_files_cap)
+	{
+		stats_files_cap = stats_files_cap ? stats_files_cap * 2 : 16;
+		stats_files = reallocarray(stats_files, stats_files_cap, sizeof(stats_file_time));
+	}
+	stats_files[stats_num_files++] = time;
+	pthread_mutex_unlock(&stats_files_lock);
+}
+
+void stats_count(stats_counter counter, u64 num)
+{
+	if (ARGS.stats)
+		atomic_fetch_add_explicit(stats_counters + counter, num, memory_order_relaxed);
+}
+
+// Writes a string as a JSON string literal.
+static void stats_json_str(const str s)
+{
+	putchar('"');
+	for (size i = 0; s[i]; i++)
+	{
+		if (s[i] == '"' || s[i] == '\\')
+			printf("\\%c", s[i]);
+		else if ((u8)s[i] < 0x20)
+			printf("\\u%04x", (u8)s[i]);
+		else
+			putchar(s[i]);
+	}
+	putchar('"');
+}
+
+void stats_report(bool json)
+{
+	const f64 total_wall = (stats_clock_ns(CLOCK_MONOTONIC) - stats_origin_wall) / 1e6;
+	const f64 total_cpu = (stats_process_cpu() - stats_origin_cpu) / 1e6;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	const u64 peak_rss = (u64)usage.ru_maxrss * 1024; // Reported in KiB.
+
+	pthread_mutex_lock(&stats_files_lock);
+	if (json)
+	{
+		printf("{\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"peak_rss_bytes\":%lu,\"phases\":{", total_wall, total_cpu, peak_rss);
+		for (u32 p = 0; p < STATS_NUM_PHASES; p++)
+		{
+			printf("%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", p ? "," : "", stats_phase_names[p],
+				atomic_load(stats_wall + p) / 1e6, atomic_load(stats_cpu + p) / 1e6);
+		}
+		printf("},\"files\":[");
+		for (size i = 0; i < stats_num_files; i++)
+		{
+			printf("%s{\"path\":", i ? "," : "");
+			stats_json_str(stats_files[i].path);
+			printf(",\"bytes\":%lu,\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+				stats_files[i].bytes, stats_files[i].wall / 1e6, stats_files[i].cpu / 1e6);
+		}
+		printf("],\"counters\":{");
+		for (u32 c = 0; c < STATS_NUM_COUNTERS; c++)
+			printf("%s\"%s\":%llu", c ? "," : "", stats_counter_names[c], atomic_load(stats_counters + c));
+		printf("}}\n");
+	}
+	else
+	{
+		printf("%-20s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+		for (u32 p = 0; p < STATS_NUM_PHASES; p++)
+		{
+			printf("%-20s %12.3f %12.3f\n", stats_phase_names[p],
+				atomic_load(stats_wall + p) / 1e6, atomic_load(stats_cpu + p) / 1e6);
+		}
+		printf("%-20s %12.3f %12.3f\n", "total", total_wall, total_cpu);
+		for (size i = 0; i < stats_num_files; i++)
+		{
+			printf("  %-18s %12.3f %12.3f %12lu bytes\n", basename(stats_files[i].path),
+				stats_files[i].wall / 1e6, stats_files[i].cpu / 1e6, stats_files[i].bytes);
+		}
+		for (u32 c = 0; c < STATS_NUM_COUNTERS; c++)
+			printf("%-20s %12llu\n", stats_counter_names[c], atomic_load(stats_counters + c));
+		printf("%-20s %12lu\n", "peak_rss_bytes", peak_rss);
+	}
+	pthread_mutex_unlock(&stats_files_lock);
+	fflush(stdout);
+}
+
+void stats_reset(void)
+{
+	for (u32 p = 0; p < STATS_NUM_PHASES; p++)
+	{
+		atomic_store(stats_wall + p, 0);
+		atomic_store(stats_cpu + p, 0);
+	}
+	for (u32 c = 0; c < STATS_NUM_COUNTERS; c++)
+		atomic_store(stats_counters + c, 0);
+
+	pthread_mutex_lock(&stats_files_lock);
+	for (size i = 0; i < stats_num_files; i++)
+		free(stats_files[i].path);
+	stats_num_files = 0;
+	pthread_mutex_unlock(&stats_files_lock);
+
+	stats_origin_wall = stats_clock_ns(CLOCK_MONOTONIC);
+	stats_origin_cpu = stats_process_cpu();
+}
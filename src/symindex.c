@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <symindex.h>
+#include <log.h>
+
+#ifdef SOLINK_ARCH_x86_64
+#include <immintrin.h>
+#endif
+
+// Symbols of the bindings STB_GLOBAL, STB_WEAK and STB_GNU_UNIQUE can be looked up, STB_LOCAL ones can't.
+#define SYMINDEX_BIND_MASK 0xf0
+
+static size symindex_scan_scalar(const symindex* index, size block, u32 hash, u32* mask)
+{
+	for (; block < index->num_blocks; block++)
+	{
+		const size base = block * SYMINDEX_BLOCK;
+		u32 found = 0;
+		for (u32 i = 0; i < SYMINDEX_BLOCK; i++)
+			found |= (u32)(index->hashes[base + i] == hash && (index->info[base + i] & SYMINDEX_BIND_MASK)) << i;
+		if (found)
+		{
+			*mask = found;
+			return block;
+		}
+	}
+	return block;
+}
+
+#ifdef SOLINK_ARCH_x86_64
+// Gets a bit for every symbol of a block that's local or undefined.
+static inline u32 symindex_local_sse2(const u8* info)
+{
+	const __m128i bind = _mm_and_si128(_mm_loadl_epi64((const __m128i*)info), _mm_set1_epi8((char)SYMINDEX_BIND_MASK));
+	return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(bind, _mm_setzero_si128())) & 0xff;
+}
+
+static size symindex_scan_sse2(const symindex* index, size block, u32 hash, u32* mask)
+{
+	const __m128i needle = _mm_set1_epi32((i32)hash);
+	for (; block < index->num_blocks; block++)
+	{
+		const size base = block * SYMINDEX_BLOCK;
+		const __m128i lo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)(index->hashes + base)), needle);
+		const __m128i hi = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)(index->hashes + base + 4)), needle);
+		const u32 equal = (u32)_mm_movemask_ps(_mm_castsi128_ps(lo)) | ((u32)_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+		if (!equal)
+			continue;
+		const u32 found = equal & ~symindex_local_sse2(index->info + base);
+		if (found)
+		{
+			*mask = found;
+			return block;
+		}
+	}
+	return block;
+}
+
+__attribute__((target("avx2")))
+static size symindex_scan_avx2(const symindex* index, size block, u32 hash, u32* mask)
+{
+	const __m256i needle = _mm256_set1_epi32((i32)hash);
+	for (; block < index->num_blocks; block++)
+	{
+		const size base = block * SYMINDEX_BLOCK;
+		const __m256i eq = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i*)(index->hashes + base)), needle);
+		const u32 equal = (u32)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+		if (!equal)
+			continue;
+		const u32 found = equal & ~symindex_local_sse2(index->info + base);
+		if (found)
+		{
+			*mask = found;
+			return block;
+		}
+	}
+	return block;
+}
+#endif
+
+symindex* symindex_build(const elf_symtab* syms, size num_syms, const str strtab, size strtab_size)
+{
+	if (!syms || !strtab)
+	{
+		log_msg(LOG_ERR, "couldn't index symbols, no symbols or string table given!\n");
+		return NULL;
+	}
+
+	// Everything lives in one allocation. The hashes come first, so vector loads of them are always aligned.
+	const size num_blocks = (num_syms + SYMINDEX_BLOCK - 1) / SYMINDEX_BLOCK;
+	const size padded = num_blocks * SYMINDEX_BLOCK;
+	const size hashes_len = padded * sizeof(u32);
+	const size total = sizeof(symindex) + hashes_len * 2 + padded;
+	u8* mem = aligned_alloc(32, ALIGN(total, 32) + 32);
+	symindex* index = (symindex*)mem;
+	index->num_syms = num_syms;
+	index->num_blocks = num_blocks;
+	index->hashes = (u32*)(mem + ALIGN(sizeof(symindex), 32));
+	index->names = index->hashes + padded;
+	index->info = (u8*)(index->names + padded);
+	memset(index->hashes, 0, hashes_len * 2 + padded);
+
+	for (size i = 0; i < num_syms; i++)
+	{
+		const elf_symtab* sym = syms + i;
+		if (sym->sym_shndx == 0 || sym->sym_name >= strtab_size)
+			continue;
+		index->hashes[i] = elf_gnu_hash(strtab + sym->sym_name);
+		index->info[i] = sym->sym_info;
+		index->names[i] = sym->sym_name;
+	}
+
+	index->scan = symindex_scan_scalar;
+#ifdef SOLINK_ARCH_x86_64
+	index->scan = __builtin_cpu_supports("avx2") ? symindex_scan_avx2 : symindex_scan_sse2;
+#endif
+	return index;
+}
+
+i64 symindex_find(const symindex* index, const str strtab, const str name)
+{
+	if (!index || !strtab || !name)
+		return -1;
+
+	const u32 hash = elf_gnu_hash(name);
+	u32 mask = 0;
+	for (size block = index->scan(index, 0, hash, &mask); block < index->num_blocks;
+		block = index->scan(index, block + 1, hash, &mask))
+	{
+		// Only the few symbols with the same hash get their names compared.
+		for (; mask; mask &= mask - 1)
+		{
+			const size i = block * SYMINDEX_BLOCK + (size)__builtin_ctz(mask);
+			if (!strcmp(strtab + index->names[i], name))
+				return (i64)i;
+		}
+	}
+	return -1;
+}
+
+void symindex_free(symindex* index)
+{
+	free(index);
+}
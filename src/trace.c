@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <trace.h>
+#include <arena.h>
+#include <args.h>
+#include <log.h>
+
+typedef struct
+{
+	str name;
+	str file;
+	str symbol;
+	u64 start;
+	u64 dur;
+} trace_event;
+
+// Events of a single thread. Buffers outlive their threads, so workers can exit before the trace gets written.
+typedef struct trace_buffer
+{
+	u32 tid;
+	size num_events;
+	size cap;
+	trace_event* events;
+	/// Copies of all file and symbol names, those may be gone by the time the trace gets written.
+	arena strs;
+	struct trace_buffer* next;
+} trace_buffer;
+
+static _Thread_local trace_buffer* trace_local = NULL;
+
+// Only taken once per thread, to register its buffer.
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer* trace_buffers = NULL;
+static u32 trace_num_threads = 0;
+
+// All timestamps are relative to the last reset.
+static u64 trace_origin = 0;
+
+static u64 trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static trace_buffer* trace_buffer_get(void)
+{
+	if (trace_local)
+		return trace_local;
+	trace_buffer* buf = calloc(1, sizeof(trace_buffer));
+	pthread_mutex_lock(&trace_lock);
+	buf->tid = ++trace_num_threads;
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	pthread_mutex_unlock(&trace_lock);
+	trace_local = buf;
+	return buf;
+}
+
+static str trace_strdup(trace_buffer* buf, const str s)
+{
+	if (!s)
+		return NULL;
+	const size len = strlen(s) + 1;
+	return memcpy(arena_alloc(&buf->strs, len), s, len);
+}
+
+u64 trace_begin(void)
+{
+	return ARGS.trace ? trace_now() : 0;
+}
+
+void trace_end(const str name, const str file, const str symbol, u64 start)
+{
+	if (!ARGS.trace)
+		return;
+	const u64 end = trace_now();
+	trace_buffer* buf = trace_buffer_get();
+	if (buf->num_events == buf->cap)
+	{
+		buf->cap = buf->cap ? buf->cap * 2 : 256;
+		buf->events = reallocarray(buf->events, buf->cap, sizeof(trace_event));
+	}
+	buf->events[buf->num_events++] = (trace_event) {
+		.name = name,
+		.file = trace_strdup(buf, file),
+		.symbol = trace_strdup(buf, symbol),
+		.start = start,
+		.dur = end - start,
+	};
+}
+
+// Writes a string as a JSON string literal.
+static void trace_json_str(FILE* f, const str s)
+{
+	fputc('"', f);
+	for (size i = 0; s[i]; i++)
+	{
+		if (s[i] == '"' || s[i] == '\\')
+			fprintf(f, "\\%c", s[i]);
+		else if ((u8)s[i] < 0x20)
+			fprintf(f, "\\u%04x", (u8)s[i]);
+		else
+			fputc(s[i], f);
+	}
+	fputc('"', f);
+}
+
+void trace_write(const str path)
+{
+	FILE* f = fopen(path, "w");
+	if (!f)
+	{
+		log_msg(LOG_WARN, "couldn't write trace to \"%s\": %s\n", path, strerror(errno));
+		return;
+	}
+
+	// Timestamps and durations are in microseconds.
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	bool first = true;
+	for (const trace_buffer* buf = trace_buffers; buf; buf = buf->next)
+	{
+		if (!buf->num_events)
+			continue;
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+			first ? "" : ",", buf->tid, buf->tid);
+		first = false;
+		for (size i = 0; i < buf->num_events; i++)
+		{
+			const trace_event* ev = buf->events + i;
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"solink\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+				ev->name, buf->tid, (ev->start - trace_origin) / 1e3, ev->dur / 1e3);
+			if (ev->file)
+			{
+				fprintf(f, "\"file\":");
+				trace_json_str(f, ev->file);
+			}
+			if (ev->symbol)
+			{
+				fprintf(f, "%s\"symbol\":", ev->file ? "," : "");
+				trace_json_str(f, ev->symbol);
+			}
+			fprintf(f, "}}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0)
+		log_msg(LOG_WARN, "couldn't write trace to \"%s\": %s\n", path, strerror(errno));
+}
+
+void trace_reset(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	for (trace_buffer* buf = trace_buffers; buf; buf = buf->next)
+	{
+		buf->num_events = 0;
+		arena_free(&buf->strs);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	trace_origin = trace_now();
+}
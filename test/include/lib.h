@@ -3,3 +3,7 @@
 int test_lib_add(int x, int y);
 int test_lib_mul(int x, int y);
 int test_lib_sub(int x, int y);
+int test_lib_square_sum(int x, int y);
+int test_lib_double(int x);
+int test_lib_count(void);
+int test_lib_total(int x);
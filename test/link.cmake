@@ -0,0 +1,23 @@
+# Links EXE against LIBS (comma separated) with SOLINK and the given FLAGS into OUTPUT,
+# then runs both and fails if the output differs.
+string(REPLACE "," ";" LIBS "${LIBS}")
+separate_arguments(FLAGS)
+
+execute_process(COMMAND ${SOLINK} -q --no-cache --no-incremental ${FLAGS} -o ${OUTPUT} ${LIBS} ${EXE}
+	RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "solink ${FLAGS} failed: ${result}")
+endif()
+file(CHMOD ${OUTPUT} PERMISSIONS OWNER_READ OWNER_WRITE OWNER_EXECUTE)
+
+execute_process(COMMAND ${EXE} OUTPUT_VARIABLE expected RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "${EXE} failed: ${result}")
+endif()
+execute_process(COMMAND ${OUTPUT} OUTPUT_VARIABLE actual RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "${OUTPUT} failed: ${result}")
+endif()
+if(NOT actual STREQUAL expected)
+	message(FATAL_ERROR "${OUTPUT} printed\n${actual}\ninstead of\n${expected}")
+endif()
@@ -1,5 +1,8 @@
 #include <lib.h>
 
+static int test_lib_calls;
+static int test_lib_sum;
+
 int test_lib_add(int x, int y)
 {
     return x + y;
@@ -9,3 +12,38 @@ int test_lib_mul(int x, int y)
 {
     return x * y;
 }
+
+// Only reachable through a direct call, so it has to be copied along.
+static __attribute__((noinline)) int test_lib_square(int x)
+{
+    return x * x;
+}
+
+int test_lib_square_sum(int x, int y)
+{
+    return test_lib_square(x) + test_lib_square(y);
+}
+
+// Ends in a tail call to another export.
+int test_lib_double(int x)
+{
+    return test_lib_add(x, x);
+}
+
+// Touches a global, which doesn't follow a copy.
+int test_lib_count(void)
+{
+    return ++test_lib_calls;
+}
+
+static __attribute__((noinline)) int test_lib_accumulate(int x)
+{
+    test_lib_sum += x;
+    return test_lib_sum;
+}
+
+// Only calls a function that touches a global.
+int test_lib_total(int x)
+{
+    return test_lib_accumulate(x);
+}
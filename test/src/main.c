@@ -7,5 +7,11 @@ int main(const int argc, const char** argv)
     printf("test_lib_add(3, 5) = %i\n", test_lib_add(3, 5));
     printf("test_lib_mul(2, 4) = %i\n", test_lib_mul(2, 4));
     printf("test_lib_sub(9, 1) = %i\n", test_lib_sub(9, 1));
+    printf("test_lib_square_sum(3, 4) = %i\n", test_lib_square_sum(3, 4));
+    printf("test_lib_double(21) = %i\n", test_lib_double(21));
+    test_lib_count();
+    printf("test_lib_count() = %i\n", test_lib_count());
+    test_lib_total(5);
+    printf("test_lib_total(7) = %i\n", test_lib_total(7));
     return 0;
 }